@@ -0,0 +1,437 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "InputLog.h"
+#include "CPU.h"
+#include "Common.h"
+#include "DiskDrive.h"
+#include "EventScheduler.h"
+#include "busmouse.h"
+#include "debug.h"
+#include "keyboard.h"
+#include "machine.h"
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDataStream>
+#include <QtCore/QList>
+
+//#define INPUTLOG_DEBUG
+
+static const char log_magic[4] = { 'C', 'T', 'I', 'L' };
+static const u16 log_version = 1;
+
+// How often a recording is flushed to disk, in host milliseconds.
+static const i64 flush_interval_ms = 1000;
+
+// Every recording log, so that hard_exit() can still flush them.
+static QMutex s_logs_lock;
+static QList<InputLog*> s_logs;
+
+// Cycles are stored as deltas from the previous event, in LEB128 form.
+static void write_varint(QDataStream& stream, u64 value)
+{
+    do {
+        u8 byte = value & 0x7f;
+        value >>= 7;
+        if (value)
+            byte |= 0x80;
+        stream << byte;
+    } while (value);
+}
+
+static bool read_varint(QDataStream& stream, u64& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        u8 byte;
+        stream >> byte;
+        if (stream.status() != QDataStream::Ok)
+            return false;
+        value |= (u64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+InputLog::InputLog(Machine& machine)
+    : m_machine(machine)
+{
+    if (!options.record_path.isEmpty()) {
+        if (!open_for_recording(options.record_path))
+            hard_exit(1);
+        m_mode = Mode::Record;
+        QMutexLocker locker(&s_logs_lock);
+        s_logs.append(this);
+    } else if (!options.replay_path.isEmpty()) {
+        if (!open_for_replay(options.replay_path))
+            hard_exit(1);
+        m_mode = Mode::Replay;
+        m_replay_timer = make<EventScheduler::Timer>(machine.scheduler(), [this] {
+            m_machine.cpu().queue_command(CPU::DeliverInput);
+        });
+        schedule_next_replay_event();
+    }
+}
+
+InputLog::~InputLog()
+{
+    if (m_mode != Mode::Record)
+        return;
+    {
+        QMutexLocker locker(&s_logs_lock);
+        s_logs.removeOne(this);
+    }
+    QMutexLocker locker(&m_file_lock);
+    m_file.flush();
+}
+
+void InputLog::flush_all_logs()
+{
+    QMutexLocker locker(&s_logs_lock);
+    for (InputLog* log : s_logs)
+        log->flush_recording();
+}
+
+void InputLog::flush_recording()
+{
+    // This may run on another thread while the CPU is stuck somewhere; don't wait on it forever.
+    if (!m_file_lock.tryLock(100))
+        return;
+    m_file.flush();
+    m_file_lock.unlock();
+}
+
+QVector<QPair<QString, QByteArray>> InputLog::disk_image_hashes() const
+{
+    QVector<QPair<QString, QByteArray>> hashes;
+    for (auto* drive : { &m_machine.floppy0(), &m_machine.floppy1(), &m_machine.fixed0(), &m_machine.fixed1() }) {
+        QByteArray hash;
+        QFile file(drive->image_path());
+        if (drive->present() && file.open(QIODevice::ReadOnly)) {
+            QCryptographicHash hasher(QCryptographicHash::Sha1);
+            hasher.addData(&file);
+            hash = hasher.result();
+        }
+        hashes.append({ drive->name(), hash });
+    }
+    return hashes;
+}
+
+bool InputLog::open_for_recording(const QString& path)
+{
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        vlog(LogReplay, "Failed to open %s for recording", qPrintable(path));
+        return false;
+    }
+
+    QDataStream stream(&m_file);
+    stream.writeRawData(log_magic, sizeof(log_magic));
+    stream << log_version;
+
+    auto hashes = disk_image_hashes();
+    stream << (u32)hashes.size();
+    for (auto& it : hashes)
+        stream << it.first << it.second;
+
+    m_file.flush();
+    m_since_flush.start();
+    vlog(LogReplay, "Recording input to %s", qPrintable(path));
+    return true;
+}
+
+bool InputLog::open_for_replay(const QString& path)
+{
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        vlog(LogReplay, "Failed to open %s for replay", qPrintable(path));
+        return false;
+    }
+
+    QDataStream stream(&m_file);
+    char magic[sizeof(log_magic)];
+    u16 version = 0;
+    if (stream.readRawData(magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, log_magic, sizeof(magic))) {
+        vlog(LogReplay, "%s is not an input log", qPrintable(path));
+        return false;
+    }
+    stream >> version;
+    if (version != log_version) {
+        vlog(LogReplay, "%s has unsupported version %u", qPrintable(path), version);
+        return false;
+    }
+
+    u32 hash_count = 0;
+    stream >> hash_count;
+    auto current_hashes = disk_image_hashes();
+    for (u32 i = 0; i < hash_count; ++i) {
+        QString name;
+        QByteArray hash;
+        stream >> name >> hash;
+        for (auto& it : current_hashes) {
+            if (it.first == name && it.second != hash)
+                vlog(LogReplay, "Warning: %s image differs from the recording, replay will probably diverge", qPrintable(name));
+        }
+    }
+
+    u64 cycle = 0;
+    while (!stream.atEnd()) {
+        Event event;
+        u8 type;
+        u64 delta;
+        stream >> type;
+        if (!read_varint(stream, delta))
+            break;
+        cycle += delta;
+        event.type = static_cast<Event::Type>(type);
+        event.cycle = cycle;
+
+        u8 byte;
+        switch (event.type) {
+        case Event::KeyPress:
+            stream >> event.scan_code >> event.code >> byte;
+            event.extended = byte;
+            break;
+        case Event::KeyRelease:
+            stream >> event.code >> byte;
+            event.extended = byte;
+            break;
+        case Event::MouseMove:
+            stream >> event.x >> event.y;
+            break;
+        case Event::MouseButtonPress:
+        case Event::MouseButtonRelease:
+            stream >> event.x >> event.y >> byte;
+            event.button = static_cast<MouseButton>(byte);
+            break;
+        case Event::IRQ:
+            stream >> event.irq;
+            break;
+        default:
+            vlog(LogReplay, "Unknown event type %u at cycle %llu, stopping there", type, (unsigned long long)cycle);
+            stream.setStatus(QDataStream::ReadCorruptData);
+            break;
+        }
+
+        if (stream.status() != QDataStream::Ok)
+            break;
+
+        if (event.type == Event::IRQ)
+            m_replay_irqs.append(event);
+        else
+            m_replay_inputs.append(event);
+    }
+
+    m_file.close();
+    vlog(LogReplay, "Replaying %d inputs and %d IRQs from %s", m_replay_inputs.size(), m_replay_irqs.size(), qPrintable(path));
+    return true;
+}
+
+void InputLog::record(const Event& event)
+{
+    ASSERT(m_mode == Mode::Record);
+    QMutexLocker locker(&m_file_lock);
+    QDataStream stream(&m_file);
+    stream << (u8)event.type;
+    write_varint(stream, event.cycle - m_last_recorded_cycle);
+    m_last_recorded_cycle = event.cycle;
+
+    switch (event.type) {
+    case Event::KeyPress:
+        stream << event.scan_code << event.code << (u8)event.extended;
+        break;
+    case Event::KeyRelease:
+        stream << event.code << (u8)event.extended;
+        break;
+    case Event::MouseMove:
+        stream << event.x << event.y;
+        break;
+    case Event::MouseButtonPress:
+    case Event::MouseButtonRelease:
+        stream << event.x << event.y << (u8)event.button;
+        break;
+    case Event::IRQ:
+        stream << event.irq;
+        break;
+    }
+
+    // Every serviced IRQ is an event, so flushing each one would be a write per interrupt.
+    // Keep the log reasonably fresh on disk in case the emulator goes down with the guest instead.
+    if (m_since_flush.hasExpired(flush_interval_ms)) {
+        m_file.flush();
+        m_since_flush.restart();
+    }
+}
+
+void InputLog::post(Event&& event)
+{
+    if (m_mode == Mode::Replay)
+        return;
+    {
+        QMutexLocker locker(&m_pending_lock);
+        m_pending.append(std::move(event));
+    }
+    m_machine.cpu().queue_command(CPU::DeliverInput);
+}
+
+void InputLog::post_key_press(u16 scan_code, bool extended, u8 make_code)
+{
+    Event event;
+    event.type = Event::KeyPress;
+    event.scan_code = scan_code;
+    event.extended = extended;
+    event.code = make_code;
+    post(std::move(event));
+}
+
+void InputLog::post_key_release(bool extended, u8 break_code)
+{
+    Event event;
+    event.type = Event::KeyRelease;
+    event.extended = extended;
+    event.code = break_code;
+    post(std::move(event));
+}
+
+void InputLog::move_event(u16 x, u16 y)
+{
+    Event event;
+    event.type = Event::MouseMove;
+    event.x = x;
+    event.y = y;
+    post(std::move(event));
+}
+
+void InputLog::button_press_event(u16 x, u16 y, MouseButton button)
+{
+    Event event;
+    event.type = Event::MouseButtonPress;
+    event.x = x;
+    event.y = y;
+    event.button = button;
+    post(std::move(event));
+}
+
+void InputLog::button_release_event(u16 x, u16 y, MouseButton button)
+{
+    Event event;
+    event.type = Event::MouseButtonRelease;
+    event.x = x;
+    event.y = y;
+    event.button = button;
+    post(std::move(event));
+}
+
+void InputLog::deliver(const Event& event)
+{
+#ifdef INPUTLOG_DEBUG
+    vlog(LogReplay, "Deliver event type %u at cycle %llu", event.type, (unsigned long long)m_machine.cpu().cycle());
+#endif
+    switch (event.type) {
+    case Event::KeyPress:
+        m_machine.keyboard().enqueue_key_press(event.scan_code, event.extended, event.code);
+        break;
+    case Event::KeyRelease:
+        m_machine.keyboard().enqueue_key_release(event.extended, event.code);
+        break;
+    case Event::MouseMove:
+        m_machine.busmouse().move_event(event.x, event.y);
+        break;
+    case Event::MouseButtonPress:
+        m_machine.busmouse().button_press_event(event.x, event.y, event.button);
+        break;
+    case Event::MouseButtonRelease:
+        m_machine.busmouse().button_release_event(event.x, event.y, event.button);
+        break;
+    case Event::IRQ:
+        ASSERT_NOT_REACHED();
+        break;
+    }
+}
+
+void InputLog::deliver_pending_input(Badge<CPU>)
+{
+    u64 cycle = m_machine.cpu().cycle();
+
+    if (m_mode == Mode::Replay) {
+        while (m_next_replay_input < m_replay_inputs.size() && m_replay_inputs[m_next_replay_input].cycle <= cycle)
+            deliver(m_replay_inputs[m_next_replay_input++]);
+        schedule_next_replay_event();
+        return;
+    }
+
+    QVector<Event> events;
+    {
+        QMutexLocker locker(&m_pending_lock);
+        events = std::move(m_pending);
+        m_pending.clear();
+    }
+
+    for (auto& event : events) {
+        if (m_mode == Mode::Record) {
+            event.cycle = cycle;
+            record(event);
+        }
+        deliver(event);
+    }
+}
+
+void InputLog::schedule_next_replay_event()
+{
+    if (m_next_replay_input >= m_replay_inputs.size()) {
+        vlog(LogReplay, "All recorded input has been replayed");
+        return;
+    }
+    auto& scheduler = m_machine.scheduler();
+    m_replay_timer->start_at(scheduler.time_for_cycle(m_replay_inputs[m_next_replay_input].cycle));
+}
+
+void InputLog::did_service_irq(Badge<PIC>, u8 irq)
+{
+    u64 cycle = m_machine.cpu().cycle();
+
+    if (m_mode == Mode::Record) {
+        Event event;
+        event.type = Event::IRQ;
+        event.cycle = cycle;
+        event.irq = irq;
+        record(event);
+        return;
+    }
+
+    if (m_mode != Mode::Replay || m_diverged)
+        return;
+
+    if (m_next_replay_irq >= m_replay_irqs.size()) {
+        vlog(LogReplay, "Diverged at cycle %llu: IRQ %u serviced after the end of the recording", (unsigned long long)cycle, irq);
+        m_diverged = true;
+        return;
+    }
+
+    auto& expected = m_replay_irqs[m_next_replay_irq++];
+    if (expected.cycle != cycle || expected.irq != irq) {
+        vlog(LogReplay, "Diverged at cycle %llu: serviced IRQ %u, but the recording has IRQ %u at cycle %llu", (unsigned long long)cycle, irq, expected.irq, (unsigned long long)expected.cycle);
+        m_diverged = true;
+    }
+}
@@ -12,7 +12,6 @@ QMAKE_CXXFLAGS_DEBUG += -O0
 CONFIG += c++1z
 
 DEFINES += CT_TRACE
-//DEFINES += CT_DETERMINISTIC
 CONFIG += silent
 CONFIG += debug
 QT += widgets
@@ -22,7 +21,6 @@ CONFIG -= app_bundle
 unix {
     LIBS += -leditline
     DEFINES += HAVE_EDITLINE
-    DEFINES += HAVE_USLEEP
 }
 
 OBJECTS_DIR = .obj
@@ -43,13 +41,22 @@ HEADERS += gui/machinewidget.h \
            gui/screen.h \
            gui/worker.h \
            gui/Renderer.h \
+           gui/Display.h \
+           gui/FrameCapture.h \
+           gui/RenderThread.h \
+           gui/PlanarToChunky.h \
            hw/DMA.h \
            hw/MemoryProvider.h \
            hw/ROM.h \
            hw/SimpleMemoryProvider.h \
            hw/DiskDrive.h \
+           hw/DiskBackend.h \
+           hw/DiskCache.h \
+           hw/DiskIOThread.h \
+           hw/OverlayDiskBackend.h \
            hw/fdc.h \
            hw/ide.h \
+           hw/PCI.h \
            hw/iodevice.h \
            hw/keyboard.h \
            hw/vomctl.h \
@@ -57,10 +64,11 @@ HEADERS += gui/machinewidget.h \
            hw/pic.h \
            hw/pit.h \
            hw/vga.h \
+           hw/VBE.h \
            hw/PS2.h \
            hw/busmouse.h \
            hw/MouseObserver.h \
-           hw/ThreadedTimer.h \
+           hw/EventScheduler.h \
            include/debugger.h \
            include/types.h \
            include/debug.h \
@@ -69,6 +77,7 @@ HEADERS += gui/machinewidget.h \
            include/templates.h \
            include/Common.h \
            include/OwnPtr.h \
+           include/InputLog.h \
            x86/CPU.h \
            x86/Descriptor.h \
            x86/Instruction.h \
@@ -77,6 +86,7 @@ HEADERS += gui/machinewidget.h \
 SOURCES += debug.cpp \
            debugger.cpp \
            dump.cpp \
+           InputLog.cpp \
            machine.cpp \
            settings.cpp \
            vmcalls.cpp \
@@ -105,14 +115,20 @@ SOURCES += debug.cpp \
            gui/screen.cpp \
            gui/worker.cpp \
            gui/Renderer.cpp \
+           gui/Display.cpp \
+           gui/FrameCapture.cpp \
+           gui/RenderThread.cpp \
+           gui/PlanarToChunky.cpp \
            hw/DMA.cpp \
            hw/busmouse.cpp \
            hw/fdc.cpp \
            hw/ide.cpp \
+           hw/PCI.cpp \
            hw/keyboard.cpp \
            hw/pic.cpp \
            hw/pit.cpp \
            hw/vga.cpp \
+           hw/VBE.cpp \
            hw/vomctl.cpp \
            hw/iodevice.cpp \
            hw/cmos.cpp \
@@ -121,5 +137,9 @@ SOURCES += debug.cpp \
            hw/ROM.cpp \
            hw/SimpleMemoryProvider.cpp \
            hw/DiskDrive.cpp \
+           hw/DiskBackend.cpp \
+           hw/DiskCache.cpp \
+           hw/DiskIOThread.cpp \
+           hw/OverlayDiskBackend.cpp \
            hw/MouseObserver.cpp \
-           hw/ThreadedTimer.cpp
+           hw/EventScheduler.cpp
@@ -105,6 +105,12 @@ void vlog(VLogChannel channel, const char* format, ...)
     case LogDMA:
         prefix = "dma";
         break;
+    case LogReplay:
+        prefix = "replay";
+        break;
+    case LogVBE:
+        prefix = "vbe";
+        break;
 #ifdef DEBUG_SERENITY
     case LogSerenity:
         prefix = "serenity";
@@ -25,6 +25,7 @@
 #include "debugger.h"
 #include "CPU.h"
 #include "Common.h"
+#include "DiskDrive.h"
 #include "debug.h"
 #include "machine.h"
 #include "pic.h"
@@ -260,6 +261,9 @@ void Debugger::handle_command(const QString& raw_command)
         return;
     }
 
+    if (lower_command == "disk")
+        return handle_disk_statistics();
+
 #ifdef DISASSEMBLE_EVERYTHING
     if (lower_command == "de1") {
         options.disassemble_everything = true;
@@ -274,6 +278,27 @@ void Debugger::handle_command(const QString& raw_command)
     printf("Unknown command: %s\n", command.toUtf8().constData());
 }
 
+void Debugger::handle_disk_statistics()
+{
+    auto& machine = cpu().machine();
+    for (auto* drive : { &machine.floppy0(), &machine.floppy1(), &machine.fixed0(), &machine.fixed1() }) {
+        if (!drive->present())
+            continue;
+        auto* cache = drive->cache();
+        if (!cache) {
+            printf("%-8s %s (uncached)\n", qPrintable(drive->name()), qPrintable(drive->image_path()));
+            continue;
+        }
+        auto& statistics = cache->statistics();
+        u64 lookups = statistics.hits + statistics.misses;
+        printf("%-8s %s\n", qPrintable(drive->name()), qPrintable(drive->image_path()));
+        printf("         %u/%u blocks cached, read-ahead %u blocks\n", cache->cached_block_count(), cache->capacity_in_blocks(), cache->read_ahead_blocks());
+        printf("         hits: %llu, misses: %llu (%.1f%% hit rate)\n", (unsigned long long)statistics.hits, (unsigned long long)statistics.misses, lookups ? 100.0 * statistics.hits / lookups : 0.0);
+        printf("         read ahead: %llu blocks, evictions: %llu, host reads: %llu\n", (unsigned long long)statistics.read_ahead_blocks, (unsigned long long)statistics.evictions, (unsigned long long)statistics.backend_reads);
+        printf("         dirty: %u blocks, host writes: %llu\n", cache->dirty_block_count(), (unsigned long long)statistics.backend_writes);
+    }
+}
+
 void Debugger::handle_irq(const QStringList& arguments)
 {
     if (arguments.size() != 1)
@@ -0,0 +1,169 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "Display.h"
+#include "Renderer.h"
+#include "debug.h"
+#include "machine.h"
+#include "vga.h"
+#include <QtCore/QIODevice>
+#include <QtGui/QPainter>
+
+struct Display::Private {
+    OwnPtr<TextRenderer> text_renderer;
+    OwnPtr<Mode04Renderer> mode04_renderer;
+    OwnPtr<Mode0DRenderer> mode0D_renderer;
+    OwnPtr<Mode12Renderer> mode12_renderer;
+    OwnPtr<Mode13Renderer> mode13_renderer;
+    OwnPtr<VBERenderer> vbe_renderer;
+    OwnPtr<DummyRenderer> dummy_renderer;
+};
+
+Display::Display(Machine& machine)
+    : m_machine(machine)
+    , d(make<Private>())
+{
+    d->text_renderer = make<TextRenderer>(machine);
+    d->mode04_renderer = make<Mode04Renderer>(machine);
+    d->mode0D_renderer = make<Mode0DRenderer>(machine);
+    d->mode12_renderer = make<Mode12Renderer>(machine);
+    d->mode13_renderer = make<Mode13Renderer>(machine);
+    d->vbe_renderer = make<VBERenderer>(machine);
+    d->dummy_renderer = make<DummyRenderer>(machine);
+}
+
+Display::~Display()
+{
+}
+
+void Display::refresh()
+{
+    VGA::DirtyMap dirty;
+    auto& snapshot = machine().vga().acquire_snapshot(dirty);
+
+    u8 video_mode = snapshot.current_video_mode();
+    bool video_mode_changed = false;
+
+    if (m_video_mode_in_last_refresh != video_mode) {
+        vlog(LogScreen, "Video mode changed to %02X", video_mode);
+        m_video_mode_in_last_refresh = video_mode;
+        video_mode_changed = true;
+    }
+
+    bool vbe_enabled = snapshot.vbe_enabled();
+    if (m_vbe_enabled_in_last_refresh != vbe_enabled) {
+        vlog(LogScreen, "VBE display %s", vbe_enabled ? "enabled" : "disabled");
+        m_vbe_enabled_in_last_refresh = vbe_enabled;
+        video_mode_changed = true;
+    }
+
+    if (video_mode_changed) {
+        renderer().will_become_active();
+        dirty.set_all();
+    }
+
+    renderer().synchronize_font();
+    renderer().synchronize_colors();
+    renderer().render(dirty);
+}
+
+Renderer& Display::renderer()
+{
+    auto& snapshot = machine().vga().snapshot();
+    if (snapshot.vbe_enabled())
+        return *d->vbe_renderer;
+
+    switch (snapshot.current_video_mode()) {
+    case 0x03:
+        return *d->text_renderer;
+    case 0x04:
+        return *d->mode04_renderer;
+    case 0x0D:
+        return *d->mode0D_renderer;
+    case 0x12:
+        return *d->mode12_renderer;
+    case 0x13:
+        return *d->mode13_renderer;
+    default:
+        return *d->dummy_renderer;
+    }
+}
+
+QSize Display::size()
+{
+    return renderer().size();
+}
+
+void Display::paint(QPainter& p)
+{
+    renderer().paint(p);
+}
+
+QImage Display::grab_frame()
+{
+    QSize frame_size = size();
+    if (frame_size.isEmpty())
+        return QImage();
+
+    QImage frame(frame_size, QImage::Format_RGB32);
+    frame.fill(Qt::black);
+    QPainter p(&frame);
+    paint(p);
+    return frame;
+}
+
+Display::Frame Display::take_frame()
+{
+    Frame frame;
+    if (renderer().is_buffered()) {
+        auto& buffered = static_cast<BufferedRenderer&>(renderer());
+        if (buffered.buffer().format() == QImage::Format_Indexed8) {
+            // This shares the buffer, the renderer detaches from it when it writes again.
+            frame.image = buffered.buffer();
+            frame.scale = buffered.scale();
+            buffered.take_dirty_rows(frame.first_dirty_row, frame.last_dirty_row);
+            return frame;
+        }
+    }
+
+    frame.image = grab_frame();
+    frame.last_dirty_row = frame.image.height() - 1;
+    return frame;
+}
+
+bool Display::write_ppm(QIODevice& device, const QImage& image)
+{
+    QImage rgb = image.convertToFormat(QImage::Format_RGB888);
+    QByteArray header = QString("P6\n%1 %2\n255\n").arg(rgb.width()).arg(rgb.height()).toLatin1();
+    if (device.write(header) != header.size())
+        return false;
+    // Scanlines are padded to 32 bits, so write them one at a time.
+    qint64 bytes_per_line = rgb.width() * 3;
+    for (int y = 0; y < rgb.height(); ++y) {
+        if (device.write(reinterpret_cast<const char*>(rgb.constScanLine(y)), bytes_per_line) != bytes_per_line)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,82 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include "OwnPtr.h"
+#include "types.h"
+#include <QImage>
+#include <QMetaType>
+
+class Machine;
+class QIODevice;
+class QPainter;
+class Renderer;
+
+// Display keeps the renderer for the current video mode up to date with the video hardware.
+// It has no widget of its own; RenderThread renders it for Screen, FrameCapture into files.
+class Display {
+public:
+    explicit Display(Machine&);
+    ~Display();
+
+    Machine& machine() const { return m_machine; }
+
+    Renderer& renderer();
+
+    // Picks up video mode changes and re-renders whatever the guest modified since last time.
+    void refresh();
+
+    // The size of the picture the current renderer paints.
+    QSize size();
+    void paint(QPainter&);
+
+    // Paints the current picture into an RGB32 image. Returns a null image if there's nothing to show.
+    QImage grab_frame();
+
+    // The current picture, cheaply: indexed renderers hand over their unscaled buffer (palette in the color table)
+    // along with the rows that changed since the last call. Everything else is painted like grab_frame() does.
+    struct Frame {
+        QImage image;
+        int scale { 1 };
+        int first_dirty_row { 0 };
+        int last_dirty_row { -1 };
+    };
+    Frame take_frame();
+
+    // Writes an image as binary PPM (raw RGB24 with a tiny header), so frames can be concatenated into a pipe.
+    static bool write_ppm(QIODevice&, const QImage&);
+
+private:
+    Machine& m_machine;
+
+    struct Private;
+    OwnPtr<Private> d;
+
+    u8 m_video_mode_in_last_refresh { 0xFF };
+    bool m_vbe_enabled_in_last_refresh { false };
+};
+
+Q_DECLARE_METATYPE(Display::Frame)
@@ -0,0 +1,111 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "FrameCapture.h"
+#include "EventScheduler.h"
+#include "debug.h"
+#include "machine.h"
+#include <QtCore/QDir>
+#include <QtCore/QFileInfo>
+
+FrameCapture::FrameCapture(Machine& machine, const QString& path, unsigned every_nth_frame)
+    : QObject(nullptr)
+    , m_machine(machine)
+    , m_display(machine)
+    , m_path(path)
+    , m_every_nth_frame(every_nth_frame ? every_nth_frame : 1)
+{
+    m_timer.setInterval(frame_interval_ms);
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(on_frame()));
+}
+
+FrameCapture::~FrameCapture()
+{
+    if (m_follows_snapshots)
+        m_machine.set_frame_observer(nullptr);
+}
+
+bool FrameCapture::start()
+{
+    if (QFileInfo(m_path).isDir()) {
+        m_writes_png_files = true;
+    } else if (m_path == "-") {
+        if (!m_stream.open(stdout, QIODevice::WriteOnly)) {
+            vlog(LogScreen, "Couldn't open stdout for frame capture");
+            return false;
+        }
+    } else {
+        m_stream.setFileName(m_path);
+        if (!m_stream.open(QIODevice::WriteOnly)) {
+            vlog(LogScreen, "Couldn't open %s for frame capture", qPrintable(m_path));
+            return false;
+        }
+    }
+
+    vlog(LogScreen, "Capturing every %u frame(s) to %s", m_every_nth_frame, qPrintable(m_path));
+    if (m_machine.scheduler().is_deterministic()) {
+        m_follows_snapshots = true;
+        m_machine.set_frame_observer([this] { on_frame(); });
+    } else {
+        m_timer.start();
+    }
+    return true;
+}
+
+void FrameCapture::on_frame()
+{
+    if (m_failed)
+        return;
+
+    // Keep the renderers up to date even for frames we skip, so dirty tracking stays cheap.
+    m_display.refresh();
+
+    if ((m_frame_count++ % m_every_nth_frame) != 0)
+        return;
+
+    QImage frame = m_display.grab_frame();
+    if (frame.isNull())
+        return;
+
+    if (!write_frame(frame)) {
+        vlog(LogScreen, "Frame capture failed, stopping");
+        m_failed = true;
+        if (!m_follows_snapshots)
+            m_timer.stop();
+    }
+}
+
+bool FrameCapture::write_frame(const QImage& frame)
+{
+    if (m_writes_png_files) {
+        QString file_name = QDir(m_path).filePath(QString("frame-%1.png").arg(m_captured_count++, 6, 10, QChar('0')));
+        return frame.save(file_name, "PNG");
+    }
+
+    ++m_captured_count;
+    if (!Display::write_ppm(m_stream, frame))
+        return false;
+    return m_stream.flush();
+}
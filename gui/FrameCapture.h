@@ -0,0 +1,71 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include "Display.h"
+#include "OwnPtr.h"
+#include "types.h"
+#include <QFile>
+#include <QObject>
+#include <QTimer>
+
+class Machine;
+
+// Renders the guest display without any widgets and dumps every Nth frame.
+// In deterministic runs a frame is a snapshot published by the VGA, counted and rendered on the CPU thread,
+// so frame N holds the same guest picture on every run. Otherwise frames are sampled by a host timer.
+// If the output path is a directory, frames go there as numbered PNG files.
+// Anything else (a file, a FIFO, or "-" for stdout) gets a stream of binary PPM frames.
+class FrameCapture final : public QObject {
+    Q_OBJECT
+public:
+    FrameCapture(Machine&, const QString& path, unsigned every_nth_frame = 1);
+    virtual ~FrameCapture() override;
+
+    bool start();
+
+    u64 frame_count() const { return m_frame_count; }
+
+    static constexpr int frame_interval_ms = 16;
+
+private slots:
+    void on_frame();
+
+private:
+    bool write_frame(const QImage&);
+
+    Machine& m_machine;
+    Display m_display;
+    QTimer m_timer;
+    bool m_follows_snapshots { false };
+    bool m_failed { false };
+    QString m_path;
+    bool m_writes_png_files { false };
+    QFile m_stream;
+    unsigned m_every_nth_frame { 1 };
+    u64 m_frame_count { 0 };
+    u64 m_captured_count { 0 };
+};
@@ -0,0 +1,317 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "PlanarToChunky.h"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    define PLANAR_TO_CHUNKY_X86
+#    include <immintrin.h>
+// The kernels keep their working set in registers only if these small loops are fully unrolled.
+#    define PLANAR_TO_CHUNKY_UNROLL _Pragma("GCC unroll 8")
+#endif
+
+// The straightforward version, one bit from each plane per pixel.
+static void planar_to_chunky_bitwise(const u8* p0, const u8* p1, const u8* p2, const u8* p3, u8* out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        for (int bit = 7; bit >= 0; --bit)
+            *(out++) = ((p0[i] >> bit) & 1) | (((p1[i] >> bit) & 1) << 1) | (((p2[i] >> bit) & 1) << 2) | (((p3[i] >> bit) & 1) << 3);
+    }
+}
+
+// Spreads the 8 bits of a plane byte into the low bit of 8 pixel bytes, in memory order.
+struct SpreadTable {
+    constexpr SpreadTable()
+        : entries()
+    {
+        for (unsigned value = 0; value < 256; ++value) {
+            for (unsigned pixel = 0; pixel < 8; ++pixel) {
+                if (!(value & (0x80 >> pixel)))
+                    continue;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                entries[value] |= 1ull << ((7 - pixel) * 8);
+#else
+                entries[value] |= 1ull << (pixel * 8);
+#endif
+            }
+        }
+    }
+    u64 entries[256];
+};
+
+static constexpr SpreadTable spread_table;
+
+static void planar_to_chunky_table(const u8* p0, const u8* p1, const u8* p2, const u8* p3, u8* out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i, out += 8) {
+        u64 pixels = spread_table.entries[p0[i]]
+            | (spread_table.entries[p1[i]] << 1)
+            | (spread_table.entries[p2[i]] << 2)
+            | (spread_table.entries[p3[i]] << 3);
+        memcpy(out, &pixels, sizeof(pixels));
+    }
+}
+
+#ifdef PLANAR_TO_CHUNKY_X86
+
+// Each vector is 16 bytes, each holding one of a plane's 8 bits (0x80 for the leftmost pixel.)
+// Turn those into 0 or plane_bit, and accumulate.
+__attribute__((target("sse2"))) static inline __m128i spread_bits_sse2(__m128i expanded, __m128i bit_select, __m128i plane_bit)
+{
+    return _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(expanded, bit_select), bit_select), plane_bit);
+}
+
+__attribute__((target("sse2"))) static void planar_to_chunky_sse2(const u8* p0, const u8* p1, const u8* p2, const u8* p3, u8* out, size_t count)
+{
+    const __m128i bit_select = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const u8* planes[4] = { p0, p1, p2, p3 };
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16, out += 128) {
+        __m128i pixels[8];
+        PLANAR_TO_CHUNKY_UNROLL
+        for (auto& vector : pixels)
+            vector = _mm_setzero_si128();
+
+        PLANAR_TO_CHUNKY_UNROLL
+        for (int plane = 0; plane < 4; ++plane) {
+            const __m128i plane_bit = _mm_set1_epi8(1 << plane);
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[plane] + i));
+
+            // Repeat every byte 8 times: after three rounds of unpacking, vector n holds bytes 2n and 2n+1.
+            __m128i x2[2] = { _mm_unpacklo_epi8(bytes, bytes), _mm_unpackhi_epi8(bytes, bytes) };
+            __m128i x4[4];
+            PLANAR_TO_CHUNKY_UNROLL
+            for (int j = 0; j < 2; ++j) {
+                x4[j * 2] = _mm_unpacklo_epi16(x2[j], x2[j]);
+                x4[j * 2 + 1] = _mm_unpackhi_epi16(x2[j], x2[j]);
+            }
+            PLANAR_TO_CHUNKY_UNROLL
+            for (int j = 0; j < 4; ++j) {
+                pixels[j * 2] = _mm_or_si128(pixels[j * 2], spread_bits_sse2(_mm_unpacklo_epi32(x4[j], x4[j]), bit_select, plane_bit));
+                pixels[j * 2 + 1] = _mm_or_si128(pixels[j * 2 + 1], spread_bits_sse2(_mm_unpackhi_epi32(x4[j], x4[j]), bit_select, plane_bit));
+            }
+        }
+
+        PLANAR_TO_CHUNKY_UNROLL
+        for (int j = 0; j < 8; ++j)
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + j * 16), pixels[j]);
+    }
+
+    planar_to_chunky_table(p0 + i, p1 + i, p2 + i, p3 + i, out, count - i);
+}
+
+__attribute__((target("avx2"))) static void planar_to_chunky_avx2(const u8* p0, const u8* p1, const u8* p2, const u8* p3, u8* out, size_t count)
+{
+    const __m256i bit_select = _mm256_set_epi8(
+        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+
+    // Output vector n covers source bytes 4n..4n+3, each repeated 8 times (two per 128-bit lane.)
+    __m256i repeat[4];
+    for (int n = 0; n < 4; ++n) {
+        char b = n * 4;
+        repeat[n] = _mm256_setr_epi8(
+            b, b, b, b, b, b, b, b, b + 1, b + 1, b + 1, b + 1, b + 1, b + 1, b + 1, b + 1,
+            b + 2, b + 2, b + 2, b + 2, b + 2, b + 2, b + 2, b + 2, b + 3, b + 3, b + 3, b + 3, b + 3, b + 3, b + 3, b + 3);
+    }
+
+    const u8* planes[4] = { p0, p1, p2, p3 };
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16, out += 128) {
+        __m256i pixels[4];
+        PLANAR_TO_CHUNKY_UNROLL
+        for (auto& vector : pixels)
+            vector = _mm256_setzero_si256();
+
+        PLANAR_TO_CHUNKY_UNROLL
+        for (int plane = 0; plane < 4; ++plane) {
+            const __m256i plane_bit = _mm256_set1_epi8(1 << plane);
+            __m256i bytes = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[plane] + i)));
+            PLANAR_TO_CHUNKY_UNROLL
+            for (int n = 0; n < 4; ++n) {
+                __m256i expanded = _mm256_shuffle_epi8(bytes, repeat[n]);
+                __m256i bits = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(expanded, bit_select), bit_select), plane_bit);
+                pixels[n] = _mm256_or_si256(pixels[n], bits);
+            }
+        }
+
+        PLANAR_TO_CHUNKY_UNROLL
+        for (int n = 0; n < 4; ++n)
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + n * 32), pixels[n]);
+    }
+
+    planar_to_chunky_table(p0 + i, p1 + i, p2 + i, p3 + i, out, count - i);
+}
+
+#endif
+
+static void unchain_to_chunky_scalar(const u8* p0, const u8* p1, const u8* p2, const u8* p3, u8* out, size_t count, unsigned shift)
+{
+    for (size_t i = 0; i < count; ++i, out += 4) {
+        size_t offset = i << shift;
+        out[0] = p0[offset];
+        out[1] = p1[offset];
+        out[2] = p2[offset];
+        out[3] = p3[offset];
+    }
+}
+
+#ifdef PLANAR_TO_CHUNKY_X86
+
+// All three layouts end up as 32-bit lanes of (p0, p1, p2, p3) byte quads, one quad per output group of 4 pixels.
+__attribute__((target("sse2"))) static void unchain_to_chunky_sse2(const u8* p0, const u8* p1, const u8* p2, const u8* p3, u8* out, size_t count, unsigned shift)
+{
+    auto load = [](const u8* plane, size_t offset) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(plane + offset)); };
+    auto store = [](u8* out, __m128i pixels) { _mm_storeu_si128(reinterpret_cast<__m128i*>(out), pixels); };
+
+    if (!count)
+        return;
+
+    // Don't let the vector loads read past the last byte we need, it may be the end of video memory.
+    const size_t end = ((count - 1) << shift) + 1;
+
+    size_t i = 0;
+    switch (shift) {
+    case 0:
+        // Plain byte interleave: 16 bytes from each plane make 64 pixels.
+        for (; i + 16 <= end; i += 16, out += 64) {
+            __m128i a = load(p0, i), b = load(p1, i), c = load(p2, i), d = load(p3, i);
+            __m128i ab_lo = _mm_unpacklo_epi8(a, b), ab_hi = _mm_unpackhi_epi8(a, b);
+            __m128i cd_lo = _mm_unpacklo_epi8(c, d), cd_hi = _mm_unpackhi_epi8(c, d);
+            store(out, _mm_unpacklo_epi16(ab_lo, cd_lo));
+            store(out + 16, _mm_unpackhi_epi16(ab_lo, cd_lo));
+            store(out + 32, _mm_unpacklo_epi16(ab_hi, cd_hi));
+            store(out + 48, _mm_unpackhi_epi16(ab_hi, cd_hi));
+        }
+        break;
+    case 1: {
+        // Every other byte: merge plane pairs into 16-bit lanes, then interleave those.
+        const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+        for (; (i << 1) + 16 <= end; i += 8, out += 32) {
+            size_t offset = i << 1;
+            __m128i ab = _mm_or_si128(_mm_and_si128(load(p0, offset), low_bytes), _mm_slli_epi16(load(p1, offset), 8));
+            __m128i cd = _mm_or_si128(_mm_and_si128(load(p2, offset), low_bytes), _mm_slli_epi16(load(p3, offset), 8));
+            store(out, _mm_unpacklo_epi16(ab, cd));
+            store(out + 16, _mm_unpackhi_epi16(ab, cd));
+        }
+        break;
+    }
+    case 2: {
+        // Every fourth byte: each plane's byte already sits at the bottom of a 32-bit lane.
+        const __m128i low_bytes = _mm_set1_epi32(0xff);
+        for (; (i << 2) + 16 <= end; i += 4, out += 16) {
+            size_t offset = i << 2;
+            __m128i pixels = _mm_and_si128(load(p0, offset), low_bytes);
+            pixels = _mm_or_si128(pixels, _mm_slli_epi32(_mm_and_si128(load(p1, offset), low_bytes), 8));
+            pixels = _mm_or_si128(pixels, _mm_slli_epi32(_mm_and_si128(load(p2, offset), low_bytes), 16));
+            pixels = _mm_or_si128(pixels, _mm_slli_epi32(load(p3, offset), 24));
+            store(out, pixels);
+        }
+        break;
+    }
+    }
+
+    size_t offset = i << shift;
+    unchain_to_chunky_scalar(p0 + offset, p1 + offset, p2 + offset, p3 + offset, out, count - i, shift);
+}
+
+#endif
+
+std::vector<PlanarToChunkyKernel> supported_planar_to_chunky_kernels()
+{
+    std::vector<PlanarToChunkyKernel> kernels;
+    kernels.push_back({ "bitwise", planar_to_chunky_bitwise });
+    kernels.push_back({ "table", planar_to_chunky_table });
+#ifdef PLANAR_TO_CHUNKY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernels.push_back({ "sse2", planar_to_chunky_sse2 });
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({ "avx2", planar_to_chunky_avx2 });
+#endif
+    return kernels;
+}
+
+// Which kernel wins depends on the host CPU, and on how well the compiler auto-vectorized the
+// portable ones (at -O3, "bitwise" can beat SSE2), so time them all on a few scanlines and keep the fastest.
+static PlanarToChunkyFunction fastest_planar_to_chunky_kernel()
+{
+    static const size_t count = 80 * 16;
+    static const int rounds = 5;
+    static const int calls_per_round = 20;
+    u8 planes[4][count];
+    u8 pixels[count * 8];
+
+    for (size_t i = 0; i < count; ++i) {
+        for (int plane = 0; plane < 4; ++plane)
+            planes[plane][i] = i * 167 + plane * 29;
+    }
+
+    PlanarToChunkyFunction fastest = nullptr;
+    auto fastest_time = std::chrono::steady_clock::duration::max();
+    for (auto& kernel : supported_planar_to_chunky_kernels()) {
+        // Best of a few rounds, so a single preemption doesn't decide it.
+        auto best_time = std::chrono::steady_clock::duration::max();
+        for (int round = 0; round < rounds; ++round) {
+            auto start = std::chrono::steady_clock::now();
+            for (int call = 0; call < calls_per_round; ++call)
+                kernel.function(planes[0], planes[1], planes[2], planes[3], pixels, count);
+            best_time = std::min(best_time, std::chrono::steady_clock::now() - start);
+        }
+        if (best_time < fastest_time) {
+            fastest = kernel.function;
+            fastest_time = best_time;
+        }
+    }
+    return fastest;
+}
+
+void planar_to_chunky(const u8* p0, const u8* p1, const u8* p2, const u8* p3, u8* out, size_t count)
+{
+    static const PlanarToChunkyFunction function = fastest_planar_to_chunky_kernel();
+    function(p0, p1, p2, p3, out, count);
+}
+
+std::vector<UnchainToChunkyKernel> supported_unchain_to_chunky_kernels()
+{
+    std::vector<UnchainToChunkyKernel> kernels;
+    kernels.push_back({ "scalar", unchain_to_chunky_scalar });
+#ifdef PLANAR_TO_CHUNKY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernels.push_back({ "sse2", unchain_to_chunky_sse2 });
+#endif
+    return kernels;
+}
+
+void unchain_to_chunky(const u8* p0, const u8* p1, const u8* p2, const u8* p3, u8* out, size_t count, unsigned shift)
+{
+    static const UnchainToChunkyFunction function = supported_unchain_to_chunky_kernels().back().function;
+    function(p0, p1, p2, p3, out, count, shift);
+}
@@ -0,0 +1,58 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include "types.h"
+#include <stddef.h>
+#include <vector>
+
+// Converts `count` bytes from each of the four VGA planes into 8 * `count` pixels,
+// one 4-bit color index per byte, with the leftmost pixel (bit 7) first.
+// On first use, this times every kernel the host CPU supports and keeps the fastest.
+void planar_to_chunky(const u8* p0, const u8* p1, const u8* p2, const u8* p3, u8* out, size_t count);
+
+typedef void (*PlanarToChunkyFunction)(const u8* p0, const u8* p1, const u8* p2, const u8* p3, u8* out, size_t count);
+
+struct PlanarToChunkyKernel {
+    const char* name;
+    PlanarToChunkyFunction function;
+};
+
+// Every kernel the host CPU can run, the portable ones first. Exposed for tests/benchmarks.
+std::vector<PlanarToChunkyKernel> supported_planar_to_chunky_kernels();
+
+// Gathers 4 * `count` 256-color pixels from the four VGA planes, where pixel x lives in plane x % 4.
+// `count` bytes are used from each plane, 1 << `shift` bytes apart: 0 in byte mode (unchained "Mode X"),
+// 1 in word mode, 2 in doubleword mode (chain-4 Mode 13h.)
+void unchain_to_chunky(const u8* p0, const u8* p1, const u8* p2, const u8* p3, u8* out, size_t count, unsigned shift);
+
+typedef void (*UnchainToChunkyFunction)(const u8* p0, const u8* p1, const u8* p2, const u8* p3, u8* out, size_t count, unsigned shift);
+
+struct UnchainToChunkyKernel {
+    const char* name;
+    UnchainToChunkyFunction function;
+};
+
+std::vector<UnchainToChunkyKernel> supported_unchain_to_chunky_kernels();
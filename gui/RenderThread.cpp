@@ -22,33 +22,49 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
-#include "ThreadedTimer.h"
-#include <QEventLoop>
 
-ThreadedTimer::ThreadedTimer(ThreadedTimer::Listener& listener, int ms)
+#include "RenderThread.h"
+
+RenderThread::RenderThread(Machine& machine)
     : QThread(nullptr)
-    , m_listener(listener)
-    , m_ms(ms)
+    , m_display(machine)
 {
-    start();
+    qRegisterMetaType<Display::Frame>();
 }
 
-ThreadedTimer::~ThreadedTimer()
+RenderThread::~RenderThread()
 {
+    {
+        QMutexLocker locker(&m_lock);
+        m_should_exit = true;
+        m_condition.wakeAll();
+    }
+    wait();
 }
 
-void ThreadedTimer::run()
+void RenderThread::request_render()
 {
-    QEventLoop event_loop;
-    ThreadedTimerHelper helper(*this, m_ms);
-    event_loop.exec();
+    QMutexLocker locker(&m_lock);
+    m_render_requested = true;
+    m_condition.wakeAll();
 }
 
-void ThreadedTimer::helper_timer_fired()
+void RenderThread::run()
 {
-    m_listener.threaded_timer_fired(Badge<ThreadedTimer>());
-}
+    forever
+    {
+        {
+            QMutexLocker locker(&m_lock);
+            while (!m_render_requested && !m_should_exit)
+                m_condition.wait(&m_lock);
+            if (m_should_exit)
+                return;
+            m_render_requested = false;
+        }
 
-ThreadedTimer::Listener::~Listener()
-{
+        m_display.refresh();
+        auto frame = m_display.take_frame();
+        if (!frame.image.isNull())
+            emit frame_ready(frame);
+    }
 }
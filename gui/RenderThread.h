@@ -22,47 +22,40 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+
 #pragma once
 
-#include "types.h"
+#include "Display.h"
+#include <QImage>
+#include <QMutex>
 #include <QThread>
+#include <QWaitCondition>
 
-class ThreadedTimerHelper;
+class Machine;
 
-class ThreadedTimer final : public QThread {
+// Renders the guest display on its own thread, from the snapshots the VGA publishes at each vertical retrace.
+// Finished frames are handed over through frame_ready(), so the GUI thread only has to put them on screen.
+class RenderThread final : public QThread {
     Q_OBJECT
 public:
-    class Listener {
-    public:
-        virtual ~Listener();
-        virtual void threaded_timer_fired(Badge<ThreadedTimer>) = 0;
-    };
+    explicit RenderThread(Machine&);
+    virtual ~RenderThread() override;
 
-    explicit ThreadedTimer(Listener&, int ms);
-    virtual ~ThreadedTimer();
+public slots:
+    // Can be called from any thread. Requests are coalesced, so this never queues up work.
+    void request_render();
 
-private:
-    friend class ThreadedTimerHelper;
-    virtual void run() override;
-    void helper_timer_fired();
-    Listener& m_listener;
-    int m_ms { 0 };
-};
+signals:
+    void frame_ready(const Display::Frame&);
 
-class ThreadedTimerHelper : public QObject {
-    Q_OBJECT
-public:
-    explicit ThreadedTimerHelper(ThreadedTimer& threaded_timer, int ms)
-        : m_threaded_timer(threaded_timer)
-    {
-        startTimer(ms);
-    }
-
-    virtual void timerEvent(QTimerEvent*) override
-    {
-        m_threaded_timer.helper_timer_fired();
-    }
+protected:
+    virtual void run() override;
 
 private:
-    ThreadedTimer& m_threaded_timer;
+    Display m_display;
+
+    QMutex m_lock;
+    QWaitCondition m_condition;
+    bool m_render_requested { false };
+    bool m_should_exit { false };
 };
@@ -23,37 +23,44 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "Renderer.h"
-#include "CPU.h"
 #include "Common.h"
+#include "PlanarToChunky.h"
+#include "debug.h"
 #include "machine.h"
-#include "screen.h"
 #include "vga.h"
 #include <QPainter>
+#include <algorithm>
 
-struct fontcharbitmap_t {
-    u8 data[16];
-};
+const VGA::Snapshot& Renderer::vga() const
+{
+    return m_machine.vga().snapshot();
+}
 
-const Screen& Renderer::screen() const
+BufferedRenderer::BufferedRenderer(Machine& machine, int width, int height, int scale)
+    : Renderer(machine)
+    , m_buffer(width, height, QImage::Format_Indexed8)
+    , m_scale(scale)
 {
-    return m_screen;
+    m_buffer.fill(0);
 }
 
-const VGA& Renderer::vga() const
+u8* BufferedRenderer::dirty_row(int y)
 {
-    return m_screen.machine().vga();
+    m_first_dirty_row = std::min(m_first_dirty_row, y);
+    m_last_dirty_row = std::max(m_last_dirty_row, y);
+    return m_buffer.scanLine(y);
 }
 
-BufferedRenderer::BufferedRenderer(Screen& screen, int width, int height, int scale)
-    : Renderer(screen)
-    , m_buffer(width, height, QImage::Format_Indexed8)
-    , m_scale(scale)
+void BufferedRenderer::take_dirty_rows(int& first, int& last)
 {
-    m_buffer.fill(0);
+    first = m_first_dirty_row;
+    last = m_last_dirty_row;
+    m_first_dirty_row = INT_MAX;
+    m_last_dirty_row = -1;
 }
 
-Mode04Renderer::Mode04Renderer(Screen& screen)
-    : BufferedRenderer(screen, 320, 200, 2)
+Mode04Renderer::Mode04Renderer(Machine& machine)
+    : BufferedRenderer(machine, 320, 200, 2)
 {
     m_buffer.setColor(0, QColor(Qt::black).rgb());
     m_buffer.setColor(1, QColor(Qt::cyan).rgb());
@@ -61,26 +68,38 @@ Mode04Renderer::Mode04Renderer(Screen& screen)
     m_buffer.setColor(3, QColor(Qt::white).rgb());
 }
 
-void TextRenderer::put_character(QPainter& p, int row, int column, u8 color, u8 character)
+TextRenderer::TextRenderer(Machine& machine)
+    : Renderer(machine)
+    , m_buffer(columns * character_width, rows * character_height, QImage::Format_RGB32)
 {
-    int x = column * m_character_width;
-    int y = row * m_character_height;
+    m_buffer.fill(Qt::black);
+}
 
-    p.setBackground(m_brush[color >> 4]);
-    p.eraseRect(x, y, m_character_width, m_character_height);
-    p.setPen(m_color[color & 0xf]);
-    p.drawPixmap(x, y, m_character[character]);
+void TextRenderer::put_character(int row, int column, u8 attribute, u8 character)
+{
+    u32 foreground = m_color[attribute & 0xf];
+    u32 background = m_color[attribute >> 4];
+    auto& glyph = m_glyph_atlas[character];
+
+    for (int y = 0; y < character_height; ++y) {
+        auto* out = reinterpret_cast<u32*>(m_buffer.scanLine(row * character_height + y)) + column * character_width;
+        for (int x = 0; x < character_width; ++x)
+            out[x] = (foreground & glyph[y][x]) | (background & ~glyph[y][x]);
+    }
 }
 
-void Mode04Renderer::render()
+void Mode04Renderer::render(const VGA::DirtyMap& dirty)
 {
-    const u8* video_memory = vga().text_memory() + vga().start_address();
+    const u8* video_memory = vga().text_memory();
+    u16 start_address = vga().start_address();
     for (unsigned scan_line = 0; scan_line < 200; ++scan_line) {
-        u8* out = m_buffer.scanLine(scan_line);
-        const u8* in = video_memory;
+        u32 offset = start_address + (scan_line / 2) * 80;
         if ((scan_line & 1))
-            in += 0x2000;
-        in += (scan_line / 2) * 80;
+            offset += 0x2000;
+        if (!dirty.is_dirty(0, offset, 80))
+            continue;
+        u8* out = dirty_row(scan_line);
+        const u8* in = video_memory + offset;
         for (unsigned i = 0; i < 80; ++i) {
             *(out++) = (in[i] >> 6) & 3;
             *(out++) = (in[i] >> 4) & 3;
@@ -90,34 +109,22 @@ void Mode04Renderer::render()
     }
 }
 
-void Mode12Renderer::render()
+void Mode12Renderer::render(const VGA::DirtyMap& dirty)
 {
     const u8* p0 = vga().plane(0);
     const u8* p1 = vga().plane(1);
     const u8* p2 = vga().plane(2);
     const u8* p3 = vga().plane(3);
 
-    int offset = 0;
-
-    u8* bits = buffer_bits();
     for (int y = 0; y < 480; ++y) {
-        u8* px = &bits[y * 640];
-
-        for (int x = 0; x < 640; x += 8, ++offset) {
-#define D(i) ((p0[offset] >> i) & 1) | (((p1[offset] >> i) & 1) << 1) | (((p2[offset] >> i) & 1) << 2) | (((p3[offset] >> i) & 1) << 3)
-            *(px++) = D(7);
-            *(px++) = D(6);
-            *(px++) = D(5);
-            *(px++) = D(4);
-            *(px++) = D(3);
-            *(px++) = D(2);
-            *(px++) = D(1);
-            *(px++) = D(0);
-        }
+        int offset = y * 80;
+        if (!dirty.is_any_plane_dirty(offset, 80))
+            continue;
+        planar_to_chunky(p0 + offset, p1 + offset, p2 + offset, p3 + offset, dirty_row(y), 80);
     }
 }
 
-void Mode0DRenderer::render()
+void Mode0DRenderer::render(const VGA::DirtyMap& dirty)
 {
     const u8* p0 = vga().plane(0);
     const u8* p1 = vga().plane(1);
@@ -130,30 +137,14 @@ void Mode0DRenderer::render()
     p2 += start_address;
     p3 += start_address;
 
-    u8* bits = buffer_bits();
-    int offset = 0;
-
     for (int y = 0; y < 200; ++y) {
-        u8* px = &bits[y * 320];
-#define A0D(i) ((p0[offset] >> i) & 1) | (((p1[offset] >> i) & 1) << 1) | (((p2[offset] >> i) & 1) << 2) | (((p3[offset] >> i) & 1) << 3)
-        for (int x = 0; x < 320; x += 8, ++offset) {
-            *(px++) = D(7);
-            *(px++) = D(6);
-            *(px++) = D(5);
-            *(px++) = D(4);
-            *(px++) = D(3);
-            *(px++) = D(2);
-            *(px++) = D(1);
-            *(px++) = D(0);
-        }
+        int offset = y * 40;
+        if (!dirty.is_any_plane_dirty(start_address + offset, 40))
+            continue;
+        planar_to_chunky(p0 + offset, p1 + offset, p2 + offset, p3 + offset, dirty_row(y), 40);
     }
 }
 
-void BufferedRenderer::will_become_active()
-{
-    const_cast<Screen&>(screen()).set_screen_size(m_buffer.width() * m_scale, m_buffer.height() * m_scale);
-}
-
 void BufferedRenderer::paint(QPainter& p)
 {
     p.drawImage(QRect(0, 0, m_buffer.width() * m_scale, m_buffer.height() * m_scale), m_buffer);
@@ -177,102 +168,204 @@ void Mode13Renderer::synchronize_colors()
         m_buffer.setColor(i, vga().color(i).rgb());
 }
 
-void Mode13Renderer::render()
+void Mode13Renderer::render(const VGA::DirtyMap& dirty)
 {
-    const u8* video_memory = vga().plane(0) + vga().start_address();
-
-    ValueSize mode;
+    // How far apart consecutive bytes of one plane are in a scanline:
+    // byte mode for unchained "Mode X", word mode, or doubleword mode for chain-4 Mode 13h.
+    unsigned shift;
     u32 line_offset = vga().read_register(0x13);
 
     if (vga().read_register(0x14) & 0x40) {
-        mode = DWordSize;
+        shift = 2;
         line_offset <<= 3;
     } else if (vga().read_register(0x17) & 0x40) {
-        mode = ByteSize;
+        shift = 0;
         line_offset <<= 1;
     } else {
-        mode = WordSize;
+        shift = 1;
         line_offset <<= 2;
     }
 
-    auto* bits = buffer_bits();
-    auto* bit = bits;
+    // How many bytes of each plane one scanline is made of.
+    u32 line_length = (320 / 4) << shift;
 
-    if (mode == ByteSize) {
-        for (unsigned y = 0; y < 200; ++y) {
-            for (unsigned x = 0; x < 320; ++x) {
-                u8 plane = x % 4;
-                u32 byte_offset = (plane * 65536) + (y * line_offset) + (x >> 2);
-                *(bit++) = video_memory[byte_offset];
-            }
+    // Rows after the line compare scanline show memory from address 0 (split screen.)
+    unsigned scanlines_per_row = std::max(1, (vga().vertical_display_end() + 1) / 200);
+    unsigned split_row = vga().line_compare() / scanlines_per_row + 1;
+
+    const u8* p0 = vga().plane(0);
+    const u8* p1 = vga().plane(1);
+    const u8* p2 = vga().plane(2);
+    const u8* p3 = vga().plane(3);
+
+    u16 start_address = vga().start_address();
+
+    for (unsigned y = 0; y < 200; ++y) {
+        u32 address = y < split_row ? start_address + y * line_offset : (y - split_row) * line_offset;
+        address &= 0xffff;
+
+        if (address + line_length <= 0x10000) {
+            if (!dirty.is_any_plane_dirty(address, line_length))
+                continue;
+            unchain_to_chunky(p0 + address, p1 + address, p2 + address, p3 + address, dirty_row(y), 320 / 4, shift);
+            continue;
         }
-    } else if (mode == WordSize) {
-        for (unsigned y = 0; y < 200; ++y) {
-            for (unsigned x = 0; x < 320; ++x) {
-                u8 plane = x % 4;
-                u32 byte_offset = (plane * 65536) + (y * line_offset) + ((x >> 1) & ~1);
-                *(bit++) = video_memory[byte_offset];
-            }
+
+        // This scanline wraps around the end of the planes, just go slow.
+        u8* out = dirty_row(y);
+        for (unsigned x = 0; x < 320 / 4; ++x) {
+            u32 offset = (address + (x << shift)) & 0xffff;
+            *(out++) = p0[offset];
+            *(out++) = p1[offset];
+            *(out++) = p2[offset];
+            *(out++) = p3[offset];
         }
-    } else if (mode == DWordSize) {
-        for (unsigned y = 0; y < 200; ++y) {
-            for (unsigned x = 0; x < 320; ++x) {
-                u8 plane = x % 4;
-                u32 byte_offset = (plane * 65536) + (y * line_offset) + (x & ~3);
-                *(bit++) = video_memory[byte_offset];
-            }
+    }
+}
+
+bool VBERenderer::update_buffer_format()
+{
+    QImage::Format format;
+    switch (vga().vbe_bits_per_pixel()) {
+    case 8:
+        format = QImage::Format_Indexed8;
+        break;
+    case 15:
+        format = QImage::Format_RGB555;
+        break;
+    case 16:
+        format = QImage::Format_RGB16;
+        break;
+    default:
+        format = QImage::Format_RGB32;
+        break;
+    }
+
+    if (m_buffer.width() == vga().vbe_width() && m_buffer.height() == vga().vbe_height() && m_buffer.format() == format)
+        return false;
+
+    vlog(LogScreen, "VBE buffer is now %ux%ux%u", vga().vbe_width(), vga().vbe_height(), vga().vbe_bits_per_pixel());
+    m_buffer = QImage(vga().vbe_width(), vga().vbe_height(), format);
+    if (format == QImage::Format_Indexed8) {
+        m_buffer.setColorCount(256);
+        synchronize_colors();
+    }
+    m_buffer.fill(0);
+    return true;
+}
+
+void VBERenderer::will_become_active()
+{
+    update_buffer_format();
+}
+
+void VBERenderer::synchronize_colors()
+{
+    if (m_buffer.format() != QImage::Format_Indexed8)
+        return;
+    for (unsigned i = 0; i < 256; ++i)
+        m_buffer.setColor(i, vga().color(i).rgb());
+}
+
+void VBERenderer::render(const VGA::DirtyMap&)
+{
+    update_buffer_format();
+
+    const u8* in = vga().vbe_display();
+    const u8* display_end = in + vga().vbe_display_size();
+    u32 bytes_per_pixel = (vga().vbe_bits_per_pixel() + 7) / 8;
+    u32 line_size = m_buffer.width() * bytes_per_pixel;
+
+    for (int y = 0; y < m_buffer.height(); ++y, in += vga().vbe_bytes_per_line()) {
+        if (in + line_size > display_end)
+            break;
+        u8* out = dirty_row(y);
+        if (bytes_per_pixel < 3) {
+            memcpy(out, in, line_size);
+            continue;
+        }
+        // The framebuffer is B, G, R(, X) in memory, which needs an opaque alpha for QImage.
+        auto* out_pixel = reinterpret_cast<QRgb*>(out);
+        for (int x = 0; x < m_buffer.width(); ++x) {
+            const u8* pixel = &in[x * bytes_per_pixel];
+            out_pixel[x] = qRgb(pixel[2], pixel[1], pixel[0]);
         }
     }
 }
 
 void TextRenderer::will_become_active()
 {
-    const_cast<Screen&>(screen()).set_screen_size(m_character_width * m_columns, m_character_height * m_rows);
+    m_needs_full_render = true;
 }
 
-void TextRenderer::paint(QPainter& p)
+void TextRenderer::render(const VGA::DirtyMap& dirty)
 {
-    auto* text_ptr = vga().text_memory() + vga().start_address() * 2;
-
-    // Repaint everything
-    for (int y = 0; y < m_rows; ++y) {
-        for (int x = 0; x < m_columns; ++x) {
-            put_character(p, y, x, text_ptr[1], text_ptr[0]);
-            text_ptr += 2;
+    u32 row_offset = vga().start_address() * 2;
+    const u32 row_length = columns * 2;
+    auto* text_memory = vga().text_memory();
+    u16* last_cells = m_cells;
+
+    for (int y = 0; y < rows; ++y, row_offset += row_length, last_cells += columns) {
+        if (!m_needs_full_render && !dirty.is_dirty(0, row_offset, row_length))
+            continue;
+        const u8* cell = text_memory + row_offset;
+        for (int x = 0; x < columns; ++x, cell += 2) {
+            u16 value = weld<u16>(cell[1], cell[0]);
+            if (!m_needs_full_render && last_cells[x] == value)
+                continue;
+            last_cells[x] = value;
+            put_character(y, x, cell[1], cell[0]);
         }
     }
 
+    m_needs_full_render = false;
+}
+
+void TextRenderer::paint(QPainter& p)
+{
+    p.drawImage(0, 0, m_buffer);
+
     if (vga().cursor_enabled()) {
         u16 raw_cursor = vga().cursor_location() - vga().start_address();
-        u16 screen_columns = screen().current_column_count();
+        u16 screen_columns = vga().text_columns();
         u16 row = screen_columns ? (raw_cursor / screen_columns) : 0;
         u16 column = screen_columns ? (raw_cursor % screen_columns) : 0;
         u8 cursor_start = vga().cursor_start_scanline();
         u8 cursor_end = vga().cursor_end_scanline();
 
         p.fillRect(
-            column * m_character_width,
-            row * m_character_height + cursor_start,
-            m_character_width,
+            column * character_width,
+            row * character_height + cursor_start,
+            character_width,
             cursor_end - cursor_start,
-            m_brush[14]);
+            QColor(m_color[14]));
     }
 }
 
 void TextRenderer::synchronize_colors()
 {
     for (int i = 0; i < 16; ++i) {
-        m_color[i] = vga().palette_color(i);
-        m_brush[i] = QBrush(m_color[i]);
+        QRgb color = vga().palette_color(i).rgb();
+        if (color == m_color[i])
+            continue;
+        m_color[i] = color;
+        m_needs_full_render = true;
     }
 }
 
 void TextRenderer::synchronize_font()
 {
-    auto vector = screen().machine().cpu().get_real_mode_interrupt_vector(0x43);
-    auto physical_address = PhysicalAddress::from_real_mode(vector);
-    auto* fbmp = (const fontcharbitmap_t*)(screen().machine().cpu().pointer_to_physical_memory(physical_address));
+    const u8* font = vga().font();
 
-    for (int i = 0; i < 256; ++i)
-        m_character[i] = QBitmap::fromData(QSize(m_character_width, m_character_height), fbmp[i].data, QImage::Format_Mono);
+    if (!memcmp(m_font, font, sizeof(m_font)))
+        return;
+    memcpy(m_font, font, sizeof(m_font));
+    m_needs_full_render = true;
+
+    for (int i = 0; i < 256; ++i) {
+        for (int y = 0; y < character_height; ++y) {
+            for (int x = 0; x < character_width; ++x)
+                m_glyph_atlas[i][y][x] = (m_font[i * character_height + y] & (0x80 >> x)) ? 0xffffffff : 0;
+        }
+    }
 }
@@ -25,128 +25,184 @@
 #pragma once
 
 #include "types.h"
+#include "vga.h"
 #include <QBitmap>
 #include <QBrush>
 #include <QImage>
+#include <climits>
 
-class Screen;
-class VGA;
+class Machine;
 
+// Renderers turn the video hardware state for one kind of mode into a picture.
+// They don't know about widgets, so they can be used headlessly too (see Display.)
 class Renderer {
 public:
-    const Screen& screen() const;
-    const VGA& vga() const;
+    virtual ~Renderer() { }
+
+    Machine& machine() const { return m_machine; }
+
+    // The VGA state to render from, see VGA::acquire_snapshot().
+    const VGA::Snapshot& vga() const;
+
+    // The size of the painted picture.
+    virtual QSize size() const = 0;
+
+    virtual bool is_buffered() const { return false; }
 
     virtual void synchronize_font() = 0;
     virtual void synchronize_colors() = 0;
     virtual void will_become_active() = 0;
-    virtual void render() = 0;
+
+    // Brings the renderer's picture up to date, only converting what's in the dirty map.
+    virtual void render(const VGA::DirtyMap&) = 0;
     virtual void paint(QPainter&) = 0;
 
 protected:
-    explicit Renderer(Screen& screen)
-        : m_screen(screen)
+    explicit Renderer(Machine& machine)
+        : m_machine(machine)
     {
     }
 
 private:
-    Screen& m_screen;
+    Machine& m_machine;
 };
 
 class TextRenderer final : public Renderer {
 public:
-    explicit TextRenderer(Screen& screen)
-        : Renderer(screen)
-    {
-    }
+    explicit TextRenderer(Machine&);
 
     virtual void synchronize_font() override;
     virtual void synchronize_colors() override;
     virtual void will_become_active() override;
-    virtual void render() override { }
+    virtual void render(const VGA::DirtyMap&) override;
     virtual void paint(QPainter&) override;
+    virtual QSize size() const override { return QSize(columns * character_width, rows * character_height); }
 
 private:
-    void put_character(QPainter&, int row, int column, u8 color, u8 character);
+    void put_character(int row, int column, u8 attribute, u8 character);
 
-    int m_rows { 25 };
-    int m_columns { 80 };
-    int m_character_width { 8 };
-    int m_character_height { 16 };
+    static constexpr int rows = 25;
+    static constexpr int columns = 80;
+    static constexpr int character_width = 8;
+    static constexpr int character_height = 16;
 
-    QBitmap m_character[256];
-    QBrush m_brush[16];
-    QColor m_color[16];
+    // Cells are drawn in here as they change, and the cursor is drawn on top in paint().
+    QImage m_buffer;
+    bool m_needs_full_render { true };
+
+    // What each cell looked like (character in the low byte, attribute in the high byte) when we last drew it.
+    u16 m_cells[rows * columns] {};
+
+    // The font is pre-expanded into one mask per pixel, so a cell is just (foreground & mask) | (background & ~mask).
+    // It's only rebuilt when the font bytes change.
+    u8 m_font[256 * character_height] {};
+    u32 m_glyph_atlas[256][character_height][character_width] {};
+
+    QRgb m_color[16] {};
 };
 
 class DummyRenderer final : public Renderer {
 public:
-    explicit DummyRenderer(Screen& screen)
-        : Renderer(screen)
+    explicit DummyRenderer(Machine& machine)
+        : Renderer(machine)
     {
     }
 
     virtual void synchronize_font() override { }
     virtual void synchronize_colors() override { }
     virtual void will_become_active() override { }
-    virtual void render() override { }
+    virtual void render(const VGA::DirtyMap&) override { }
     virtual void paint(QPainter&) override { }
+    virtual QSize size() const override { return QSize(); }
 };
 
 class BufferedRenderer : public Renderer {
 public:
     virtual void paint(QPainter&) override;
-    virtual void will_become_active() override;
+    virtual void will_become_active() override { }
+    virtual QSize size() const override { return m_buffer.size() * m_scale; }
+    virtual bool is_buffered() const override { return true; }
+
+    // The unscaled picture, with the palette in its color table if it's indexed.
+    const QImage& buffer() const { return m_buffer; }
+    int scale() const { return m_scale; }
+
+    // The range of buffer rows rendered since the last call. Empty (first > last) if none were.
+    void take_dirty_rows(int& first, int& last);
 
 protected:
-    explicit BufferedRenderer(Screen&, int width, int height, int scale = 1);
-    u8* buffer_bits() { return m_buffer.bits(); }
+    explicit BufferedRenderer(Machine&, int width, int height, int scale = 1);
+    // Where to draw buffer row `y`, which is then reported by take_dirty_rows().
+    // Only ask for rows that are actually redrawn: this detaches the buffer if someone holds a copy of it.
+    u8* dirty_row(int y);
 
     QImage m_buffer;
     int m_scale { 1 };
+
+private:
+    int m_first_dirty_row { INT_MAX };
+    int m_last_dirty_row { -1 };
 };
 
 class Mode04Renderer final : public BufferedRenderer {
 public:
-    explicit Mode04Renderer(Screen&);
+    explicit Mode04Renderer(Machine&);
 
     virtual void synchronize_font() override { }
     virtual void synchronize_colors() override { }
-    virtual void render() override;
+    virtual void render(const VGA::DirtyMap&) override;
 };
 
 class Mode0DRenderer final : public BufferedRenderer {
 public:
-    explicit Mode0DRenderer(Screen& screen)
-        : BufferedRenderer(screen, 320, 200, 2)
+    explicit Mode0DRenderer(Machine& machine)
+        : BufferedRenderer(machine, 320, 200, 2)
     {
     }
 
     virtual void synchronize_font() override { }
     virtual void synchronize_colors() override;
-    virtual void render() override;
+    virtual void render(const VGA::DirtyMap&) override;
 };
 
 class Mode12Renderer final : public BufferedRenderer {
 public:
-    explicit Mode12Renderer(Screen& screen)
-        : BufferedRenderer(screen, 640, 480)
+    explicit Mode12Renderer(Machine& machine)
+        : BufferedRenderer(machine, 640, 480)
     {
     }
 
     virtual void synchronize_font() override { }
     virtual void synchronize_colors() override;
-    virtual void render() override;
+    virtual void render(const VGA::DirtyMap&) override;
 };
 
 class Mode13Renderer final : public BufferedRenderer {
 public:
-    explicit Mode13Renderer(Screen& screen)
-        : BufferedRenderer(screen, 320, 200, 2)
+    explicit Mode13Renderer(Machine& machine)
+        : BufferedRenderer(machine, 320, 200, 2)
+    {
+    }
+
+    virtual void synchronize_font() override { }
+    virtual void synchronize_colors() override;
+    virtual void render(const VGA::DirtyMap&) override;
+};
+
+// Shows the VBE linear framebuffer. Guests draw into it without going through any device,
+// so every refresh converts the whole visible picture.
+class VBERenderer final : public BufferedRenderer {
+public:
+    explicit VBERenderer(Machine& machine)
+        : BufferedRenderer(machine, 640, 480)
     {
     }
 
     virtual void synchronize_font() override { }
     virtual void synchronize_colors() override;
-    virtual void render() override;
+    virtual void will_become_active() override;
+    virtual void render(const VGA::DirtyMap&) override;
+
+private:
+    bool update_buffer_format();
 };
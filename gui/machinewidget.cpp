@@ -30,7 +30,6 @@
 #include "palettewidget.h"
 #include "screen.h"
 #include <QtCore/QCoreApplication>
-#include <QtCore/QTimer>
 #include <QtWidgets/QAction>
 #include <QtWidgets/QFileDialog>
 #include <QtWidgets/QToolBar>
@@ -43,8 +42,6 @@ struct MachineWidget::Private {
     QAction* pauseMachine;
     QAction* stopMachine;
     QAction* rebootMachine;
-
-    QTimer syncTimer;
 };
 
 MachineWidget::MachineWidget(Machine& m)
@@ -109,9 +106,6 @@ MachineWidget::MachineWidget(Machine& m)
     connect(d->startMachine, SIGNAL(triggered(bool)), SLOT(onStartTriggered()));
     connect(d->stopMachine, SIGNAL(triggered(bool)), SLOT(onStopTriggered()));
 
-    QObject::connect(&d->syncTimer, SIGNAL(timeout()), &screen(), SLOT(flush_key_buffer()));
-    d->syncTimer.start(10);
-
     QObject::connect(qApp, SIGNAL(aboutToQuit()), &machine(), SLOT(stop()));
 }
 
@@ -124,8 +118,7 @@ void MachineWidget::onFloppyATriggered()
     QString fileName = QFileDialog::getOpenFileName(this, tr("Choose floppy A image"));
     if (fileName.isNull())
         return;
-    machine().floppy0().set_image_path(fileName);
-    vlog(LogDisk, "floppy0 image changed to %s", qPrintable(fileName));
+    machine().change_floppy_image(machine().floppy0(), fileName);
 }
 
 void MachineWidget::onFloppyBTriggered()
@@ -133,8 +126,7 @@ void MachineWidget::onFloppyBTriggered()
     QString fileName = QFileDialog::getOpenFileName(this, tr("Choose floppy B image"));
     if (fileName.isNull())
         return;
-    machine().floppy1().set_image_path(fileName);
-    vlog(LogDisk, "floppy1 image changed to %s", qPrintable(fileName));
+    machine().change_floppy_image(machine().floppy1(), fileName);
 }
 
 void MachineWidget::onPauseTriggered()
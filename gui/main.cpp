@@ -23,7 +23,11 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "CPU.h"
+#include "DiskDrive.h"
 #include "Common.h"
+#include "FrameCapture.h"
+#include "InputLog.h"
+#include "OverlayDiskBackend.h"
 #include "debugger.h"
 #include "iodevice.h"
 #include "machine.h"
@@ -31,10 +35,12 @@
 #include "screen.h"
 #include "settings.h"
 #include <QFile>
+#include <QtGui/QGuiApplication>
 #include <QtWidgets/QApplication>
 #include <signal.h>
 
 static void parse_arguments(const QStringList& arguments);
+static int run_overlay_tool(int argc, char** argv);
 
 RuntimeOptions options;
 
@@ -46,20 +52,41 @@ static void sigint_handler(int)
 
 void hard_exit(int exit_code)
 {
+    InputLog::flush_all_logs();
+    DiskDrive::flush_all_drives_for_exit();
     exit(exit_code);
 }
 
 int main(int argc, char** argv)
 {
+    if (argc > 1 && QString::fromLatin1(argv[1]).startsWith("--overlay-"))
+        return run_overlay_tool(argc, argv);
+
     OwnPtr<QCoreApplication> app;
+    bool headless = false;
+    bool capture = false;
 
     for (int i = 1; i < argc; ++i) {
-        if (QString::fromLatin1(argv[i]) == "--no-gui") {
-            app = make<QCoreApplication>(argc, argv);
-            break;
+        if (QString::fromLatin1(argv[i]) == "--no-gui")
+            headless = true;
+        else if (QString::fromLatin1(argv[i]) == "--capture")
+            capture = true;
+        else if (QString::fromLatin1(argv[i]) == "--software-gl") {
+            // Mesa's llvmpipe, so the OpenGL screen path works (and can be tested) without a GPU.
+            qputenv("LIBGL_ALWAYS_SOFTWARE", "1");
+            QCoreApplication::setAttribute(Qt::AA_UseSoftwareOpenGL);
         }
     }
 
+    if (headless && capture) {
+        // Painting frames needs QtGui, but not a display server.
+        if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+        app = make<QGuiApplication>(argc, argv);
+    } else if (headless) {
+        app = make<QCoreApplication>(argc, argv);
+    }
+
     if (!app) {
         app = make<QApplication>(argc, argv);
         QApplication::setWindowIcon(QIcon(":/icons/computron.ico"));
@@ -91,9 +118,20 @@ int main(int argc, char** argv)
         vlog(LogInit, "%s present", device.name());
     });
 
-    if (machine->settings().is_for_autotest()) {
-        machine->cpu().main_loop();
-        return 0;
+    // Without a GUI, just let the worker run (e.g for --replay or autotests.)
+    if (headless || machine->settings().is_for_autotest()) {
+        OwnPtr<FrameCapture> frame_capture;
+        if (!options.capture_path.isEmpty()) {
+            frame_capture = make<FrameCapture>(*machine, options.capture_path, options.capture_every_nth_frame);
+            if (!frame_capture->start())
+                return 1;
+        }
+        return app->exec();
+    }
+
+    if (!options.capture_path.isEmpty()) {
+        fprintf(stderr, "--capture only works together with --no-gui.\n");
+        return 1;
     }
 
     MainWindow mainWindow;
@@ -104,6 +142,27 @@ int main(int argc, char** argv)
     return app->exec();
 }
 
+int run_overlay_tool(int argc, char** argv)
+{
+    QString command = QString::fromLatin1(argv[1]);
+    auto argument = [&](int index) { return QFile::decodeName(argv[index]); };
+
+    bool ok;
+    if (command == "--overlay-create" && argc == 4)
+        ok = OverlayDiskBackend::create(argument(3), argument(2));
+    else if (command == "--overlay-commit" && argc == 3)
+        ok = OverlayDiskBackend::commit(argument(2));
+    else if (command == "--overlay-flatten" && argc == 4)
+        ok = OverlayDiskBackend::flatten(argument(2), argument(3));
+    else {
+        fprintf(stderr, "usage: computron --overlay-create [base image] [overlay]\n");
+        fprintf(stderr, "       computron --overlay-commit [overlay]\n");
+        fprintf(stderr, "       computron --overlay-flatten [overlay] [output image]\n");
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
+
 void parse_arguments(const QStringList& arguments)
 {
     for (auto it = arguments.begin(); it != arguments.end();) {
@@ -140,6 +199,8 @@ void parse_arguments(const QStringList& arguments)
             options.novlog = true;
         else if (argument == "--no-log-exceptions")
             options.log_exceptions = false;
+        else if (argument == "--deterministic")
+            options.deterministic = true;
         else if (argument == "--config") {
             ++it;
             if (it == arguments.end()) {
@@ -156,10 +217,58 @@ void parse_arguments(const QStringList& arguments)
             }
             options.autotest_path = (*it);
             continue;
+        } else if (argument == "--record") {
+            ++it;
+            if (it == arguments.end()) {
+                fprintf(stderr, "usage: computron --record [filename]\n");
+                hard_exit(1);
+            }
+            options.record_path = (*it);
+            continue;
+        } else if (argument == "--replay") {
+            ++it;
+            if (it == arguments.end()) {
+                fprintf(stderr, "usage: computron --replay [filename]\n");
+                hard_exit(1);
+            }
+            options.replay_path = (*it);
+            continue;
+        } else if (argument == "--capture") {
+            ++it;
+            if (it == arguments.end()) {
+                fprintf(stderr, "usage: computron --capture [directory|filename|-]\n");
+                hard_exit(1);
+            }
+            options.capture_path = (*it);
+            continue;
+        } else if (argument == "--capture-every") {
+            ++it;
+            bool ok = false;
+            if (it != arguments.end())
+                options.capture_every_nth_frame = (*it).toUInt(&ok);
+            if (!ok || !options.capture_every_nth_frame) {
+                fprintf(stderr, "usage: computron --capture-every [frame count]\n");
+                hard_exit(1);
+            }
+            ++it;
+            continue;
         }
         ++it;
     }
 
+    if (!options.record_path.isEmpty() && !options.replay_path.isEmpty()) {
+        fprintf(stderr, "Can't use --record and --replay at the same time.\n");
+        hard_exit(1);
+    }
+
+    // Frames captured to stdout mustn't be interleaved with log output.
+    if (options.capture_path == "-")
+        options.novlog = true;
+
+    // Recording and replaying only make sense if time is a function of the instruction count.
+    if (!options.record_path.isEmpty() || !options.replay_path.isEmpty())
+        options.deterministic = true;
+
 #ifndef CT_TRACE
     if (options.trace) {
         fprintf(stderr, "Rebuild with #define CT_TRACE if you want --trace to work.\n");
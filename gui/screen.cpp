@@ -25,57 +25,77 @@
 #include "screen.h"
 #include "CPU.h"
 #include "Common.h"
-#include "Renderer.h"
-#include "busmouse.h"
+#include "InputLog.h"
+#include "RenderThread.h"
 #include "debug.h"
-#include "keyboard.h"
 #include "machine.h"
 #include "settings.h"
 #include "vga.h"
 #include <QtCore/QDebug>
-#include <QtCore/QMutex>
-#include <QtCore/QQueue>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QTimer>
 #include <QtGui/QBitmap>
+#include <QtGui/QGuiApplication>
+#include <QtGui/QOpenGLShaderProgram>
 #include <QtGui/QPaintEvent>
 #include <QtGui/QPainter>
-
-struct fontcharbitmap_t {
-    u8 data[16];
-};
-
-static Screen* s_self = 0L;
+#include <QtGui/QScreen>
+#include <algorithm>
+#include <climits>
 
 struct Screen::Private {
-    QMutex key_queue_lock;
-
-    QQueue<u16> key_queue;
-    QQueue<u8> raw_queue;
-
     QTimer refresh_timer;
     QTimer periodic_refresh_timer;
-
-    OwnPtr<TextRenderer> text_renderer;
-    OwnPtr<Mode04Renderer> mode04_renderer;
-    OwnPtr<Mode0DRenderer> mode0D_renderer;
-    OwnPtr<Mode12Renderer> mode12_renderer;
-    OwnPtr<Mode13Renderer> mode13_renderer;
-    OwnPtr<DummyRenderer> dummy_renderer;
+    QElapsedTimer since_last_refresh;
+    int host_frame_interval_ms { 16 };
+
+    OwnPtr<RenderThread> render_thread;
+    Display::Frame frame;
+
+    // Indexed frames go to the GPU as an 8-bit texture, and a fragment shader looks up the palette and scales.
+    // If any of that isn't available, we fall back to QPainter.
+    OwnPtr<QOpenGLShaderProgram> program;
+    GLuint pixel_texture { 0 };
+    GLuint palette_texture { 0 };
+    QSize pixel_texture_size;
+    QVector<QRgb> palette_in_texture;
+    // Rows that changed since the pixel texture was last uploaded (first > last if none did.)
+    int first_stale_row { INT_MAX };
+    int last_stale_row { -1 };
 };
 
+static const char vertex_shader_source[] = R"(
+attribute vec2 position;
+varying vec2 texture_position;
+void main()
+{
+    texture_position = vec2(position.x + 1.0, 1.0 - position.y) * 0.5;
+    gl_Position = vec4(position, 0.0, 1.0);
+}
+)";
+
+static const char fragment_shader_source[] = R"(
+#ifdef GL_ES
+precision mediump float;
+#endif
+uniform sampler2D pixels;
+uniform sampler2D palette;
+varying vec2 texture_position;
+void main()
+{
+    float index = texture2D(pixels, texture_position).r;
+    gl_FragColor = vec4(texture2D(palette, vec2((index * 255.0 + 0.5) / 256.0, 0.5)).rgb, 1.0);
+}
+)";
+
 Screen::Screen(Machine& m)
     : QOpenGLWidget(nullptr)
     , d(make<Private>())
     , m_machine(m)
 {
-    s_self = this;
-
-    d->text_renderer = make<TextRenderer>(*this);
-    d->mode04_renderer = make<Mode04Renderer>(*this);
-    d->mode0D_renderer = make<Mode0DRenderer>(*this);
-    d->mode12_renderer = make<Mode12Renderer>(*this);
-    d->mode13_renderer = make<Mode13Renderer>(*this);
-    d->dummy_renderer = make<DummyRenderer>(*this);
+    d->render_thread = make<RenderThread>(m);
+    connect(d->render_thread.ptr(), SIGNAL(frame_ready(const Display::Frame&)), this, SLOT(on_frame_ready(const Display::Frame&)));
+    d->render_thread->start();
 
     init();
 
@@ -83,107 +103,70 @@ Screen::Screen(Machine& m)
 
     setMouseTracking(true);
 
-    // This timer is kicked whenever screen memory is modified.
+    // The VGA notifies us at the start of each emulated vertical retrace with changes to show,
+    // and the render thread sends us a frame. Don't show them more often than the host display can, though.
+    if (auto* host_screen = QGuiApplication::primaryScreen()) {
+        if (host_screen->refreshRate() > 0)
+            d->host_frame_interval_ms = std::max(1, qRound(1000 / host_screen->refreshRate()));
+    }
     d->refresh_timer.setSingleShot(true);
-    d->refresh_timer.setInterval(50);
+    d->refresh_timer.setTimerType(Qt::PreciseTimer);
     connect(&d->refresh_timer, SIGNAL(timeout()), this, SLOT(refresh()));
 
-    // This timer does a forced refresh() every second, in case we miss anything.
-    // FIXME: This would not be needed if we had perfect invalidation + scanline timing.
+    // This timer forces a render every second, in case we miss anything (e.g the font changing in RAM.)
     d->periodic_refresh_timer.setInterval(1000);
     d->periodic_refresh_timer.start();
-    connect(&d->periodic_refresh_timer, SIGNAL(timeout()), this, SLOT(refresh()));
+    connect(&d->periodic_refresh_timer, SIGNAL(timeout()), d->render_thread.ptr(), SLOT(request_render()));
 }
 
 Screen::~Screen()
 {
+    // Stop rendering before anything it uses goes away.
+    d->render_thread.clear();
+
+    makeCurrent();
+    if (d->pixel_texture)
+        glDeleteTextures(1, &d->pixel_texture);
+    if (d->palette_texture)
+        glDeleteTextures(1, &d->palette_texture);
+    d->program.clear();
+    doneCurrent();
 }
 
 MouseObserver& Screen::mouse_observer()
 {
-    return machine().busmouse();
+    return machine().input_log();
 }
 
 void Screen::schedule_refresh()
 {
-    if (!d->refresh_timer.isActive())
-        d->refresh_timer.start();
+    if (d->refresh_timer.isActive())
+        return;
+    int elapsed_ms = d->since_last_refresh.isValid() ? d->since_last_refresh.elapsed() : d->host_frame_interval_ms;
+    d->refresh_timer.start(std::max(0, d->host_frame_interval_ms - elapsed_ms));
 }
 
 void Screen::notify()
 {
-    if (d->refresh_timer.isActive())
-        return;
-    QMetaObject::invokeMethod(this, "schedule_refresh", Qt::QueuedConnection);
+    d->render_thread->request_render();
 }
 
-class RefreshGuard {
-public:
-    RefreshGuard(Machine& machine)
-        : m_machine(machine)
-    {
-        m_machine.vga().will_refresh_screen();
-    }
-    ~RefreshGuard() { m_machine.vga().did_refresh_screen(); }
-
-private:
-    Machine& m_machine;
-};
-
-inline bool is_video_mode_using_vga_memory(u8 video_mode)
+void Screen::on_frame_ready(const Display::Frame& frame)
 {
-    return video_mode == 0x0D || video_mode == 0x12 || video_mode == 0x13;
+    // We may get several frames per refresh, so remember every row any of them changed.
+    d->first_stale_row = std::min(d->first_stale_row, frame.first_dirty_row);
+    d->last_stale_row = std::max(d->last_stale_row, frame.last_dirty_row);
+    d->frame = frame;
+    set_screen_size(frame.image.width() * frame.scale, frame.image.height() * frame.scale);
+    schedule_refresh();
 }
 
 void Screen::refresh()
 {
-    RefreshGuard guard(machine());
-
-    u8 video_mode = current_video_mode();
-    bool video_mode_changed = false;
-
-    if (m_video_mode_in_last_refresh != video_mode) {
-        vlog(LogScreen, "Video mode changed to %02X", video_mode);
-        m_video_mode_in_last_refresh = video_mode;
-        video_mode_changed = true;
-    }
-
-    if (video_mode_changed) {
-        renderer().will_become_active();
-    }
-
-    if (is_video_mode_using_vga_memory(video_mode)) {
-        if (machine().vga().is_palette_dirty()) {
-            renderer().synchronize_colors();
-            machine().vga().set_palette_dirty(false);
-        }
-    }
-
-    renderer().synchronize_font();
-    renderer().synchronize_colors();
-    renderer().render();
-
+    d->since_last_refresh.start();
     update();
 }
 
-Renderer& Screen::renderer()
-{
-    switch (current_video_mode()) {
-    case 0x03:
-        return *d->text_renderer;
-    case 0x04:
-        return *d->mode04_renderer;
-    case 0x0D:
-        return *d->mode0D_renderer;
-    case 0x12:
-        return *d->mode12_renderer;
-    case 0x13:
-        return *d->mode13_renderer;
-    default:
-        return *d->dummy_renderer;
-    }
-}
-
 void Screen::set_screen_size(int width, int height)
 {
     if (m_width == width && m_height == height)
@@ -203,10 +186,97 @@ void Screen::resizeEvent(QResizeEvent* e)
     update();
 }
 
-void Screen::paintEvent(QPaintEvent*)
+void Screen::initializeGL()
 {
-    QPainter p(this);
-    renderer().paint(p);
+    initializeOpenGLFunctions();
+
+    auto program = make<QOpenGLShaderProgram>();
+    if (!program->addShaderFromSourceCode(QOpenGLShader::Vertex, vertex_shader_source)
+        || !program->addShaderFromSourceCode(QOpenGLShader::Fragment, fragment_shader_source)
+        || !program->link()) {
+        vlog(LogScreen, "Couldn't set up the palette shader, drawing with QPainter: %s", qPrintable(program->log()));
+        return;
+    }
+
+    auto make_texture = [this] {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        return texture;
+    };
+    d->pixel_texture = make_texture();
+    d->palette_texture = make_texture();
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 256, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+
+    d->program = std::move(program);
+    vlog(LogScreen, "Drawing indexed modes with OpenGL (%s)", reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+}
+
+void Screen::upload_indexed_frame()
+{
+    const QImage& image = d->frame.image;
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, d->pixel_texture);
+    if (d->pixel_texture_size != image.size()) {
+        // QImage pads scanlines to 32 bits, which is what GL_UNPACK_ALIGNMENT 4 expects.
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, image.width(), image.height(), 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, image.constBits());
+        d->pixel_texture_size = image.size();
+    } else if (d->first_stale_row <= d->last_stale_row) {
+        int first = std::max(d->first_stale_row, 0);
+        int last = std::min(d->last_stale_row, image.height() - 1);
+        if (first <= last)
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, image.width(), last - first + 1, GL_LUMINANCE, GL_UNSIGNED_BYTE, image.constScanLine(first));
+    }
+    d->first_stale_row = INT_MAX;
+    d->last_stale_row = -1;
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, d->palette_texture);
+    if (d->palette_in_texture != image.colorTable()) {
+        u8 palette[256 * 4] {};
+        for (int i = 0; i < image.colorCount() && i < 256; ++i) {
+            QRgb color = image.color(i);
+            palette[i * 4 + 0] = qRed(color);
+            palette[i * 4 + 1] = qGreen(color);
+            palette[i * 4 + 2] = qBlue(color);
+            palette[i * 4 + 3] = 0xff;
+        }
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 256, 1, GL_RGBA, GL_UNSIGNED_BYTE, palette);
+        d->palette_in_texture = image.colorTable();
+    }
+}
+
+void Screen::paintGL()
+{
+    const QImage& image = d->frame.image;
+    if (image.isNull())
+        return;
+
+    if (!d->program || image.format() != QImage::Format_Indexed8) {
+        // Next time we get to use the texture, it'll need everything.
+        d->pixel_texture_size = QSize();
+        QPainter p(this);
+        p.drawImage(QRect(0, 0, image.width() * d->frame.scale, image.height() * d->frame.scale), image);
+        return;
+    }
+
+    upload_indexed_frame();
+
+    static const GLfloat quad[] = { -1, -1, 1, -1, -1, 1, 1, 1 };
+    d->program->bind();
+    d->program->setUniformValue("pixels", 0);
+    d->program->setUniformValue("palette", 1);
+    d->program->enableAttributeArray("position");
+    d->program->setAttributeArray("position", quad, 2);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    d->program->disableAttributeArray("position");
+    d->program->release();
 }
 
 u8 Screen::current_video_mode() const
@@ -268,7 +338,6 @@ void Screen::mouseReleaseEvent(QMouseEvent* e)
 #include <QDebug>
 #include <QHash>
 #include <QKeyEvent>
-#include <QMutexLocker>
 
 static QHash<QString, u16> normals;
 static QHash<QString, u16> shifts;
@@ -502,11 +571,6 @@ void Screen::keyPressEvent(QKeyEvent* event)
 
     u16 scancode = scan_code_from_key_event(event);
 
-    if (!machine().keyboard().is_enabled()) {
-        vlog(LogScreen, "KeyPress event while keyboard disabled");
-        return;
-    }
-
     //qDebug() << "KeyPress:" << native_key_from_key_event(event) << "mapped to" << key_name << "modifiers" << event->modifiers() << "scancode:" << scancode;
 
     if (key_name == "F11")
@@ -514,19 +578,7 @@ void Screen::keyPressEvent(QKeyEvent* event)
     else if (key_name == "F12")
         releaseMouse();
 
-    QMutexLocker locker(&d->key_queue_lock);
-
-    if (scancode != 0) {
-        d->key_queue.enqueue(scancode);
-        //printf("Queued %04X (%s)\n", scancode, qPrintable(key_name));
-    }
-
-    if (extended[key_name])
-        d->raw_queue.enqueue(0xE0);
-
-    d->raw_queue.enqueue(make_code[key_name]);
-
-    machine().keyboard().did_enqueue_data();
+    machine().input_log().post_key_press(scancode, extended[key_name], make_code[key_name]);
 }
 
 void Screen::keyReleaseEvent(QKeyEvent* event)
@@ -537,92 +589,7 @@ void Screen::keyReleaseEvent(QKeyEvent* event)
         return;
     }
 
-    if (!machine().keyboard().is_enabled()) {
-        vlog(LogScreen, "KeyRelease event while keyboard disabled");
-        return;
-    }
-
-    QMutexLocker l(&d->key_queue_lock);
     QString key_name = key_name_from_key_event(event);
-
-    if (extended[key_name])
-        d->raw_queue.enqueue(0xE0);
-
-    d->raw_queue.enqueue(break_code[key_name]);
-    machine().keyboard().did_enqueue_data();
+    machine().input_log().post_key_release(extended[key_name], break_code[key_name]);
     event->ignore();
 }
-
-u16 Screen::next_key()
-{
-    QMutexLocker l(&d->key_queue_lock);
-
-    d->raw_queue.clear();
-    if (!d->key_queue.isEmpty())
-        return d->key_queue.dequeue();
-
-    return 0;
-}
-
-u16 Screen::peek_key()
-{
-    QMutexLocker l(&d->key_queue_lock);
-
-    d->raw_queue.clear();
-    if (!d->key_queue.isEmpty())
-        return d->key_queue.head();
-
-    return 0;
-}
-
-u8 Screen::pop_key_data()
-{
-    QMutexLocker l(&d->key_queue_lock);
-
-    u8 key = 0;
-    if (!d->raw_queue.isEmpty())
-        key = d->raw_queue.dequeue();
-    return key;
-}
-
-bool Screen::has_raw_key()
-{
-    QMutexLocker l(&d->key_queue_lock);
-    return !d->raw_queue.isEmpty();
-}
-
-void Screen::flush_key_buffer()
-{
-    QMutexLocker l(&d->key_queue_lock);
-
-    if (!d->raw_queue.isEmpty() && machine().cpu().get_if())
-        machine().keyboard().did_enqueue_data();
-}
-
-bool kbd_has_data()
-{
-    if (!s_self)
-        return false;
-    return s_self->has_raw_key();
-}
-
-u16 kbd_getc()
-{
-    if (!s_self)
-        return 0x0000;
-    return s_self->next_key();
-}
-
-u16 kbd_hit()
-{
-    if (!s_self)
-        return 0x0000;
-    return s_self->peek_key();
-}
-
-u8 kbd_pop_raw()
-{
-    if (!s_self)
-        return 0x00;
-    return s_self->pop_key_data();
-}
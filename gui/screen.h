@@ -24,17 +24,19 @@
 
 #pragma once
 
+#include "Display.h"
 #include "OwnPtr.h"
 #include "types.h"
+#include <QOpenGLFunctions>
 #include <QOpenGLWidget>
 #include <QtCore/QHash>
 #include <QtWidgets/QWidget>
 
 class Machine;
 class MouseObserver;
-class Renderer;
 
-class Screen final : public QOpenGLWidget {
+class Screen final : public QOpenGLWidget
+    , protected QOpenGLFunctions {
     Q_OBJECT
 public:
     explicit Screen(Machine&);
@@ -49,11 +51,6 @@ public:
     u8 current_row_count() const;
     u8 current_column_count() const;
 
-    u16 next_key();
-    u16 peek_key();
-    u8 pop_key_data();
-    bool has_raw_key();
-
     void set_screen_size(int width, int height);
 
 protected:
@@ -68,18 +65,18 @@ public slots:
     bool load_keymap(const QString& filename);
 
 private slots:
-    void flush_key_buffer();
     void schedule_refresh();
+    void on_frame_ready(const Display::Frame&);
 
 private:
-    void paintEvent(QPaintEvent*) override;
+    void initializeGL() override;
+    void paintGL() override;
+    void upload_indexed_frame();
     void resizeEvent(QResizeEvent*) override;
     void init();
 
     MouseObserver& mouse_observer();
 
-    Renderer& renderer();
-
     int m_width { 0 };
     int m_height { 0 };
 
@@ -92,7 +89,5 @@ private:
 
     struct Private;
     OwnPtr<Private> d;
-
-    u8 m_video_mode_in_last_refresh { 0xFF };
     Machine& m_machine;
 };
@@ -24,6 +24,7 @@
 
 #include "worker.h"
 #include "CPU.h"
+#include "debug.h"
 #include "machine.h"
 
 Worker::Worker(Machine& machine)
@@ -38,29 +39,61 @@ Worker::~Worker()
 
 void Worker::run()
 {
-    m_machine.make_cpu(Badge<Worker>());
-    m_machine.make_devices(Badge<Worker>());
-    m_machine.did_initialize_worker(Badge<Worker>());
-    while (true) {
-        m_machine.cpu().main_loop();
-        msleep(50);
+    if (!m_initialized) {
+        m_machine.make_cpu(Badge<Worker>());
+        m_machine.make_devices(Badge<Worker>());
+        m_initialized = true;
+        m_state = State::Running;
+        m_machine.did_initialize_worker(Badge<Worker>());
     }
+
+    // This only returns once someone calls stop().
+    m_machine.cpu().main_loop();
+    m_state = State::Stopped;
 }
 
-void Worker::shutdown()
+void Worker::resume()
 {
-    // FIXME: Implement shutdown
-    hard_exit(0);
+    switch (m_state) {
+    case State::Running:
+        break;
+    case State::Paused:
+        m_state = State::Running;
+        m_machine.cpu().queue_command(CPU::Resume);
+        break;
+    case State::Stopped:
+        // Starting a stopped machine is like powering it back on.
+        m_state = State::Running;
+        m_machine.cpu().queue_command(CPU::Resume);
+        m_machine.cpu().queue_command(CPU::HardReboot);
+        start();
+        break;
+    }
 }
 
-void Worker::exit_debugger()
+void Worker::pause()
 {
-    m_machine.cpu().queue_command(CPU::ExitDebugger);
+    if (m_state != State::Running)
+        return;
+    m_state = State::Paused;
+    m_machine.cpu().queue_command(CPU::Pause);
 }
 
-void Worker::enter_debugger()
+void Worker::stop()
 {
-    m_machine.cpu().queue_command(CPU::EnterDebugger);
+    if (m_state == State::Stopped)
+        return;
+    m_machine.cpu().queue_command(CPU::Stop);
+
+    // Can't wait for ourselves.
+    if (QThread::currentThread() == this)
+        return;
+
+    // The CPU might be stuck somewhere we can't interrupt it (e.g the debugger console.)
+    if (!wait(1000)) {
+        vlog(LogExit, "Worker didn't stop in time, exiting anyway");
+        hard_exit(0);
+    }
 }
 
 void Worker::reboot_machine()
@@ -25,24 +25,43 @@
 #pragma once
 
 #include <QThread>
+#include <atomic>
 
 class Machine;
 
+// The Worker thread owns the CPU and devices, and runs the CPU main loop.
+//
+// Run state transitions are requested from any thread and picked up by the CPU
+// at the next instruction boundary (or right away, if it's halted):
+//
+//     Running <-> Paused    pause() / resume(), the CPU blocks until resumed.
+//     Running  -> Stopped   stop(), main_loop() returns and the thread exits.
+//     Paused   -> Stopped   stop()
+//     Stopped  -> Running   resume(), the thread restarts and the machine reboots.
 class Worker final : public QThread {
     Q_OBJECT
 public:
+    enum class State {
+        Running,
+        Paused,
+        Stopped,
+    };
+
     explicit Worker(Machine&);
     virtual ~Worker() override;
 
-    void enter_debugger();
-    void exit_debugger();
+    State state() const { return m_state; }
+
+    void resume();
+    void pause();
+    void stop();
     void reboot_machine();
 
-public slots:
-    void run() override;
-    void shutdown();
+protected:
+    virtual void run() override;
 
 private:
     Machine& m_machine;
-    bool m_active { false };
+    std::atomic<State> m_state { State::Stopped };
+    bool m_initialized { false };
 };
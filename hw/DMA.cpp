@@ -23,10 +23,50 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "DMA.h"
+#include "CPU.h"
+#include "debug.h"
+#include "machine.h"
+
+//#define DMA_DEBUG
+
+// Two cascaded 8237s: channels 0-3 move bytes, channels 4-7 move 16-bit words
+// (and channel 4 is the cascade.) The page registers supply the address bits above
+// the 16 bits the 8237 itself counts, so a transfer wraps within its 64 KiB (8-bit)
+// or 128 KiB (16-bit) page.
+
+struct DMAChannel {
+    u16 base_address { 0 };
+    u16 base_count { 0 };
+    u16 current_address { 0 };
+    u16 current_count { 0 };
+    u8 page { 0 };
+    u8 mode { 0 };
+    bool masked { true };
+    bool terminal_count { false };
+
+    bool autoinitialize() const { return mode & 0x10; }
+    bool address_decrement() const { return mode & 0x20; }
+};
+
+struct DMAController {
+    DMAChannel channel[4];
+    bool flip_flop { false };
+    u8 command { 0 };
+    u8 request { 0 };
+    u8 status { 0 };
+};
 
 struct DMA::Private {
+    DMAController controller[2];
+    u8 page_registers[16];
+
+    DMAController& controller_for(unsigned channel) { return controller[channel >> 2]; }
+    DMAChannel& channel(unsigned channel) { return controller[channel >> 2].channel[channel & 3]; }
 };
 
+// Page register port (offset from 0x80) for each channel.
+static const u8 page_register_for_channel[8] = { 0x7, 0x3, 0x1, 0x2, 0xf, 0xb, 0x9, 0xa };
+
 DMA::DMA(Machine& machine)
     : IODevice("DMA", machine)
     , d(make<Private>())
@@ -37,6 +77,8 @@ DMA::DMA(Machine& machine)
         listen(i, IODevice::ReadWrite);
     for (size_t i = 0xc0; i <= 0xde; i += 2)
         listen(i, IODevice::ReadWrite);
+
+    reset();
 }
 
 DMA::~DMA()
@@ -45,6 +87,9 @@ DMA::~DMA()
 
 void DMA::reset()
 {
+    d->controller[0] = DMAController();
+    d->controller[1] = DMAController();
+    memset(d->page_registers, 0, sizeof(d->page_registers));
 }
 
 void DMA::out8(u16 port, u8 data)
@@ -54,11 +99,191 @@ void DMA::out8(u16 port, u8 data)
         return;
     }
 
+    if (port >= 0x80 && port <= 0x8f) {
+        d->page_registers[port & 0xf] = data;
+        return;
+    }
+
+    // The second controller's registers are on even ports only.
+    unsigned controller_index = port >= 0xc0;
+    unsigned reg = controller_index ? (port - 0xc0) >> 1 : port;
+    DMAController& controller = d->controller[controller_index];
+
+    if (reg < 8) {
+        DMAChannel& channel = controller.channel[reg >> 1];
+        u16& base = (reg & 1) ? channel.base_count : channel.base_address;
+        u16& current = (reg & 1) ? channel.current_count : channel.current_address;
+        if (!controller.flip_flop)
+            base = (base & 0xff00) | data;
+        else
+            base = (base & 0x00ff) | (data << 8);
+        current = base;
+        controller.flip_flop = !controller.flip_flop;
+        channel.terminal_count = false;
+        return;
+    }
+
+    switch (reg) {
+    case 0x8:
+        controller.command = data;
+        break;
+    case 0x9:
+        // Software requests are only meaningful for memory-to-memory, which the PC doesn't wire up.
+        controller.request = data & 7;
+        break;
+    case 0xa:
+        controller.channel[data & 3].masked = data & 4;
+        break;
+    case 0xb:
+        controller.channel[data & 3].mode = data & 0xfc;
+        break;
+    case 0xc:
+        controller.flip_flop = false;
+        break;
+    case 0xd:
+        // Master clear.
+        controller = DMAController();
+        break;
+    case 0xe:
+        for (auto& channel : controller.channel)
+            channel.masked = false;
+        break;
+    case 0xf:
+        for (unsigned i = 0; i < 4; ++i)
+            controller.channel[i].masked = data & (1 << i);
+        break;
+    }
+
+#ifdef DMA_DEBUG
     vlog(LogDMA, "out %04x <- %02x", port, data);
+#endif
 }
 
 u8 DMA::in8(u16 port)
 {
-    vlog(LogDMA, "in %04x", port);
-    return 0;
+    if (port >= 0x80 && port <= 0x8f)
+        return d->page_registers[port & 0xf];
+
+    unsigned controller_index = port >= 0xc0;
+    unsigned reg = controller_index ? (port - 0xc0) >> 1 : port;
+    DMAController& controller = d->controller[controller_index];
+
+    if (reg < 8) {
+        DMAChannel& channel = controller.channel[reg >> 1];
+        u16 value = (reg & 1) ? channel.current_count : channel.current_address;
+        u8 data = controller.flip_flop ? (value >> 8) : (value & 0xff);
+        controller.flip_flop = !controller.flip_flop;
+        return data;
+    }
+
+    switch (reg) {
+    case 0x8: {
+        // Reading the status register clears the terminal count bits.
+        u8 data = 0;
+        for (unsigned i = 0; i < 4; ++i) {
+            if (controller.channel[i].terminal_count)
+                data |= 1 << i;
+        }
+        data |= controller.status & 0xf0;
+        for (auto& channel : controller.channel)
+            channel.terminal_count = false;
+        return data;
+    }
+    case 0xf: {
+        u8 data = 0xf0;
+        for (unsigned i = 0; i < 4; ++i) {
+            if (controller.channel[i].masked)
+                data |= 1 << i;
+        }
+        return data;
+    }
+    default:
+        vlog(LogDMA, "in %04x", port);
+        return 0;
+    }
+}
+
+u32 DMA::write_to_memory(unsigned channel, const u8* data, u32 size)
+{
+    return transfer(channel, TransferType::ToMemory, const_cast<u8*>(data), size);
+}
+
+u32 DMA::read_from_memory(unsigned channel, u8* data, u32 size)
+{
+    return transfer(channel, TransferType::FromMemory, data, size);
+}
+
+bool DMA::has_reached_terminal_count(unsigned channel) const
+{
+    return d->controller[(channel >> 2) & 1].channel[channel & 3].terminal_count;
+}
+
+u32 DMA::transfer(unsigned channel_index, TransferType type, u8* data, u32 size)
+{
+    ASSERT(channel_index < 8);
+    DMAChannel& channel = d->channel(channel_index);
+    if (channel.masked) {
+        vlog(LogDMA, "Channel %u is masked, nothing transferred", channel_index);
+        return 0;
+    }
+    if (d->controller_for(channel_index).command & 0x04) {
+        vlog(LogDMA, "Controller for channel %u is disabled, nothing transferred", channel_index);
+        return 0;
+    }
+
+    auto channel_type = static_cast<TransferType>((channel.mode >> 2) & 3);
+    if (channel_type != type && channel_type != TransferType::Verify) {
+        vlog(LogDMA, "Channel %u is programmed for the other direction (mode %02x)", channel_index, channel.mode);
+        return 0;
+    }
+
+    // Sizes and addresses count in units of the channel's width.
+    bool is_16bit = channel_index >= 4;
+    unsigned shift = is_16bit ? 1 : 0;
+    u32 page = d->page_registers[page_register_for_channel[channel_index]];
+    u32 page_base = is_16bit ? ((page & 0xfe) << 16) : (page << 16);
+
+    u32 units_left = (u32)channel.current_count + 1;
+    u32 units = std::min(size >> shift, units_left);
+    auto& cpu = machine().cpu();
+
+    u32 done = 0;
+    while (done < units) {
+        u32 run;
+        if (channel.address_decrement()) {
+            // Rare enough to go one unit at a time.
+            run = 1;
+        } else {
+            // Don't let the copy run past the wrap of the 16-bit address counter.
+            run = std::min(units - done, 0x10000u - channel.current_address);
+        }
+        PhysicalAddress address(page_base + ((u32)channel.current_address << shift));
+        u8* buffer = data + (done << shift);
+        if (channel_type == TransferType::ToMemory)
+            cpu.write_physical_memory_block(address, buffer, run << shift);
+        else if (channel_type == TransferType::FromMemory)
+            cpu.read_physical_memory_block(address, buffer, run << shift);
+        if (channel.address_decrement())
+            channel.current_address -= 1;
+        else
+            channel.current_address += run;
+        done += run;
+    }
+
+    channel.current_count -= done;
+    if (done == units_left) {
+        channel.terminal_count = true;
+        if (channel.autoinitialize()) {
+            channel.current_address = channel.base_address;
+            channel.current_count = channel.base_count;
+        } else {
+            channel.current_count = 0xffff;
+            channel.masked = true;
+        }
+    }
+
+#ifdef DMA_DEBUG
+    vlog(LogDMA, "Channel %u moved %u bytes %s %08x", channel_index, done << shift, type == TransferType::ToMemory ? "to" : "from", page_base);
+#endif
+    return done << shift;
 }
@@ -36,7 +36,24 @@ public:
     virtual u8 in8(u16 port) override;
     virtual void out8(u16 port, u8 data) override;
 
+    // Device side of a channel. A device with data ready calls these instead of raising DREQ
+    // once per byte; the whole block moves in one go, bounded by the channel's remaining count.
+    // They return how many bytes were transferred, which is 0 if the channel is masked or
+    // programmed for the other direction.
+    u32 write_to_memory(unsigned channel, const u8* data, u32 size);
+    u32 read_from_memory(unsigned channel, u8* data, u32 size);
+
+    // Whether the channel has reached terminal count since it was last programmed.
+    bool has_reached_terminal_count(unsigned channel) const;
+
 private:
+    enum class TransferType {
+        Verify = 0,
+        ToMemory = 1,
+        FromMemory = 2,
+    };
+    u32 transfer(unsigned channel, TransferType, u8* data, u32 size);
+
     struct Private;
     OwnPtr<Private> d;
 };
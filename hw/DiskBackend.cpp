@@ -0,0 +1,215 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "DiskBackend.h"
+#include "OverlayDiskBackend.h"
+#include "debug.h"
+#include <QFile>
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+OwnPtr<DiskBackend> DiskBackend::open(const QString& path, Type type, bool read_only)
+{
+    if (OverlayDiskBackend::is_overlay(path))
+        return OverlayDiskBackend::open(path, read_only);
+    if (type == Type::Mapped) {
+        if (auto backend = MappedDiskBackend::open(path, read_only))
+            return backend;
+        vlog(LogDisk, "Falling back to file I/O for %s", qPrintable(path));
+    }
+    return FileDiskBackend::open(path, read_only);
+}
+
+int DiskBackend::open_file(const QString& path, bool& read_only)
+{
+    QByteArray native_path = QFile::encodeName(path);
+    int fd = -1;
+    if (!read_only) {
+        fd = ::open(native_path.constData(), O_RDWR | O_CLOEXEC);
+        if (fd < 0 && (errno == EACCES || errno == EROFS || errno == EPERM)) {
+            vlog(LogDisk, "Disk image %s is read-only", qPrintable(path));
+            read_only = true;
+        }
+    }
+    if (read_only)
+        fd = ::open(native_path.constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        vlog(LogDisk, "Failed to open disk image %s: %s", qPrintable(path), strerror(errno));
+    return fd;
+}
+
+bool DiskBackend::read_fully(int fd, u64 offset, u8* buffer, size_t size)
+{
+    while (size) {
+        ssize_t nread = ::pread(fd, buffer, size, offset);
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (nread == 0) {
+            // Reading past the end of a short image yields zeroes, like the old fread() path did with its unused buffer.
+            memset(buffer, 0, size);
+            return true;
+        }
+        buffer += nread;
+        offset += nread;
+        size -= nread;
+    }
+    return true;
+}
+
+bool DiskBackend::write_fully(int fd, u64 offset, const u8* buffer, size_t size)
+{
+    while (size) {
+        ssize_t nwritten = ::pwrite(fd, buffer, size, offset);
+        if (nwritten < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buffer += nwritten;
+        offset += nwritten;
+        size -= nwritten;
+    }
+    return true;
+}
+
+OwnPtr<DiskBackend> FileDiskBackend::open(const QString& path, bool read_only)
+{
+    int fd = open_file(path, read_only);
+    if (fd < 0)
+        return nullptr;
+    return OwnPtr<DiskBackend>(new FileDiskBackend(path, fd, read_only));
+}
+
+FileDiskBackend::FileDiskBackend(const QString& path, int fd, bool read_only)
+    : DiskBackend(path)
+    , m_fd(fd)
+{
+    m_read_only = read_only;
+    struct stat st;
+    if (fstat(m_fd, &st) == 0)
+        m_size = st.st_size;
+}
+
+FileDiskBackend::~FileDiskBackend()
+{
+    ::close(m_fd);
+}
+
+bool FileDiskBackend::read(u64 offset, u8* buffer, size_t size)
+{
+    if (!read_fully(m_fd, offset, buffer, size)) {
+        vlog(LogDisk, "Read from %s failed at offset %llu: %s", qPrintable(m_path), (unsigned long long)offset, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool FileDiskBackend::write(u64 offset, const u8* buffer, size_t size)
+{
+    if (m_read_only)
+        return false;
+    if (!write_fully(m_fd, offset, buffer, size)) {
+        vlog(LogDisk, "Write to %s failed at offset %llu: %s", qPrintable(m_path), (unsigned long long)offset, strerror(errno));
+        return false;
+    }
+    m_size = std::max<u64>(m_size, offset + size);
+    return true;
+}
+
+bool FileDiskBackend::flush()
+{
+    if (m_read_only)
+        return true;
+    return ::fsync(m_fd) == 0;
+}
+
+OwnPtr<DiskBackend> MappedDiskBackend::open(const QString& path, bool read_only)
+{
+    int fd = open_file(path, read_only);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    int protection = PROT_READ | (read_only ? 0 : PROT_WRITE);
+    void* mapping = mmap(nullptr, st.st_size, protection, MAP_SHARED, fd, 0);
+    // The mapping keeps the file referenced, so we don't need the descriptor.
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        vlog(LogDisk, "Failed to map disk image %s: %s", qPrintable(path), strerror(errno));
+        return nullptr;
+    }
+    return OwnPtr<DiskBackend>(new MappedDiskBackend(path, static_cast<u8*>(mapping), st.st_size, read_only));
+}
+
+MappedDiskBackend::MappedDiskBackend(const QString& path, u8* mapping, u64 size, bool read_only)
+    : DiskBackend(path)
+    , m_mapping(mapping)
+{
+    m_size = size;
+    m_read_only = read_only;
+}
+
+MappedDiskBackend::~MappedDiskBackend()
+{
+    flush();
+    munmap(m_mapping, m_size);
+}
+
+bool MappedDiskBackend::read(u64 offset, u8* buffer, size_t size)
+{
+    size_t available = offset < m_size ? std::min<u64>(size, m_size - offset) : 0;
+    memcpy(buffer, m_mapping + offset, available);
+    memset(buffer + available, 0, size - available);
+    return true;
+}
+
+bool MappedDiskBackend::write(u64 offset, const u8* buffer, size_t size)
+{
+    // A mapping can't grow, so writes past the end of the image fail.
+    if (m_read_only || offset > m_size || size > m_size - offset)
+        return false;
+    memcpy(m_mapping + offset, buffer, size);
+    return true;
+}
+
+bool MappedDiskBackend::flush()
+{
+    if (m_read_only)
+        return true;
+    return msync(m_mapping, m_size, MS_SYNC) == 0;
+}
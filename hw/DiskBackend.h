@@ -0,0 +1,112 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include "OwnPtr.h"
+#include "types.h"
+#include <QString>
+
+// A DiskBackend is the open image file behind a DiskDrive.
+// It is created once when the drive is configured and stays open
+// until the image is swapped out, so sector transfers don't pay
+// for a path lookup and stdio setup on every request.
+class DiskBackend {
+public:
+    enum class Type {
+        File,
+        Mapped,
+    };
+
+    virtual ~DiskBackend() { }
+
+    // Overlay images are recognized by their header, whatever the requested type.
+    static OwnPtr<DiskBackend> open(const QString& path, Type = Type::File, bool read_only = false);
+
+    const QString& path() const { return m_path; }
+    u64 size() const { return m_size; }
+    bool is_read_only() const { return m_read_only; }
+
+    // True if transfers are plain memory copies, so caching them gains nothing.
+    virtual bool is_memory_backed() const { return false; }
+
+    // Positioned transfers; these never move a shared file offset.
+    virtual bool read(u64 offset, u8* buffer, size_t size) = 0;
+    virtual bool write(u64 offset, const u8* buffer, size_t size) = 0;
+    virtual bool flush() { return true; }
+
+protected:
+    explicit DiskBackend(const QString& path)
+        : m_path(path)
+    {
+    }
+
+    // Opens read/write unless read_only is set, falling back to read-only
+    // (and setting read_only) if the image isn't writable.
+    static int open_file(const QString& path, bool& read_only);
+
+    // Loops over short transfers. read_fully() zero-fills past end-of-file.
+    static bool read_fully(int fd, u64 offset, u8* buffer, size_t size);
+    static bool write_fully(int fd, u64 offset, const u8* buffer, size_t size);
+
+    QString m_path;
+    u64 m_size { 0 };
+    bool m_read_only { false };
+};
+
+class FileDiskBackend final : public DiskBackend {
+public:
+    static OwnPtr<DiskBackend> open(const QString& path, bool read_only = false);
+    virtual ~FileDiskBackend() override;
+
+    virtual bool read(u64 offset, u8* buffer, size_t size) override;
+    virtual bool write(u64 offset, const u8* buffer, size_t size) override;
+    virtual bool flush() override;
+
+private:
+    FileDiskBackend(const QString& path, int fd, bool read_only);
+
+    int m_fd { -1 };
+};
+
+// Maps the whole image with MAP_SHARED. Sector transfers are a memcpy
+// to or from the mapping, and flush() is an msync(). Meant for
+// read-mostly images like floppies and install media.
+class MappedDiskBackend final : public DiskBackend {
+public:
+    static OwnPtr<DiskBackend> open(const QString& path, bool read_only = false);
+    virtual ~MappedDiskBackend() override;
+
+    virtual bool is_memory_backed() const override { return true; }
+
+    virtual bool read(u64 offset, u8* buffer, size_t size) override;
+    virtual bool write(u64 offset, const u8* buffer, size_t size) override;
+    virtual bool flush() override;
+
+private:
+    MappedDiskBackend(const QString& path, u8* mapping, u64 size, bool read_only);
+
+    u8* m_mapping { nullptr };
+};
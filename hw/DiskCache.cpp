@@ -0,0 +1,278 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "DiskCache.h"
+#include "DiskBackend.h"
+#include "debug.h"
+#include <algorithm>
+#include <cstring>
+
+DiskCache::DiskCache(DiskBackend& backend, u32 capacity_in_blocks, u32 read_ahead_blocks, WriteMode write_mode)
+    : m_backend(backend)
+    , m_capacity(std::max(capacity_in_blocks, read_ahead_blocks + 1))
+    , m_read_ahead(read_ahead_blocks)
+    , m_write_mode(write_mode)
+{
+}
+
+DiskCache::~DiskCache()
+{
+    if (m_dirty_count)
+        vlog(LogDisk, "Discarding %u dirty blocks for %s", m_dirty_count, qPrintable(m_backend.path()));
+}
+
+u64 DiskCache::block_count() const
+{
+    return (m_backend.size() + block_size - 1) / block_size;
+}
+
+DiskCache::Block* DiskCache::find(u64 index)
+{
+    auto it = m_blocks.find(index);
+    if (it == m_blocks.end())
+        return nullptr;
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    return &*it->second;
+}
+
+DiskCache::Block& DiskCache::insert(u64 index)
+{
+    ASSERT(!m_blocks.count(index));
+    bool recycle = m_blocks.size() >= m_capacity;
+    if (recycle && m_lru.back().dirty && !write_back()) {
+        // Never drop data the guest was told was written. Go over capacity until the backend takes it.
+        vlog(LogDisk, "Could not write back dirty blocks of %s, keeping them cached", qPrintable(m_backend.path()));
+        recycle = false;
+    }
+    if (recycle) {
+        // Recycle the least recently used block's buffer.
+        auto victim = std::prev(m_lru.end());
+        m_blocks.erase(victim->index);
+        m_lru.splice(m_lru.begin(), m_lru, victim);
+        ++m_statistics.evictions;
+    } else {
+        m_lru.push_front({ 0, std::vector<u8>(block_size) });
+    }
+    m_lru.front().index = index;
+    m_blocks[index] = m_lru.begin();
+    return m_lru.front();
+}
+
+bool DiskCache::fill(u64 first_index, u64 count)
+{
+    // One host read for the whole run, then split it into blocks.
+    std::vector<u8> data(count * block_size);
+    ++m_statistics.backend_reads;
+    if (!m_backend.read(first_index * block_size, data.data(), data.size()))
+        return false;
+    for (u64 i = 0; i < count; ++i)
+        memcpy(insert(first_index + i).data.data(), data.data() + i * block_size, block_size);
+    return true;
+}
+
+bool DiskCache::read(u64 offset, u8* buffer, size_t size)
+{
+    if (!size)
+        return true;
+
+    u64 first = offset / block_size;
+    u64 last = (offset + size - 1) / block_size;
+    bool sequential = offset == m_next_sequential_offset;
+    m_next_sequential_offset = offset + size;
+
+    // Requests larger than the cache itself bypass it.
+    if (last - first + 1 > m_capacity - m_read_ahead) {
+        m_statistics.misses += last - first + 1;
+        ++m_statistics.backend_reads;
+        if (!m_backend.read(offset, buffer, size))
+            return false;
+        copy_dirty_blocks(offset, buffer, size);
+        return true;
+    }
+
+    // While the guest is streaming, top up the read-ahead window as soon
+    // as it has consumed everything we fetched ahead of it.
+    u64 end = last + 1;
+    if (sequential && m_read_ahead && end < block_count() && !m_blocks.count(end))
+        end = std::min<u64>(end + m_read_ahead, block_count());
+
+    for (u64 index = first; index < end;) {
+        if (find(index)) {
+            ++m_statistics.hits;
+            ++index;
+            continue;
+        }
+        // Fetch each run of missing blocks with a single host read.
+        u64 run_end = index + 1;
+        while (run_end < end && !m_blocks.count(run_end))
+            ++run_end;
+        u64 missed = std::min(run_end, last + 1) - std::min(index, last + 1);
+        m_statistics.misses += missed;
+        m_statistics.read_ahead_blocks += (run_end - index) - missed;
+        if (!fill(index, run_end - index))
+            return false;
+        index = run_end;
+    }
+
+    for (u64 index = first; index <= last; ++index) {
+        Block* block = find(index);
+        ASSERT(block);
+        u64 block_offset = index * block_size;
+        u64 copy_start = std::max(offset, block_offset);
+        u64 copy_end = std::min(offset + size, block_offset + block_size);
+        memcpy(buffer + (copy_start - offset), block->data.data() + (copy_start - block_offset), copy_end - copy_start);
+    }
+    return true;
+}
+
+void DiskCache::copy_into_block(Block& block, u64 offset, const u8* buffer, size_t size)
+{
+    u64 block_offset = block.index * block_size;
+    u64 copy_start = std::max(offset, block_offset);
+    u64 copy_end = std::min(offset + size, block_offset + block_size);
+    memcpy(block.data.data() + (copy_start - block_offset), buffer + (copy_start - offset), copy_end - copy_start);
+}
+
+void DiskCache::copy_dirty_blocks(u64 offset, u8* buffer, size_t size)
+{
+    // The backend doesn't have these yet, so they win over what it returned.
+    if (!m_dirty_count)
+        return;
+    u64 first = offset / block_size;
+    u64 last = (offset + size - 1) / block_size;
+    for (u64 index = first; index <= last; ++index) {
+        auto it = m_blocks.find(index);
+        if (it == m_blocks.end() || !it->second->dirty)
+            continue;
+        u64 block_offset = index * block_size;
+        u64 copy_start = std::max(offset, block_offset);
+        u64 copy_end = std::min(offset + size, block_offset + block_size);
+        memcpy(buffer + (copy_start - offset), it->second->data.data() + (copy_start - block_offset), copy_end - copy_start);
+    }
+}
+
+bool DiskCache::write_through(u64 offset, const u8* buffer, size_t size)
+{
+    ++m_statistics.backend_writes;
+    if (!m_backend.write(offset, buffer, size))
+        return false;
+
+    // Keep whatever we have cached coherent with what we just wrote.
+    u64 first = offset / block_size;
+    u64 last = (offset + size - 1) / block_size;
+    for (u64 index = first; index <= last; ++index) {
+        auto it = m_blocks.find(index);
+        if (it != m_blocks.end())
+            copy_into_block(*it->second, offset, buffer, size);
+    }
+    return true;
+}
+
+bool DiskCache::write(u64 offset, const u8* buffer, size_t size)
+{
+    if (!size)
+        return true;
+
+    u64 first = offset / block_size;
+    u64 last = (offset + size - 1) / block_size;
+    if (m_write_mode == WriteMode::WriteThrough || last - first + 1 > m_capacity - m_read_ahead)
+        return write_through(offset, buffer, size);
+
+    // Fail now, like a write-through would, rather than accept data that can never be written back.
+    if (m_backend.is_read_only())
+        return false;
+
+    m_written_end = std::max(m_written_end, offset + size);
+    for (u64 index = first; index <= last; ++index) {
+        Block* block = find(index);
+        if (!block) {
+            u64 block_offset = index * block_size;
+            bool covers_block = offset <= block_offset && offset + size >= block_offset + block_size;
+            if (covers_block) {
+                block = &insert(index);
+            } else {
+                // Partial write: the rest of the block has to come from the backend first.
+                ++m_statistics.misses;
+                if (!fill(index, 1))
+                    return false;
+                block = find(index);
+            }
+        }
+        copy_into_block(*block, offset, buffer, size);
+        if (!block->dirty) {
+            block->dirty = true;
+            ++m_dirty_count;
+        }
+    }
+    return true;
+}
+
+bool DiskCache::write_back()
+{
+    if (!m_dirty_count)
+        return true;
+
+    std::vector<Block*> dirty_blocks;
+    dirty_blocks.reserve(m_dirty_count);
+    for (auto& block : m_lru) {
+        if (block.dirty)
+            dirty_blocks.push_back(&block);
+    }
+    std::sort(dirty_blocks.begin(), dirty_blocks.end(), [](auto* a, auto* b) { return a->index < b->index; });
+
+    // Don't extend the image with the unwritten tail of its last block.
+    u64 image_end = std::max(m_backend.size(), m_written_end);
+
+    bool ok = true;
+    std::vector<u8> run;
+    for (size_t i = 0; i < dirty_blocks.size();) {
+        size_t run_end = i + 1;
+        while (run_end < dirty_blocks.size() && dirty_blocks[run_end]->index == dirty_blocks[run_end - 1]->index + 1)
+            ++run_end;
+        u64 run_offset = dirty_blocks[i]->index * block_size;
+        run.resize((run_end - i) * block_size);
+        for (size_t j = i; j < run_end; ++j)
+            memcpy(run.data() + (j - i) * block_size, dirty_blocks[j]->data.data(), block_size);
+        size_t run_size = std::min<u64>(run.size(), image_end - run_offset);
+        ++m_statistics.backend_writes;
+        if (m_backend.write(run_offset, run.data(), run_size)) {
+            for (size_t j = i; j < run_end; ++j)
+                dirty_blocks[j]->dirty = false;
+            m_dirty_count -= run_end - i;
+        } else {
+            ok = false;
+        }
+        i = run_end;
+    }
+    return ok;
+}
+
+void DiskCache::invalidate()
+{
+    ASSERT(!m_dirty_count);
+    m_blocks.clear();
+    m_lru.clear();
+    m_next_sequential_offset = 0;
+}
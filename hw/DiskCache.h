@@ -0,0 +1,117 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include "types.h"
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+class DiskBackend;
+
+// An LRU cache of fixed-size blocks in front of a DiskBackend.
+// Reads that continue where the previous one ended are treated as a
+// sequential stream, and the cache then reads ahead of them so that
+// small BIOS-style requests turn into few, large host reads.
+//
+// In write-through mode, writes go straight to the backend and update cached blocks.
+// In write-back mode, they only dirty cached blocks, which reach the backend when
+// someone calls write_back() or when they're evicted. Adjacent dirty blocks are
+// coalesced into a single host write.
+class DiskCache {
+public:
+    static constexpr u32 block_size = 4096;
+
+    enum class WriteMode {
+        WriteThrough,
+        WriteBack,
+        // Like WriteBack, but the guest's flush requests are ignored.
+        Unsafe,
+    };
+
+    struct Statistics {
+        u64 hits { 0 };
+        u64 misses { 0 };
+        u64 read_ahead_blocks { 0 };
+        u64 evictions { 0 };
+        u64 backend_reads { 0 };
+        u64 backend_writes { 0 };
+    };
+
+    DiskCache(DiskBackend&, u32 capacity_in_blocks, u32 read_ahead_blocks, WriteMode = WriteMode::WriteThrough);
+    ~DiskCache();
+
+    bool read(u64 offset, u8* buffer, size_t size);
+    bool write(u64 offset, const u8* buffer, size_t size);
+
+    // Writes all dirty blocks to the backend. Doesn't sync the backend itself.
+    bool write_back();
+
+    // Drops everything cached. Dirty blocks must have been written back first.
+    void invalidate();
+
+    WriteMode write_mode() const { return m_write_mode; }
+    bool has_dirty_blocks() const { return m_dirty_count; }
+
+    const Statistics& statistics() const { return m_statistics; }
+    u32 cached_block_count() const { return m_blocks.size(); }
+    u32 dirty_block_count() const { return m_dirty_count; }
+    u32 capacity_in_blocks() const { return m_capacity; }
+    u32 read_ahead_blocks() const { return m_read_ahead; }
+
+private:
+    struct Block {
+        u64 index;
+        std::vector<u8> data;
+        bool dirty { false };
+    };
+    using BlockList = std::list<Block>;
+
+    Block* find(u64 index);
+    Block& insert(u64 index);
+    bool fill(u64 first_index, u64 count);
+    u64 block_count() const;
+    bool write_through(u64 offset, const u8* buffer, size_t size);
+    void copy_dirty_blocks(u64 offset, u8* buffer, size_t size);
+    void copy_into_block(Block&, u64 offset, const u8* buffer, size_t size);
+
+    DiskBackend& m_backend;
+    u32 m_capacity { 0 };
+    u32 m_read_ahead { 0 };
+    WriteMode m_write_mode { WriteMode::WriteThrough };
+    u32 m_dirty_count { 0 };
+
+    // The image grows when written past its end, so write-back has to know how far writes went.
+    u64 m_written_end { 0 };
+
+    // Most recently used first.
+    BlockList m_lru;
+    std::unordered_map<u64, BlockList::iterator> m_blocks;
+
+    u64 m_next_sequential_offset { 0 };
+    Statistics m_statistics;
+};
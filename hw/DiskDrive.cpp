@@ -23,24 +23,196 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "DiskDrive.h"
+#include "debug.h"
+#include <QList>
 
-DiskDrive::DiskDrive(const QString& name)
+// Every live drive, so that hard_exit() can still get cached writes to disk.
+static QMutex s_drives_lock;
+static QList<DiskDrive*> s_drives;
+
+DiskDrive::DiskDrive(const QString& name, EventScheduler& scheduler)
     : m_name(name)
+    , m_write_back_timer(make<EventScheduler::Timer>(scheduler, [this] { write_back(); }))
 {
+    QMutexLocker locker(&s_drives_lock);
+    s_drives.append(this);
 }
 
 DiskDrive::~DiskDrive()
 {
+    {
+        QMutexLocker locker(&s_drives_lock);
+        s_drives.removeOne(this);
+    }
+    // Stop the I/O thread before the backend it might be using goes away.
+    m_io_thread.clear();
+    QMutexLocker locker(&m_lock);
+    write_back_and_sync();
+}
+
+void DiskDrive::write_back_and_sync()
+{
+    if (m_cache && !m_cache->write_back())
+        vlog(LogDisk, "%s: Writing back %u cached blocks failed", qPrintable(m_name), m_cache->dirty_block_count());
+    if (m_backend)
+        m_backend->flush();
+}
+
+void DiskDrive::flush_all_drives_for_exit()
+{
+    // This runs on whichever thread is exiting, possibly while the CPU thread is stuck somewhere
+    // (e.g the debugger console) or even in the middle of a drive operation. So it only touches
+    // the cache and backend under the drive lock, and leaves the I/O thread and timer alone.
+    QMutexLocker locker(&s_drives_lock);
+    for (DiskDrive* drive : s_drives) {
+        if (!drive->m_lock.tryLock(1000)) {
+            vlog(LogDisk, "%s: Still busy, cached writes may be lost", qPrintable(drive->m_name));
+            continue;
+        }
+        drive->write_back_and_sync();
+        drive->m_lock.unlock();
+    }
 }
 
 void DiskDrive::set_configuration(Configuration config)
 {
     m_config = std::move(config);
-    m_present = !m_config.image_path.isEmpty();
+    open_backend();
 }
 
 void DiskDrive::set_image_path(const QString& path)
 {
     m_config.image_path = path;
+    open_backend();
+}
+
+void DiskDrive::open_backend()
+{
+    write_back();
+    QMutexLocker locker(&m_lock);
+    m_cache.clear();
+    m_backend.clear();
     m_present = !m_config.image_path.isEmpty();
+    if (!m_present)
+        return;
+    m_backend = DiskBackend::open(m_config.image_path, m_config.backend_type);
+    if (!m_backend) {
+        vlog(LogDisk, "%s: Could not open image %s", qPrintable(m_name), qPrintable(m_config.image_path));
+        return;
+    }
+    // A mapping is already served from the host page cache.
+    if (!m_backend->is_memory_backed() && m_config.cache_size_kib)
+        m_cache = make<DiskCache>(*m_backend, m_config.cache_size_kib * 1024 / DiskCache::block_size, m_config.read_ahead_kib * 1024 / DiskCache::block_size, m_config.cache_mode);
+}
+
+bool DiskDrive::read_sectors(u32 lba, u32 count, u8* buffer)
+{
+    wait_until_idle();
+    return do_read_sectors(lba, count, buffer);
+}
+
+bool DiskDrive::write_sectors(u32 lba, u32 count, const u8* buffer)
+{
+    wait_until_idle();
+    schedule_write_back();
+    return do_write_sectors(lba, count, buffer);
+}
+
+bool DiskDrive::flush()
+{
+    wait_until_idle();
+    return do_flush();
+}
+
+bool DiskDrive::write_back()
+{
+    m_write_back_timer->stop();
+    wait_until_idle();
+    QMutexLocker locker(&m_lock);
+    if (!m_cache || m_cache->write_back())
+        return true;
+    vlog(LogDisk, "%s: Writing back %u cached blocks failed", qPrintable(m_name), m_cache->dirty_block_count());
+    return false;
+}
+
+void DiskDrive::schedule_write_back()
+{
+    // Written data goes out in one batch a little later, instead of with every write.
+    if (!m_cache || m_cache->write_mode() == DiskCache::WriteMode::WriteThrough || m_write_back_timer->is_active())
+        return;
+    m_write_back_timer->start_after((u64)m_config.write_back_delay_ms * 1000000);
+}
+
+void DiskDrive::start_read_sectors(u32 lba, u32 count, u8* buffer)
+{
+    start_async([this, lba, count, buffer] { return do_read_sectors(lba, count, buffer); });
+}
+
+void DiskDrive::start_write_sectors(u32 lba, u32 count, const u8* buffer)
+{
+    schedule_write_back();
+    start_async([this, lba, count, buffer] { return do_write_sectors(lba, count, buffer); });
+}
+
+void DiskDrive::start_flush()
+{
+    start_async([this] { return do_flush(); });
+}
+
+void DiskDrive::start_async(DiskIOThread::Job job)
+{
+    if (!m_io_thread)
+        m_io_thread = make<DiskIOThread>(QString("%1 I/O").arg(m_name));
+    m_io_thread->submit(std::move(job));
+}
+
+bool DiskDrive::finish_async()
+{
+    if (!m_io_thread)
+        return true;
+    return m_io_thread->wait_for_job();
+}
+
+void DiskDrive::wait_until_idle()
+{
+    if (m_io_thread)
+        m_io_thread->wait_until_idle();
+}
+
+bool DiskDrive::do_read_sectors(u32 lba, u32 count, u8* buffer)
+{
+    QMutexLocker locker(&m_lock);
+    if (!m_backend)
+        return false;
+    u64 offset = (u64)lba * bytes_per_sector();
+    size_t size = (size_t)count * bytes_per_sector();
+    if (m_cache)
+        return m_cache->read(offset, buffer, size);
+    return m_backend->read(offset, buffer, size);
+}
+
+bool DiskDrive::do_write_sectors(u32 lba, u32 count, const u8* buffer)
+{
+    QMutexLocker locker(&m_lock);
+    if (!m_backend)
+        return false;
+    u64 offset = (u64)lba * bytes_per_sector();
+    size_t size = (size_t)count * bytes_per_sector();
+    if (m_cache)
+        return m_cache->write(offset, buffer, size);
+    return m_backend->write(offset, buffer, size);
+}
+
+bool DiskDrive::do_flush()
+{
+    QMutexLocker locker(&m_lock);
+    if (!m_backend)
+        return true;
+    if (m_cache) {
+        if (m_cache->write_mode() == DiskCache::WriteMode::Unsafe)
+            return true;
+        if (!m_cache->write_back())
+            return false;
+    }
+    return m_backend->flush();
 }
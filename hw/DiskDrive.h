@@ -24,7 +24,13 @@
 
 #pragma once
 
+#include "DiskBackend.h"
+#include "DiskCache.h"
+#include "DiskIOThread.h"
+#include "EventScheduler.h"
+#include "OwnPtr.h"
 #include "types.h"
+#include <QMutex>
 #include <QString>
 
 class DiskDrive {
@@ -36,9 +42,15 @@ public:
         unsigned sectors { 0 };
         unsigned bytes_per_sector { 0 };
         u8 floppy_type_for_cmos { 0 };
+        DiskBackend::Type backend_type { DiskBackend::Type::File };
+        unsigned cache_size_kib { 4096 };
+        unsigned read_ahead_kib { 64 };
+        DiskCache::WriteMode cache_mode { DiskCache::WriteMode::WriteThrough };
+        // How long written data may sit in a write-back cache, in milliseconds of virtual time.
+        unsigned write_back_delay_ms { 1000 };
     };
 
-    explicit DiskDrive(const QString& name);
+    DiskDrive(const QString& name, EventScheduler&);
     ~DiskDrive();
 
     QString name() const { return m_name; }
@@ -52,6 +64,30 @@ public:
         return (sector - 1) + (head * sectors_per_track()) + (cylinder * sectors_per_track() * heads());
     }
 
+    // Block-level access to the image, shared by IDE, FDC and the BIOS.
+    bool read_sectors(u32 lba, u32 count, u8* buffer);
+    bool write_sectors(u32 lba, u32 count, const u8* buffer);
+    bool flush();
+
+    // Writes out whatever a write-back cache is holding, regardless of cache mode.
+    // Doesn't sync the image itself; flush() does that (unless the cache mode is unsafe.)
+    bool write_back();
+
+    // Writes back and syncs every drive in the process, for exit paths that skip the destructors.
+    // Can be called from any thread.
+    static void flush_all_drives_for_exit();
+
+    // Asynchronous variants that run on the drive's I/O thread. At most one can be in flight,
+    // and its buffer must be left alone until finish_async() has returned its result.
+    // The synchronous calls above wait for any in-flight operation before touching the image.
+    void start_read_sectors(u32 lba, u32 count, u8* buffer);
+    void start_write_sectors(u32 lba, u32 count, const u8* buffer);
+    void start_flush();
+    bool finish_async();
+
+    // Null for images that don't go through the block cache (e.g. mmap'ed ones.)
+    const DiskCache* cache() const { return m_cache.ptr(); }
+
     bool present() const { return m_present; }
     unsigned cylinders() const { return (m_config.sectors / m_config.sectors_per_track / m_config.heads) - 2; }
     unsigned heads() const { return m_config.heads; }
@@ -61,7 +97,22 @@ public:
     u8 floppy_type_for_cmos() const { return m_config.floppy_type_for_cmos; }
 
     //private:
+    void open_backend();
+    void write_back_and_sync();
+    void start_async(DiskIOThread::Job);
+    void schedule_write_back();
+    void wait_until_idle();
+    bool do_read_sectors(u32 lba, u32 count, u8* buffer);
+    bool do_write_sectors(u32 lba, u32 count, const u8* buffer);
+    bool do_flush();
+
     Configuration m_config;
     QString m_name;
     bool m_present { false };
+    // Held for every use of the backend and cache, which the I/O thread and exit paths share with the CPU thread.
+    QMutex m_lock;
+    OwnPtr<DiskBackend> m_backend;
+    OwnPtr<DiskCache> m_cache;
+    OwnPtr<DiskIOThread> m_io_thread;
+    OwnPtr<EventScheduler::Timer> m_write_back_timer;
 };
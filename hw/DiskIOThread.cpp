@@ -0,0 +1,103 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "DiskIOThread.h"
+#include "debug.h"
+
+DiskIOThread::DiskIOThread(const QString& name)
+    : QThread(nullptr)
+{
+    setObjectName(name);
+    start();
+}
+
+DiskIOThread::~DiskIOThread()
+{
+    wait_for_job();
+    {
+        QMutexLocker locker(&m_lock);
+        m_should_exit = true;
+        m_job_submitted.wakeAll();
+    }
+    wait();
+}
+
+void DiskIOThread::submit(Job job)
+{
+    QMutexLocker locker(&m_lock);
+    ASSERT(!m_pending);
+    m_job = std::move(job);
+    m_pending = true;
+    m_running = true;
+    m_job_submitted.wakeAll();
+}
+
+bool DiskIOThread::wait_for_job()
+{
+    QMutexLocker locker(&m_lock);
+    if (!m_pending)
+        return true;
+    while (m_running)
+        m_job_finished.wait(&m_lock);
+    m_pending = false;
+    return m_result;
+}
+
+void DiskIOThread::wait_until_idle()
+{
+    QMutexLocker locker(&m_lock);
+    while (m_running)
+        m_job_finished.wait(&m_lock);
+}
+
+bool DiskIOThread::has_pending_job() const
+{
+    QMutexLocker locker(&m_lock);
+    return m_pending;
+}
+
+void DiskIOThread::run()
+{
+    forever
+    {
+        Job job;
+        {
+            QMutexLocker locker(&m_lock);
+            while (!m_job && !m_should_exit)
+                m_job_submitted.wait(&m_lock);
+            if (m_should_exit)
+                return;
+            job = std::move(m_job);
+            m_job = nullptr;
+        }
+
+        bool result = job();
+
+        QMutexLocker locker(&m_lock);
+        m_result = result;
+        m_running = false;
+        m_job_finished.wakeAll();
+    }
+}
@@ -0,0 +1,66 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+#include <functional>
+
+// Runs a DiskDrive's host I/O off the emulation thread, one job at a time.
+// The submitter picks the result up with wait_for_job(), which blocks only if the
+// job hasn't finished yet.
+class DiskIOThread final : public QThread {
+public:
+    using Job = std::function<bool()>;
+
+    explicit DiskIOThread(const QString& name);
+    virtual ~DiskIOThread() override;
+
+    // Must not be called while a job is pending.
+    void submit(Job);
+
+    // Waits for the pending job and returns its result. Returns true if there was none.
+    bool wait_for_job();
+
+    // Waits for the pending job to finish, but leaves its result for wait_for_job().
+    void wait_until_idle();
+
+    bool has_pending_job() const;
+
+protected:
+    virtual void run() override;
+
+private:
+    mutable QMutex m_lock;
+    QWaitCondition m_job_submitted;
+    QWaitCondition m_job_finished;
+    Job m_job;
+    bool m_pending { false };
+    bool m_running { false };
+    bool m_result { true };
+    bool m_should_exit { false };
+};
@@ -0,0 +1,300 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "EventScheduler.h"
+#include "CPU.h"
+#include "Common.h"
+#include "debug.h"
+#include "machine.h"
+#include <algorithm>
+
+//#define EVENTSCHEDULER_DEBUG
+
+static const u64 nanoseconds_per_second = 1000000000;
+
+// The clock rate used in deterministic mode, i.e one instruction is 40 ns.
+static const u64 deterministic_cycles_per_second = 25000000;
+
+// Initial guess for the emulated instruction rate, refined by calibrate() as we go.
+static const u64 initial_cycles_per_second = 25000000;
+static const u64 min_cycles_per_second = 1000000;
+static const u64 max_cycles_per_second = 4000000000;
+
+static const u64 calibration_interval_ns = 50000000;
+
+// If virtual time drifts further than this from host time (e.g because we sat
+// in the debugger), we stop trying to catch up and just forgive the difference.
+static const i64 max_drift_ns = 100000000;
+
+EventScheduler::Timer::Timer(EventScheduler& scheduler, std::function<void()> callback)
+    : m_scheduler(scheduler)
+    , m_callback(std::move(callback))
+{
+}
+
+EventScheduler::Timer::~Timer()
+{
+    m_scheduler.remove(*this);
+}
+
+void EventScheduler::Timer::start_at(u64 deadline_ns)
+{
+    m_scheduler.schedule(*this, deadline_ns);
+}
+
+void EventScheduler::Timer::start_after(u64 delay_ns)
+{
+    m_scheduler.schedule(*this, m_scheduler.now() + delay_ns);
+}
+
+void EventScheduler::Timer::stop()
+{
+    if (m_active)
+        m_scheduler.unschedule(*this);
+}
+
+EventScheduler::EventScheduler(Machine& machine)
+    : m_machine(machine)
+    , m_deterministic(options.deterministic)
+    , m_paces_idle(!m_deterministic || !options.record_path.isEmpty())
+    , m_cycles_per_second(m_deterministic ? deterministic_cycles_per_second : initial_cycles_per_second)
+{
+    m_base_cycle = current_cycle();
+
+    if (m_paces_idle)
+        m_host_timer.start();
+
+    if (m_deterministic)
+        return;
+
+    m_last_calibration_cycle = m_base_cycle;
+
+    m_calibration_timer = make<Timer>(*this, [this] { calibrate(); });
+    m_calibration_timer->start_after(calibration_interval_ns);
+}
+
+EventScheduler::~EventScheduler()
+{
+}
+
+u64 EventScheduler::current_cycle() const
+{
+    return m_machine.cpu().cycle();
+}
+
+u64 EventScheduler::host_ns() const
+{
+    return m_host_timer.nsecsElapsed();
+}
+
+u64 EventScheduler::now() const
+{
+    return time_for_cycle(current_cycle());
+}
+
+u64 EventScheduler::time_for_cycle(u64 cycle) const
+{
+    if (cycle <= m_base_cycle)
+        return m_base_ns;
+    // Split the multiplication so we don't overflow 64 bits on long uptimes.
+    u64 cycles = cycle - m_base_cycle;
+    return m_base_ns
+        + (cycles / m_cycles_per_second) * nanoseconds_per_second
+        + (cycles % m_cycles_per_second) * nanoseconds_per_second / m_cycles_per_second;
+}
+
+QDateTime EventScheduler::current_datetime() const
+{
+    if (!m_deterministic)
+        return QDateTime::currentDateTime();
+    // Deterministic machines boot at a fixed point in time, and the clock only moves with virtual time.
+    return QDateTime(QDate(2018, 2, 9), QTime(1, 2, 3)).addMSecs(now() / 1000000);
+}
+
+u64 EventScheduler::cycle_for_time(u64 ns) const
+{
+    if (ns <= m_base_ns)
+        return m_base_cycle;
+    u64 elapsed = ns - m_base_ns;
+    // Round up, so that now() >= ns once the CPU has reached the returned cycle.
+    return m_base_cycle
+        + (elapsed / nanoseconds_per_second) * m_cycles_per_second
+        + ((elapsed % nanoseconds_per_second) * m_cycles_per_second + nanoseconds_per_second - 1) / nanoseconds_per_second;
+}
+
+void EventScheduler::schedule(Timer& timer, u64 deadline_ns)
+{
+    // If the timer was already scheduled, its old heap entry goes stale and is skipped later.
+    timer.m_deadline = deadline_ns;
+    timer.m_sequence = m_next_sequence++;
+    timer.m_active = true;
+
+    // The sequence number breaks ties, so events with equal deadlines fire in the order they were scheduled.
+    m_heap.push_back({ deadline_ns, timer.m_sequence, &timer });
+    std::push_heap(m_heap.begin(), m_heap.end(), EntryComparator());
+
+    update_next_event_cycle();
+}
+
+void EventScheduler::unschedule(Timer& timer)
+{
+    timer.m_active = false;
+    update_next_event_cycle();
+}
+
+void EventScheduler::remove(Timer& timer)
+{
+    timer.m_active = false;
+    m_heap.erase(std::remove_if(m_heap.begin(), m_heap.end(), [&](auto& entry) { return entry.timer == &timer; }), m_heap.end());
+    std::make_heap(m_heap.begin(), m_heap.end(), EntryComparator());
+    update_next_event_cycle();
+}
+
+void EventScheduler::update_next_event_cycle()
+{
+    while (!m_heap.empty()) {
+        auto& entry = m_heap.front();
+        if (entry.timer->m_active && entry.timer->m_sequence == entry.sequence)
+            break;
+        std::pop_heap(m_heap.begin(), m_heap.end(), EntryComparator());
+        m_heap.pop_back();
+    }
+
+    if (m_heap.empty())
+        m_next_event_cycle = ~0ull;
+    else
+        m_next_event_cycle = cycle_for_time(m_heap.front().deadline);
+}
+
+void EventScheduler::run_due_events()
+{
+    u64 now_ns = now();
+    while (!m_heap.empty()) {
+        Entry entry = m_heap.front();
+        bool is_stale = !entry.timer->m_active || entry.timer->m_sequence != entry.sequence;
+        if (!is_stale && entry.deadline > now_ns)
+            break;
+        std::pop_heap(m_heap.begin(), m_heap.end(), EntryComparator());
+        m_heap.pop_back();
+        if (is_stale)
+            continue;
+        entry.timer->m_active = false;
+        entry.timer->m_callback();
+    }
+    update_next_event_cycle();
+}
+
+u64 EventScheduler::next_wake_cycle(u64 wake_ns) const
+{
+    if (wake_ns == ~0ull)
+        return m_next_event_cycle;
+    return std::min(m_next_event_cycle, cycle_for_time(wake_ns));
+}
+
+u64 EventScheduler::idle_target_cycle(u64 wake_ns) const
+{
+    u64 wake_cycle = next_wake_cycle(wake_ns);
+
+    // Nothing but the next event can move a deterministic clock, so skip straight to it.
+    // That holds while recording too: idle_timeout_ns() paces how long we sleep, but if a wake-up cuts
+    // the sleep short, we still land on the same cycle a replay (which doesn't sleep) lands on.
+    if (m_deterministic)
+        return wake_cycle == ~0ull ? current_cycle() : std::max(current_cycle(), wake_cycle);
+
+    u64 host_now = host_ns() + m_host_offset_ns;
+    return std::max(current_cycle(), std::min(cycle_for_time(host_now), wake_cycle));
+}
+
+u64 EventScheduler::idle_timeout_ns(u64 wake_ns)
+{
+    u64 wake_cycle = next_wake_cycle(wake_ns);
+    if (wake_cycle == ~0ull)
+        return ~0ull;
+
+    // A deterministic clock doesn't wait for the host, the halted CPU just skips ahead.
+    if (!m_paces_idle)
+        return 0;
+
+    forgive_idle_drift();
+
+    u64 next_wake_ns = time_for_cycle(wake_cycle);
+    u64 host_now = host_ns() + m_host_offset_ns;
+    if (next_wake_ns <= host_now)
+        return 0;
+    return next_wake_ns - host_now;
+}
+
+void EventScheduler::forgive_idle_drift()
+{
+    // A recording machine runs at a fixed clock, so a busy (or paused) stretch can leave it far behind
+    // the host, or far ahead of it. Don't race through idle time to catch up, or freeze the guest
+    // until the host does. There's no calibration to forgive the drift, so do it here.
+    if (!m_deterministic)
+        return;
+    i64 drift = (i64)now() - (i64)(host_ns() + m_host_offset_ns);
+    if (drift > max_drift_ns || drift < -max_drift_ns)
+        m_host_offset_ns += drift;
+}
+
+void EventScheduler::set_cycles_per_second(u64 cycles_per_second)
+{
+    if (cycles_per_second == m_cycles_per_second)
+        return;
+    m_base_ns = now();
+    m_base_cycle = current_cycle();
+    m_cycles_per_second = cycles_per_second;
+    update_next_event_cycle();
+}
+
+void EventScheduler::calibrate()
+{
+    u64 host_now = host_ns();
+    u64 cycle = current_cycle();
+
+    u64 host_elapsed = host_now - m_last_calibration_host_ns;
+    u64 cycles_elapsed = cycle - m_last_calibration_cycle;
+    m_last_calibration_host_ns = host_now;
+    m_last_calibration_cycle = cycle;
+
+    i64 drift = (i64)now() - (i64)(host_now + m_host_offset_ns);
+    if (drift > max_drift_ns || drift < -max_drift_ns) {
+#ifdef EVENTSCHEDULER_DEBUG
+        vlog(LogTimer, "Forgiving %lld ns of drift", (long long)drift);
+#endif
+        m_host_offset_ns += drift;
+        drift = 0;
+    }
+
+    if (host_elapsed && cycles_elapsed) {
+        // Aim to cancel out the current drift over the next interval, but don't overcorrect.
+        double target_ns = std::clamp((double)host_elapsed - drift, host_elapsed / 2.0, host_elapsed * 2.0);
+        double rate = cycles_elapsed * (double)nanoseconds_per_second / target_ns;
+        set_cycles_per_second(std::clamp((u64)rate, min_cycles_per_second, max_cycles_per_second));
+#ifdef EVENTSCHEDULER_DEBUG
+        vlog(LogTimer, "Calibrated: %llu cycles/s (drift %lld ns)", (unsigned long long)m_cycles_per_second, (long long)drift);
+#endif
+    }
+
+    m_calibration_timer->start_after(calibration_interval_ns);
+}
@@ -0,0 +1,146 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include "OwnPtr.h"
+#include "types.h"
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <functional>
+#include <vector>
+
+class Machine;
+
+// The EventScheduler is the machine's single source of time.
+// Virtual time (in nanoseconds) is derived from the CPU cycle counter,
+// and devices schedule callbacks against it instead of owning host timers.
+// The CPU main loop polls next_event_cycle() and calls run_due_events()
+// once the cycle counter gets there, so everything runs on the worker thread.
+//
+// In deterministic mode (--deterministic), the clock rate is fixed and never
+// calibrated against the host, so virtual time depends only on retired instructions.
+// A halted CPU always skips straight to the next event then. While recording (--record),
+// it first sleeps until the host catches up, so the machine stays usable instead of
+// spinning, but that only changes how long the host waits, never where virtual time
+// ends up. Replays don't sleep at all.
+class EventScheduler {
+public:
+    class Timer {
+    public:
+        Timer(EventScheduler&, std::function<void()>);
+        ~Timer();
+
+        void start_at(u64 deadline_ns);
+        void start_after(u64 delay_ns);
+        void stop();
+
+        bool is_active() const { return m_active; }
+        u64 deadline() const { return m_deadline; }
+
+    private:
+        friend class EventScheduler;
+        EventScheduler& m_scheduler;
+        std::function<void()> m_callback;
+        u64 m_deadline { 0 };
+        u64 m_sequence { 0 };
+        bool m_active { false };
+    };
+
+    explicit EventScheduler(Machine&);
+    ~EventScheduler();
+
+    // Current virtual time in nanoseconds.
+    u64 now() const;
+
+    // Guest-visible wall clock time. Tracks the host clock, unless we're deterministic.
+    QDateTime current_datetime() const;
+
+    bool is_deterministic() const { return m_deterministic; }
+
+    // Virtual time at which the CPU will reach the given cycle.
+    u64 time_for_cycle(u64 cycle) const;
+
+    // First CPU cycle at which an event is due, or ~0 if nothing is scheduled.
+    u64 next_event_cycle() const { return m_next_event_cycle; }
+
+    void run_due_events();
+
+    // The cycle a halted CPU should skip ahead to: host time or the next event (or `wake_ns`), whichever comes first.
+    u64 idle_target_cycle(u64 wake_ns = ~0ull) const;
+
+    // How long (in host nanoseconds) a halted CPU can sleep before the next event (or `wake_ns`) is due. ~0 means forever.
+    u64 idle_timeout_ns(u64 wake_ns = ~0ull);
+
+    u64 cycles_per_second() const { return m_cycles_per_second; }
+
+private:
+    struct Entry {
+        u64 deadline;
+        u64 sequence;
+        Timer* timer;
+    };
+
+    struct EntryComparator {
+        bool operator()(const Entry& a, const Entry& b) const
+        {
+            if (a.deadline != b.deadline)
+                return a.deadline > b.deadline;
+            return a.sequence > b.sequence;
+        }
+    };
+
+    void schedule(Timer&, u64 deadline_ns);
+    void unschedule(Timer&);
+    void remove(Timer&);
+
+    u64 current_cycle() const;
+    u64 cycle_for_time(u64 ns) const;
+    u64 host_ns() const;
+    void set_cycles_per_second(u64);
+    void update_next_event_cycle();
+    u64 next_wake_cycle(u64 wake_ns) const;
+    void calibrate();
+    void forgive_idle_drift();
+
+    Machine& m_machine;
+    bool m_deterministic { false };
+    // Whether a halted CPU waits for host time to reach its next event.
+    bool m_paces_idle { false };
+
+    std::vector<Entry> m_heap;
+    u64 m_next_sequence { 1 };
+    u64 m_next_event_cycle { ~0ull };
+
+    // Virtual time is m_base_ns + (cycle - m_base_cycle) at m_cycles_per_second.
+    u64 m_cycles_per_second { 0 };
+    u64 m_base_cycle { 0 };
+    u64 m_base_ns { 0 };
+
+    QElapsedTimer m_host_timer;
+    i64 m_host_offset_ns { 0 };
+    u64 m_last_calibration_cycle { 0 };
+    u64 m_last_calibration_host_ns { 0 };
+    OwnPtr<Timer> m_calibration_timer;
+};
@@ -0,0 +1,381 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "OverlayDiskBackend.h"
+#include "debug.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char overlay_magic[8] = { 'C', 'T', 'O', 'V', 'R', 'L', 'A', 'Y' };
+static const u32 overlay_version = 1;
+
+// The header block is one page; the base image path follows the fixed fields.
+static const u32 header_block_size = 4096;
+
+struct OverlayHeader {
+    char magic[8];
+    u32 version;
+    u32 cluster_size;
+    u64 virtual_size;
+    u64 table_offset;
+    u32 cluster_count;
+    u32 base_path_length;
+};
+
+static_assert(sizeof(OverlayHeader) == 40, "OverlayHeader must match the on-disk layout");
+
+static u64 round_up(u64 value, u64 alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static QString resolve_base_path(const QString& overlay_path, const QString& base_path)
+{
+    if (QFileInfo(base_path).isAbsolute())
+        return base_path;
+    return QFileInfo(overlay_path).dir().filePath(base_path);
+}
+
+bool OverlayDiskBackend::is_overlay(const QString& path)
+{
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    char magic[sizeof(overlay_magic)];
+    bool ok = read_fully(fd, 0, reinterpret_cast<u8*>(magic), sizeof(magic));
+    ::close(fd);
+    return ok && !memcmp(magic, overlay_magic, sizeof(magic));
+}
+
+OwnPtr<DiskBackend> OverlayDiskBackend::open(const QString& path, bool read_only)
+{
+    return load(path, read_only);
+}
+
+OwnPtr<OverlayDiskBackend> OverlayDiskBackend::load(const QString& path, bool read_only)
+{
+    int fd = open_file(path, read_only);
+    if (fd < 0)
+        return nullptr;
+    OwnPtr<OverlayDiskBackend> backend(new OverlayDiskBackend(path, fd, read_only));
+    if (!backend->load_header())
+        return nullptr;
+    return backend;
+}
+
+OverlayDiskBackend::OverlayDiskBackend(const QString& path, int fd, bool read_only)
+    : DiskBackend(path)
+    , m_fd(fd)
+{
+    m_read_only = read_only;
+}
+
+OverlayDiskBackend::~OverlayDiskBackend()
+{
+    if (!publish_new_clusters())
+        vlog(LogDisk, "%s: Could not write the cluster table: %s", qPrintable(m_path), strerror(errno));
+    ::close(m_fd);
+}
+
+bool OverlayDiskBackend::load_header()
+{
+    OverlayHeader header;
+    if (!read_fully(m_fd, 0, reinterpret_cast<u8*>(&header), sizeof(header)) || memcmp(header.magic, overlay_magic, sizeof(overlay_magic))) {
+        vlog(LogDisk, "%s is not an overlay image", qPrintable(m_path));
+        return false;
+    }
+    if (header.version != overlay_version) {
+        vlog(LogDisk, "%s: Unsupported overlay version %u", qPrintable(m_path), header.version);
+        return false;
+    }
+    if (!header.cluster_size || (header.cluster_size & (header.cluster_size - 1)) || header.base_path_length > header_block_size - sizeof(header)
+        || header.table_offset < header_block_size || (u64)header.cluster_count * header.cluster_size < header.virtual_size) {
+        vlog(LogDisk, "%s: Corrupt overlay header", qPrintable(m_path));
+        return false;
+    }
+
+    QByteArray base_path(header.base_path_length, Qt::Uninitialized);
+    if (!read_fully(m_fd, sizeof(header), reinterpret_cast<u8*>(base_path.data()), base_path.size()))
+        return false;
+
+    m_size = header.virtual_size;
+    m_cluster_size = header.cluster_size;
+    m_table_offset = header.table_offset;
+    m_table.resize(header.cluster_count);
+    if (!read_fully(m_fd, m_table_offset, reinterpret_cast<u8*>(m_table.data()), m_table.size() * sizeof(u64))) {
+        vlog(LogDisk, "%s: Failed to read cluster table: %s", qPrintable(m_path), strerror(errno));
+        return false;
+    }
+    m_data_offset = round_up(m_table_offset + m_table.size() * sizeof(u64), m_cluster_size);
+
+    struct stat st;
+    if (fstat(m_fd, &st) < 0)
+        return false;
+    m_next_cluster_offset = std::max<u64>(m_data_offset, round_up(st.st_size, m_cluster_size));
+
+    for (u64 data : m_table) {
+        if (data && (data < m_data_offset || data >= m_next_cluster_offset || data % m_cluster_size)) {
+            vlog(LogDisk, "%s: Corrupt cluster table entry %llx", qPrintable(m_path), (unsigned long long)data);
+            return false;
+        }
+    }
+
+    m_base_path = QFile::decodeName(base_path);
+    m_base = DiskBackend::open(resolve_base_path(m_path, m_base_path), Type::File, true);
+    if (!m_base) {
+        vlog(LogDisk, "%s: Could not open base image %s", qPrintable(m_path), qPrintable(m_base_path));
+        return false;
+    }
+    return true;
+}
+
+u32 OverlayDiskBackend::allocated_cluster_count() const
+{
+    return std::count_if(m_table.begin(), m_table.end(), [](u64 data) { return data != 0; });
+}
+
+bool OverlayDiskBackend::read(u64 offset, u8* buffer, size_t size)
+{
+    while (size) {
+        u64 index = offset / m_cluster_size;
+        u32 offset_in_cluster = offset % m_cluster_size;
+        size_t chunk = std::min<u64>(size, m_cluster_size - offset_in_cluster);
+        if (index >= m_table.size()) {
+            memset(buffer, 0, size);
+            return true;
+        }
+        bool ok;
+        if (u64 data = m_table[index])
+            ok = read_fully(m_fd, data + offset_in_cluster, buffer, chunk);
+        else
+            ok = m_base->read(offset, buffer, chunk);
+        if (!ok) {
+            vlog(LogDisk, "Read from %s failed at offset %llu: %s", qPrintable(m_path), (unsigned long long)offset, strerror(errno));
+            return false;
+        }
+        buffer += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool OverlayDiskBackend::write(u64 offset, const u8* buffer, size_t size)
+{
+    if (m_read_only || offset > m_table.size() * (u64)m_cluster_size || size > m_table.size() * (u64)m_cluster_size - offset)
+        return false;
+    while (size) {
+        u32 index = offset / m_cluster_size;
+        u32 offset_in_cluster = offset % m_cluster_size;
+        size_t chunk = std::min<u64>(size, m_cluster_size - offset_in_cluster);
+        bool ok;
+        if (u64 data = m_table[index])
+            ok = write_fully(m_fd, data + offset_in_cluster, buffer, chunk);
+        else
+            ok = write_new_cluster(index, offset_in_cluster, buffer, chunk);
+        if (!ok) {
+            vlog(LogDisk, "Write to %s failed at offset %llu: %s", qPrintable(m_path), (unsigned long long)offset, strerror(errno));
+            return false;
+        }
+        buffer += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool OverlayDiskBackend::write_new_cluster(u32 index, u32 offset_in_cluster, const u8* data, size_t size)
+{
+    // Fill the new cluster from the base and append it. Its table entry goes
+    // to disk at the next flush(), once the data is known to be on disk.
+    std::vector<u8> cluster(m_cluster_size);
+    if (size < m_cluster_size && !m_base->read((u64)index * m_cluster_size, cluster.data(), m_cluster_size))
+        return false;
+    memcpy(cluster.data() + offset_in_cluster, data, size);
+
+    u64 cluster_offset = m_next_cluster_offset;
+    if (!write_fully(m_fd, cluster_offset, cluster.data(), m_cluster_size))
+        return false;
+    m_table[index] = cluster_offset;
+    m_next_cluster_offset += m_cluster_size;
+    m_unpublished_clusters.push_back(index);
+    return true;
+}
+
+bool OverlayDiskBackend::publish_new_clusters()
+{
+    if (m_unpublished_clusters.empty())
+        return true;
+    // The data has to be durable before anything points at it,
+    // otherwise a host crash could leave table entries pointing at garbage.
+    if (::fdatasync(m_fd) < 0)
+        return false;
+    for (u32 index : m_unpublished_clusters) {
+        if (!write_fully(m_fd, m_table_offset + (u64)index * sizeof(u64), reinterpret_cast<const u8*>(&m_table[index]), sizeof(u64)))
+            return false;
+    }
+    m_unpublished_clusters.clear();
+    return true;
+}
+
+bool OverlayDiskBackend::flush()
+{
+    if (m_read_only)
+        return true;
+    if (!publish_new_clusters())
+        return false;
+    return ::fsync(m_fd) == 0;
+}
+
+bool OverlayDiskBackend::clear_table()
+{
+    std::fill(m_table.begin(), m_table.end(), 0);
+    m_unpublished_clusters.clear();
+    if (!write_fully(m_fd, m_table_offset, reinterpret_cast<const u8*>(m_table.data()), m_table.size() * sizeof(u64)))
+        return false;
+    if (::fsync(m_fd) < 0 || ::ftruncate(m_fd, m_data_offset) < 0)
+        return false;
+    m_next_cluster_offset = m_data_offset;
+    return true;
+}
+
+bool OverlayDiskBackend::create(const QString& overlay_path, const QString& base_path, u32 cluster_size)
+{
+    auto base = DiskBackend::open(base_path, Type::File, true);
+    if (!base)
+        return false;
+
+    QFileInfo overlay_info(overlay_path);
+    QString stored_base_path = overlay_info.dir().relativeFilePath(QFileInfo(base_path).absoluteFilePath());
+    QByteArray encoded_base_path = QFile::encodeName(stored_base_path);
+    if (encoded_base_path.size() > (int)(header_block_size - sizeof(OverlayHeader))) {
+        vlog(LogDisk, "Base image path too long: %s", qPrintable(stored_base_path));
+        return false;
+    }
+
+    OverlayHeader header;
+    memcpy(header.magic, overlay_magic, sizeof(overlay_magic));
+    header.version = overlay_version;
+    header.cluster_size = cluster_size;
+    header.virtual_size = base->size();
+    header.table_offset = header_block_size;
+    header.cluster_count = round_up(base->size(), cluster_size) / cluster_size;
+    header.base_path_length = encoded_base_path.size();
+
+    std::vector<u8> block(header_block_size);
+    memcpy(block.data(), &header, sizeof(header));
+    memcpy(block.data() + sizeof(header), encoded_base_path.constData(), encoded_base_path.size());
+
+    u64 data_offset = round_up(header.table_offset + (u64)header.cluster_count * sizeof(u64), cluster_size);
+
+    int fd = ::open(QFile::encodeName(overlay_path).constData(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        vlog(LogDisk, "Failed to create overlay %s: %s", qPrintable(overlay_path), strerror(errno));
+        return false;
+    }
+    // The (all-zero) cluster table is left as a hole.
+    bool ok = write_fully(fd, 0, block.data(), block.size()) && ::ftruncate(fd, data_offset) == 0 && ::fsync(fd) == 0;
+    ::close(fd);
+    if (!ok) {
+        vlog(LogDisk, "Failed to write overlay %s: %s", qPrintable(overlay_path), strerror(errno));
+        return false;
+    }
+    vlog(LogDisk, "Created overlay %s on top of %s (%llu bytes, %u-byte clusters)", qPrintable(overlay_path), qPrintable(stored_base_path), (unsigned long long)header.virtual_size, cluster_size);
+    return true;
+}
+
+bool OverlayDiskBackend::commit(const QString& overlay_path)
+{
+    auto overlay = load(overlay_path, false);
+    if (!overlay || overlay->is_read_only())
+        return false;
+
+    auto base = DiskBackend::open(resolve_base_path(overlay_path, overlay->m_base_path));
+    if (!base || base->is_read_only()) {
+        vlog(LogDisk, "Can't commit %s: base image %s is not writable", qPrintable(overlay_path), qPrintable(overlay->m_base_path));
+        return false;
+    }
+
+    u32 committed = 0;
+    std::vector<u8> cluster(overlay->m_cluster_size);
+    for (u32 index = 0; index < overlay->m_table.size(); ++index) {
+        u64 data = overlay->m_table[index];
+        if (!data)
+            continue;
+        u64 offset = (u64)index * overlay->m_cluster_size;
+        size_t size = std::min<u64>(overlay->m_cluster_size, overlay->m_size - offset);
+        if (!read_fully(overlay->m_fd, data, cluster.data(), size) || !base->write(offset, cluster.data(), size))
+            return false;
+        ++committed;
+    }
+    if (!base->flush())
+        return false;
+
+    // The base now holds everything, so the overlay can start over empty.
+    if (!overlay->clear_table())
+        return false;
+
+    vlog(LogDisk, "Committed %u clusters from %s into %s", committed, qPrintable(overlay_path), qPrintable(overlay->m_base_path));
+    return true;
+}
+
+bool OverlayDiskBackend::flatten(const QString& overlay_path, const QString& output_path)
+{
+    auto overlay = load(overlay_path, true);
+    if (!overlay)
+        return false;
+
+    int fd = ::open(QFile::encodeName(output_path).constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        vlog(LogDisk, "Failed to create %s: %s", qPrintable(output_path), strerror(errno));
+        return false;
+    }
+
+    bool ok = true;
+    std::vector<u8> cluster(overlay->m_cluster_size);
+    for (u64 offset = 0; ok && offset < overlay->m_size; offset += overlay->m_cluster_size) {
+        size_t size = std::min<u64>(overlay->m_cluster_size, overlay->m_size - offset);
+        ok = overlay->read(offset, cluster.data(), size);
+        // Leave all-zero clusters as holes.
+        if (ok && std::any_of(cluster.begin(), cluster.begin() + size, [](u8 byte) { return byte != 0; }))
+            ok = write_fully(fd, offset, cluster.data(), size);
+    }
+    ok = ok && ::ftruncate(fd, overlay->m_size) == 0 && ::fsync(fd) == 0;
+    ::close(fd);
+
+    if (!ok) {
+        vlog(LogDisk, "Failed to flatten %s into %s: %s", qPrintable(overlay_path), qPrintable(output_path), strerror(errno));
+        return false;
+    }
+    vlog(LogDisk, "Flattened %s into %s", qPrintable(overlay_path), qPrintable(output_path));
+    return true;
+}
@@ -0,0 +1,80 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include "DiskBackend.h"
+#include <vector>
+
+// A sparse copy-on-write image on top of a read-only base image.
+//
+// The file starts with a header block holding the geometry and the path
+// of the base image (relative paths are relative to the overlay itself).
+// Then comes the cluster table, one little-endian u64 per cluster giving
+// the overlay file offset of that cluster's data, or 0 if it still lives
+// in the base. Data clusters follow, appended in allocation order.
+class OverlayDiskBackend final : public DiskBackend {
+public:
+    static constexpr u32 default_cluster_size = 65536;
+
+    static bool is_overlay(const QString& path);
+    static OwnPtr<DiskBackend> open(const QString& path, bool read_only = false);
+
+    // Offline tools, see --overlay-create, --overlay-commit and --overlay-flatten.
+    static bool create(const QString& overlay_path, const QString& base_path, u32 cluster_size = default_cluster_size);
+    static bool commit(const QString& overlay_path);
+    static bool flatten(const QString& overlay_path, const QString& output_path);
+
+    virtual ~OverlayDiskBackend() override;
+
+    virtual bool read(u64 offset, u8* buffer, size_t size) override;
+    virtual bool write(u64 offset, const u8* buffer, size_t size) override;
+    virtual bool flush() override;
+
+    const QString& base_path() const { return m_base_path; }
+    u32 cluster_size() const { return m_cluster_size; }
+    u32 allocated_cluster_count() const;
+
+private:
+    OverlayDiskBackend(const QString& path, int fd, bool read_only);
+
+    static OwnPtr<OverlayDiskBackend> load(const QString& path, bool read_only);
+    bool load_header();
+    bool write_new_cluster(u32 index, u32 offset_in_cluster, const u8* data, size_t size);
+    bool publish_new_clusters();
+    bool clear_table();
+
+    int m_fd { -1 };
+    OwnPtr<DiskBackend> m_base;
+    QString m_base_path;
+    u32 m_cluster_size { 0 };
+    u64 m_table_offset { 0 };
+    u64 m_data_offset { 0 };
+    u64 m_next_cluster_offset { 0 };
+    std::vector<u64> m_table;
+
+    // Clusters allocated since the last flush(), whose table entries are only in memory so far.
+    std::vector<u32> m_unpublished_clusters;
+};
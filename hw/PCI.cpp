@@ -0,0 +1,235 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "PCI.h"
+#include "machine.h"
+
+//#define PCI_DEBUG
+
+PCI::Function::Function(u16 vendor_id, u16 device_id, u8 class_code, u8 subclass, u8 programming_interface, u8 revision)
+{
+    set_config16(0x00, vendor_id);
+    set_config16(0x02, device_id);
+    set_config8(0x08, revision);
+    set_config8(0x09, programming_interface);
+    set_config8(0x0a, subclass);
+    set_config8(0x0b, class_code);
+}
+
+u16 PCI::Function::config16(u8 reg) const
+{
+    return weld<u16>(m_config[reg + 1], m_config[reg]);
+}
+
+u32 PCI::Function::config32(u8 reg) const
+{
+    return weld<u32>(config16(reg + 2), config16(reg));
+}
+
+void PCI::Function::set_config16(u8 reg, u16 value)
+{
+    m_config[reg] = least_significant<u8>(value);
+    m_config[reg + 1] = most_significant<u8>(value);
+}
+
+void PCI::Function::set_config32(u8 reg, u32 value)
+{
+    set_config16(reg, least_significant<u16>(value));
+    set_config16(reg + 2, most_significant<u16>(value));
+}
+
+u32 PCI::Function::writable_bits(u8 reg) const
+{
+    switch (reg) {
+    case 0x04:
+        // Command: I/O space, memory space, bus master. Status bits aren't writable.
+        return 0x00000007;
+    case 0x0c:
+        // Latency timer.
+        return 0x0000ff00;
+    case 0x3c:
+        // Interrupt line.
+        return 0x000000ff;
+    default:
+        // Vendor specific registers are plain storage.
+        return reg >= 0x40 ? 0xffffffff : 0;
+    }
+}
+
+u32 PCI::Function::read_config(u8 reg) const
+{
+    return config32(reg & 0xfc);
+}
+
+void PCI::Function::write_config(u8 reg, u32 value, u32 byte_mask)
+{
+    reg &= 0xfc;
+    u32 mask = writable_bits(reg) & byte_mask;
+    set_config32(reg, (config32(reg) & ~mask) | (value & mask));
+    did_write_config(reg);
+}
+
+// Device 0 is an i440FX host bridge, and device 1 function 0 a PIIX3 ISA bridge.
+// They don't do anything, but guests expect to find them.
+class HostBridge final : public PCI::Function {
+public:
+    HostBridge()
+        : PCI::Function(0x8086, 0x1237, 0x06, 0x00, 0x00, 0x02)
+    {
+    }
+};
+
+class ISABridge final : public PCI::Function {
+public:
+    ISABridge()
+        : PCI::Function(0x8086, 0x7000, 0x06, 0x01, 0x00)
+    {
+        // Multi-function device, so guests go on to look at the IDE function.
+        set_config8(0x0e, 0x80);
+    }
+};
+
+static const u32 config_enable = 0x80000000;
+
+struct PCI::Private {
+    u32 config_address { 0 };
+    Function* functions[32][8] {};
+    HostBridge host_bridge;
+    ISABridge isa_bridge;
+};
+
+PCI::PCI(Machine& machine)
+    : IODevice("PCI", machine)
+    , d(make<Private>())
+{
+    attach(0, 0, d->host_bridge);
+    attach(1, 0, d->isa_bridge);
+
+    for (u16 port = 0xcf8; port <= 0xcff; ++port)
+        listen(port, IODevice::ReadWrite);
+
+    reset();
+}
+
+PCI::~PCI()
+{
+}
+
+void PCI::reset()
+{
+    d->config_address = 0;
+}
+
+void PCI::attach(u8 device, u8 function, Function& pci_function)
+{
+    ASSERT(device < 32 && function < 8);
+    ASSERT(!d->functions[device][function]);
+    d->functions[device][function] = &pci_function;
+}
+
+PCI::Function* PCI::selected_function() const
+{
+    u32 address = d->config_address;
+    if (!(address & config_enable))
+        return nullptr;
+    // Only bus 0 exists.
+    if ((address >> 16) & 0xff)
+        return nullptr;
+    return d->functions[(address >> 11) & 0x1f][(address >> 8) & 7];
+}
+
+u32 PCI::read_data(u16 port, unsigned size)
+{
+    auto* function = selected_function();
+    u32 value = function ? function->read_config(d->config_address & 0xfc) : 0xffffffff;
+    value >>= (port & 3) * 8;
+#ifdef PCI_DEBUG
+    vlog(LogIO, "PCI config read %08x+%u (%u bytes) = %08x", d->config_address, port & 3, size, value);
+#endif
+    return size == 4 ? value : value & ((1u << (size * 8)) - 1);
+}
+
+void PCI::write_data(u16 port, u32 value, unsigned size)
+{
+#ifdef PCI_DEBUG
+    vlog(LogIO, "PCI config write %08x+%u (%u bytes) <- %08x", d->config_address, port & 3, size, value);
+#endif
+    auto* function = selected_function();
+    if (!function)
+        return;
+    unsigned shift = (port & 3) * 8;
+    u32 byte_mask = size == 4 ? 0xffffffff : ((1u << (size * 8)) - 1) << shift;
+    function->write_config(d->config_address & 0xfc, value << shift, byte_mask);
+}
+
+static bool is_address_port(u16 port)
+{
+    return port >= 0xcf8 && port <= 0xcfb;
+}
+
+u8 PCI::in8(u16 port)
+{
+    if (is_address_port(port))
+        return d->config_address >> ((port & 3) * 8);
+    return read_data(port, 1);
+}
+
+u16 PCI::in16(u16 port)
+{
+    if (is_address_port(port))
+        return d->config_address >> ((port & 3) * 8);
+    return read_data(port, 2);
+}
+
+u32 PCI::in32(u16 port)
+{
+    if (is_address_port(port))
+        return d->config_address;
+    return read_data(port, 4);
+}
+
+void PCI::out8(u16 port, u8 data)
+{
+    // Only full dword writes go to CONFIG_ADDRESS. (Linux pokes CFBh while probing for mechanism #1.)
+    if (is_address_port(port))
+        return;
+    write_data(port, data, 1);
+}
+
+void PCI::out16(u16 port, u16 data)
+{
+    if (is_address_port(port))
+        return;
+    write_data(port, data, 2);
+}
+
+void PCI::out32(u16 port, u32 data)
+{
+    if (is_address_port(port)) {
+        d->config_address = data & 0x80fffffc;
+        return;
+    }
+    write_data(port, data, 4);
+}
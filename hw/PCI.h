@@ -0,0 +1,85 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include "OwnPtr.h"
+#include "iodevice.h"
+
+// A single PCI bus behind configuration mechanism #1 (ports CF8h/CFCh).
+// Functions sit at fixed device/function numbers and have their resources
+// assigned up front, since there's no PCI BIOS to do it for the guest.
+class PCI final : public IODevice {
+public:
+    class Function {
+    public:
+        virtual ~Function() { }
+
+        u32 read_config(u8 reg) const;
+        void write_config(u8 reg, u32 value, u32 byte_mask);
+
+    protected:
+        Function(u16 vendor_id, u16 device_id, u8 class_code, u8 subclass, u8 programming_interface, u8 revision = 0);
+
+        u8 config8(u8 reg) const { return m_config[reg]; }
+        u16 config16(u8 reg) const;
+        u32 config32(u8 reg) const;
+        void set_config8(u8 reg, u8 value) { m_config[reg] = value; }
+        void set_config16(u8 reg, u16 value);
+        void set_config32(u8 reg, u32 value);
+
+        // Bits of the config dword at `reg` that the guest is allowed to change.
+        virtual u32 writable_bits(u8 reg) const;
+
+        // Called after the guest has written the config dword at `reg`.
+        virtual void did_write_config(u8 reg) { (void)reg; }
+
+        bool is_bus_master_enabled() const { return config16(0x04) & 0x04; }
+
+    private:
+        u8 m_config[256] {};
+    };
+
+    explicit PCI(Machine&);
+    virtual ~PCI();
+
+    void attach(u8 device, u8 function, Function&);
+
+    virtual void reset() override;
+    virtual u8 in8(u16 port) override;
+    virtual u16 in16(u16 port) override;
+    virtual u32 in32(u16 port) override;
+    virtual void out8(u16 port, u8 data) override;
+    virtual void out16(u16 port, u16 data) override;
+    virtual void out32(u16 port, u32 data) override;
+
+private:
+    Function* selected_function() const;
+    u32 read_data(u16 port, unsigned size);
+    void write_data(u16 port, u32 value, unsigned size);
+
+    struct Private;
+    OwnPtr<Private> d;
+};
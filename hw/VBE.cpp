@@ -0,0 +1,304 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "VBE.h"
+#include "CPU.h"
+#include "Common.h"
+#include "debug.h"
+#include "machine.h"
+#include "vga.h"
+#include <string.h>
+
+//#define VBE_DEBUG
+
+enum DispiIndex {
+    DispiID = 0,
+    DispiXResolution,
+    DispiYResolution,
+    DispiBitsPerPixel,
+    DispiEnable,
+    DispiBank,
+    DispiVirtualWidth,
+    DispiVirtualHeight,
+    DispiXOffset,
+    DispiYOffset,
+    DispiVideoMemory64K,
+};
+
+enum DispiEnableFlags {
+    DispiEnabled = 0x01,
+    DispiGetCaps = 0x02,
+    Dispi8BitDAC = 0x20,
+    DispiLFBEnabled = 0x40,
+    DispiNoClearMemory = 0x80,
+};
+
+static const u16 dispi_id_min = 0xB0C0;
+static const u16 dispi_id_max = 0xB0C5;
+
+static const u16 max_x_resolution = 2560;
+static const u16 max_y_resolution = 1600;
+static const u16 max_bits_per_pixel = 32;
+
+struct VBE::Private {
+    u16 index { 0 };
+    u16 id { dispi_id_max };
+    u16 x_resolution { 640 };
+    u16 y_resolution { 480 };
+    u16 bits_per_pixel { 8 };
+    u16 enable { 0 };
+    u16 bank { 0 };
+    u16 virtual_width { 640 };
+    u16 virtual_height { 480 };
+    u16 x_offset { 0 };
+    u16 y_offset { 0 };
+
+    u8* framebuffer { nullptr };
+};
+
+static u32 bytes_per_pixel(u16 bits_per_pixel)
+{
+    return (bits_per_pixel + 7) / 8;
+}
+
+static u16 virtual_height_for_line_size(u32 line_size)
+{
+    // Narrow lines fit more than 65535 of them in the framebuffer, but the register is 16 bits.
+    return std::min<u32>(VBE::framebuffer_size / line_size, 0xffff);
+}
+
+VBE::VBE(Machine& machine)
+    : IODevice("VBE", machine)
+    , d(make<Private>())
+{
+    d->framebuffer = new u8[framebuffer_size];
+    memset(d->framebuffer, 0, framebuffer_size);
+    machine.cpu().map_direct_memory(PhysicalAddress(framebuffer_address), d->framebuffer, framebuffer_size);
+
+    listen(0x1CE, IODevice::ReadWrite);
+    listen(0x1CF, IODevice::ReadWrite);
+
+    reset();
+}
+
+VBE::~VBE()
+{
+    machine().cpu().map_direct_memory(PhysicalAddress(framebuffer_address), nullptr, 0);
+    delete[] d->framebuffer;
+}
+
+void VBE::reset()
+{
+    u8* framebuffer = d->framebuffer;
+    *d = Private();
+    d->framebuffer = framebuffer;
+}
+
+bool VBE::is_enabled() const
+{
+    return d->enable & DispiEnabled;
+}
+
+u16 VBE::width() const
+{
+    return d->x_resolution;
+}
+
+u16 VBE::height() const
+{
+    return d->y_resolution;
+}
+
+u8 VBE::bits_per_pixel() const
+{
+    return d->bits_per_pixel;
+}
+
+u32 VBE::bytes_per_line() const
+{
+    return d->virtual_width * bytes_per_pixel(d->bits_per_pixel);
+}
+
+const u8* VBE::framebuffer() const
+{
+    return d->framebuffer;
+}
+
+const u8* VBE::display_start() const
+{
+    u32 offset = d->y_offset * bytes_per_line() + d->x_offset * bytes_per_pixel(d->bits_per_pixel);
+    if (offset >= framebuffer_size)
+        return d->framebuffer;
+    return d->framebuffer + offset;
+}
+
+u16 VBE::read_register(u16 index) const
+{
+    switch (index) {
+    case DispiID:
+        return d->id;
+    case DispiXResolution:
+        return (d->enable & DispiGetCaps) ? max_x_resolution : d->x_resolution;
+    case DispiYResolution:
+        return (d->enable & DispiGetCaps) ? max_y_resolution : d->y_resolution;
+    case DispiBitsPerPixel:
+        return (d->enable & DispiGetCaps) ? max_bits_per_pixel : d->bits_per_pixel;
+    case DispiEnable:
+        return d->enable;
+    case DispiBank:
+        return d->bank;
+    case DispiVirtualWidth:
+        return d->virtual_width;
+    case DispiVirtualHeight:
+        return d->virtual_height;
+    case DispiXOffset:
+        return d->x_offset;
+    case DispiYOffset:
+        return d->y_offset;
+    case DispiVideoMemory64K:
+        return framebuffer_size / 65536;
+    default:
+        vlog(LogVBE, "Read from invalid DISPI register %u", index);
+        return 0;
+    }
+}
+
+void VBE::set_enable(u16 flags)
+{
+    if (!(flags & DispiEnabled)) {
+        if (is_enabled())
+            vlog(LogVBE, "Disabled");
+        d->enable = flags;
+        return;
+    }
+
+    if (is_enabled()) {
+        d->enable = flags;
+        return;
+    }
+
+    if (!d->bits_per_pixel)
+        d->bits_per_pixel = 8;
+
+    bool valid_depth = d->bits_per_pixel == 8 || d->bits_per_pixel == 15 || d->bits_per_pixel == 16 || d->bits_per_pixel == 24 || d->bits_per_pixel == 32;
+    u32 line_size = d->x_resolution * bytes_per_pixel(d->bits_per_pixel);
+    if (!valid_depth || !d->x_resolution || !d->y_resolution || d->x_resolution > max_x_resolution || d->y_resolution > max_y_resolution || line_size * d->y_resolution > framebuffer_size) {
+        vlog(LogVBE, "Refusing to enable unsupported mode %ux%ux%u", d->x_resolution, d->y_resolution, d->bits_per_pixel);
+        return;
+    }
+
+    d->enable = flags;
+    d->virtual_width = d->x_resolution;
+    d->virtual_height = virtual_height_for_line_size(line_size);
+    d->x_offset = 0;
+    d->y_offset = 0;
+    d->bank = 0;
+
+    if (!(flags & DispiNoClearMemory))
+        memset(d->framebuffer, 0, framebuffer_size);
+
+    // FIXME: Support banked access through the VGA window, and the 8-bit DAC.
+    vlog(LogVBE, "Enabled %ux%ux%u, linear framebuffer at %08x", d->x_resolution, d->y_resolution, d->bits_per_pixel, framebuffer_address);
+}
+
+void VBE::write_register(u16 index, u16 value)
+{
+#ifdef VBE_DEBUG
+    vlog(LogVBE, "DISPI register %u <- %04x", index, value);
+#endif
+
+    switch (index) {
+    case DispiID:
+        if (value >= dispi_id_min && value <= dispi_id_max)
+            d->id = value;
+        break;
+    case DispiXResolution:
+    case DispiYResolution:
+    case DispiBitsPerPixel:
+        // The mode can only be changed while the display is disabled.
+        if (is_enabled())
+            break;
+        if (index == DispiXResolution)
+            d->x_resolution = value;
+        else if (index == DispiYResolution)
+            d->y_resolution = value;
+        else
+            d->bits_per_pixel = value;
+        break;
+    case DispiEnable:
+        set_enable(value);
+        break;
+    case DispiBank:
+        d->bank = value;
+        break;
+    case DispiVirtualWidth: {
+        u32 line_size = value * bytes_per_pixel(d->bits_per_pixel);
+        if (value < d->x_resolution || !line_size)
+            break;
+        d->virtual_width = value;
+        d->virtual_height = virtual_height_for_line_size(line_size);
+        break;
+    }
+    case DispiVirtualHeight:
+        // Read-only, it follows from the virtual width.
+        break;
+    case DispiXOffset:
+        d->x_offset = value;
+        break;
+    case DispiYOffset:
+        d->y_offset = value;
+        break;
+    default:
+        vlog(LogVBE, "Write to invalid DISPI register %u <- %04x", index, value);
+        break;
+    }
+
+    machine().vga().request_present();
+}
+
+u16 VBE::in16(u16 port)
+{
+    if (port == 0x1CE)
+        return d->index;
+    return read_register(d->index);
+}
+
+void VBE::out16(u16 port, u16 data)
+{
+    if (port == 0x1CE) {
+        d->index = data;
+        return;
+    }
+    write_register(d->index, data);
+}
+
+u8 VBE::in8(u16 port)
+{
+    return least_significant<u8>(in16(port));
+}
+
+void VBE::out8(u16 port, u8 data)
+{
+    out16(port, data);
+}
@@ -0,0 +1,64 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include "OwnPtr.h"
+#include "iodevice.h"
+
+// Bochs-style VBE "DISPI" display interface, with a linear framebuffer in plain host memory.
+// Guests pick a resolution through ports 0x1CE (index) and 0x1CF (data), then draw straight
+// into the framebuffer, which the CPU maps at framebuffer_address like ordinary RAM.
+class VBE final : public IODevice {
+public:
+    explicit VBE(Machine&);
+    virtual ~VBE();
+
+    static constexpr u32 framebuffer_address = 0xE0000000;
+    static constexpr u32 framebuffer_size = 16 * 1048576;
+
+    virtual void reset() override;
+    virtual u8 in8(u16 port) override;
+    virtual u16 in16(u16 port) override;
+    virtual void out8(u16 port, u8 data) override;
+    virtual void out16(u16 port, u16 data) override;
+
+    bool is_enabled() const;
+    u16 width() const;
+    u16 height() const;
+    u8 bits_per_pixel() const;
+    u32 bytes_per_line() const;
+
+    // The first visible pixel, taking the virtual screen offsets into account.
+    const u8* display_start() const;
+    const u8* framebuffer() const;
+
+private:
+    u16 read_register(u16 index) const;
+    void write_register(u16 index, u16 value);
+    void set_enable(u16 flags);
+
+    struct Private;
+    OwnPtr<Private> d;
+};
@@ -27,15 +27,16 @@
 #include "DiskDrive.h"
 #include "debug.h"
 #include "machine.h"
-#include <QtCore/QDate>
-#include <QtCore/QTime>
 
 //#define CMOS_DEBUG
 
+static const u64 rtc_update_interval_ns = 250000000;
+
 CMOS::CMOS(Machine& machine)
     : IODevice("CMOS", machine)
 {
-    m_rtc_timer = make<ThreadedTimer>(*this, 250);
+    m_rtc_timer = make<EventScheduler::Timer>(machine.scheduler(), [this] { rtc_timer_fired(); });
+    m_rtc_timer->start_after(rtc_update_interval_ns);
     listen(0x70, IODevice::WriteOnly);
     listen(0x71, IODevice::ReadWrite);
     reset();
@@ -80,14 +81,6 @@ bool CMOS::in_24_hour_mode() const
     return m_ram[StatusRegisterB] & 0x02;
 }
 
-static QDateTime current_datetime_for_cmos()
-{
-#ifdef CT_DETERMINISTIC
-    return QDateTime(QDate(2018, 2, 9), QTime(1, 2, 3, 4));
-#endif
-    return QDateTime::currentDateTime();
-}
-
 u8 CMOS::to_current_clock_format(u8 value) const
 {
     if (in_binary_clock_mode())
@@ -101,7 +94,7 @@ void CMOS::update_clock()
     ASSERT(in_24_hour_mode());
 
     m_ram[StatusRegisterA] |= 0x80; // RTC update in progress
-    auto now = current_datetime_for_cmos();
+    auto now = machine().scheduler().current_datetime();
     m_ram[RTCSecond] = to_current_clock_format(now.time().second());
     m_ram[RTCMinute] = to_current_clock_format(now.time().minute());
     m_ram[RTCHour] = to_current_clock_format(now.time().hour());
@@ -151,7 +144,8 @@ u8 CMOS::get(RegisterIndex index) const
     return m_ram[index];
 }
 
-void CMOS::threaded_timer_fired(Badge<ThreadedTimer>)
+void CMOS::rtc_timer_fired()
 {
     update_clock();
+    m_rtc_timer->start_after(rtc_update_interval_ns);
 }
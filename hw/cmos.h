@@ -25,13 +25,11 @@
 #pragma once
 
 #include "Common.h"
+#include "EventScheduler.h"
 #include "OwnPtr.h"
-#include "ThreadedTimer.h"
 #include "iodevice.h"
 
-class CMOS final
-    : public IODevice
-    , public ThreadedTimer::Listener {
+class CMOS final : public IODevice {
 public:
     enum RegisterIndex {
         StatusRegisterA = 0x0a,
@@ -67,7 +65,7 @@ public:
     u8 get(RegisterIndex) const;
 
 private:
-    virtual void threaded_timer_fired(Badge<ThreadedTimer>) override;
+    void rtc_timer_fired();
 
     u8 m_register_index { 0 };
     u8 m_ram[80];
@@ -76,5 +74,5 @@ private:
     bool in_24_hour_mode() const;
     u8 to_current_clock_format(u8) const;
 
-    OwnPtr<ThreadedTimer> m_rtc_timer;
+    OwnPtr<EventScheduler::Timer> m_rtc_timer;
 };
@@ -24,6 +24,7 @@
 
 #include "fdc.h"
 #include "Common.h"
+#include "DMA.h"
 #include "DiskDrive.h"
 #include "debug.h"
 #include "machine.h"
@@ -46,6 +47,17 @@
 
 #define DATA_REGISTER_READY 0x80
 
+// Status register bits reported after a read/write data command.
+#define FDC_ST0_ABNORMAL_TERMINATION 0x40
+#define FDC_ST1_MISSING_ADDRESS_MARK 0x01
+#define FDC_ST1_NOT_WRITABLE 0x02
+#define FDC_ST1_NO_DATA 0x04
+#define FDC_ST1_OVERRUN 0x10
+#define FDC_ST1_DATA_ERROR 0x20
+
+// The floppy controller is hard-wired to ISA DMA channel 2.
+static const unsigned fdc_dma_channel = 2;
+
 enum FDCCommand {
     SenseInterruptStatus = 0x08,
     SpecifyStepAndHeadLoad = 0x03,
@@ -284,6 +296,11 @@ static bool is_read_data_command(u8 b)
     return (b & 0x1f) == 0x06;
 }
 
+static bool is_write_data_command(u8 b)
+{
+    return (b & 0x3f) == 0x05;
+}
+
 void FDC::out8(u16 port, u8 data)
 {
 #ifdef FDC_DEBUG
@@ -327,7 +344,7 @@ void FDC::out8(u16 port, u8 data)
             d->main_status_register &= FDC_MSR_DIO;
             d->main_status_register |= FDC_MSR_RQM | FDC_MSR_CMDBSY;
             // Determine the command length
-            if (is_read_data_command(data)) {
+            if (is_read_data_command(data) || is_write_data_command(data)) {
                 d->command_size = 9;
             } else {
                 switch (data) {
@@ -392,6 +409,16 @@ void FDC::reset_controller_soon()
 }
 
 void FDC::execute_read_data_command()
+{
+    execute_data_transfer(false);
+}
+
+void FDC::execute_write_data_command()
+{
+    execute_data_transfer(true);
+}
+
+void FDC::execute_data_transfer(bool to_disk)
 {
     d->drive_index = d->command[1] & 3;
     d->current_drive().head = (d->command[1] >> 2) & 1;
@@ -402,7 +429,8 @@ void FDC::execute_read_data_command()
     d->current_drive().end_of_track = d->command[6];
     d->current_drive().gap3_length = d->command[7];
     d->current_drive().data_length = d->command[8];
-    vlog(LogFDC, "ReadData { drive:%u, C:%u H:%u, S:%u / bpS:%u, EOT:%u, g3l:%u, dl:%u }",
+    vlog(LogFDC, "%s { drive:%u, C:%u H:%u, S:%u / bpS:%u, EOT:%u, g3l:%u, dl:%u }",
+        to_disk ? "WriteData" : "ReadData",
         d->drive_index,
         d->current_drive().cylinder,
         d->current_drive().head,
@@ -411,6 +439,88 @@ void FDC::execute_read_data_command()
         d->current_drive().end_of_track,
         d->current_drive().gap3_length,
         d->current_drive().data_length);
+
+    FDCDrive& drive = d->current_drive();
+    DiskDrive* disk = nullptr;
+    if (d->drive_index == 0)
+        disk = &machine().floppy0();
+    else if (d->drive_index == 1)
+        disk = &machine().floppy1();
+
+    if (!disk || !disk->present())
+        return finish_data_transfer(FDC_ST0_ABNORMAL_TERMINATION, FDC_ST1_MISSING_ADDRESS_MARK, 0);
+
+    if (!using_dma()) {
+        vlog(LogFDC, "Non-DMA data transfers are not supported");
+        return finish_data_transfer(FDC_ST0_ABNORMAL_TERMINATION, FDC_ST1_OVERRUN, 0);
+    }
+
+    unsigned last_sector = std::min<unsigned>(drive.end_of_track, disk->sectors_per_track());
+    if (drive.sector < 1 || drive.sector > last_sector || drive.head >= disk->heads())
+        return finish_data_transfer(FDC_ST0_ABNORMAL_TERMINATION, FDC_ST1_NO_DATA, 0);
+
+    // The controller keeps going until the DMA controller signals terminal count,
+    // or it runs out of track (out of cylinder, in multi-track mode.)
+    bool multi_track = d->command[0] & 0x80;
+    u32 sector_count = last_sector - drive.sector + 1;
+    if (multi_track && drive.head == 0 && disk->heads() > 1)
+        sector_count += last_sector;
+    u32 lba = disk->to_lba(drive.cylinder, drive.head, drive.sector);
+    if (lba + sector_count > disk->sectors())
+        return finish_data_transfer(FDC_ST0_ABNORMAL_TERMINATION, FDC_ST1_NO_DATA, 0);
+
+    unsigned bytes_per_sector = disk->bytes_per_sector();
+    QByteArray buffer(sector_count * bytes_per_sector, 0);
+    auto* data = reinterpret_cast<u8*>(buffer.data());
+    u32 transferred;
+    if (to_disk) {
+        transferred = machine().dma().read_from_memory(fdc_dma_channel, data, buffer.size());
+        // A partial last sector is written out padded with zeroes, like the real thing.
+        u32 sectors_written = (transferred + bytes_per_sector - 1) / bytes_per_sector;
+        if (sectors_written && !disk->write_sectors(lba, sectors_written, data))
+            return finish_data_transfer(FDC_ST0_ABNORMAL_TERMINATION, FDC_ST1_NOT_WRITABLE, 0);
+    } else {
+        if (!disk->read_sectors(lba, sector_count, data))
+            return finish_data_transfer(FDC_ST0_ABNORMAL_TERMINATION, FDC_ST1_DATA_ERROR, 0);
+        transferred = machine().dma().write_to_memory(fdc_dma_channel, data, buffer.size());
+    }
+
+    if (!transferred)
+        return finish_data_transfer(FDC_ST0_ABNORMAL_TERMINATION, FDC_ST1_OVERRUN, 0);
+
+    // Leave the drive positioned at the sector after the last one transferred.
+    u32 sectors_transferred = (transferred + bytes_per_sector - 1) / bytes_per_sector;
+    for (u32 i = 0; i < sectors_transferred; ++i) {
+        if (drive.sector < last_sector) {
+            ++drive.sector;
+            continue;
+        }
+        drive.sector = 1;
+        if (multi_track && drive.head == 0) {
+            drive.head = 1;
+        } else {
+            drive.head = 0;
+            ++drive.cylinder;
+        }
+    }
+
+    finish_data_transfer(0, 0, 0);
+}
+
+void FDC::finish_data_transfer(u8 st0, u8 st1, u8 st2)
+{
+    FDCDrive& drive = d->current_drive();
+    d->status_register[0] = st0 | (drive.head << 2) | d->drive_index;
+    d->command_result.clear();
+    d->command_result.append(d->status_register[0]);
+    d->command_result.append(st1);
+    d->command_result.append(st2);
+    d->command_result.append(drive.cylinder);
+    d->command_result.append(drive.head);
+    d->command_result.append(drive.sector);
+    d->command_result.append(drive.bytes_per_sector);
+    vlog(LogFDC, "Data transfer done, ST0:%02x ST1:%02x ST2:%02x, now at C:%u H:%u S:%u", d->status_register[0], st1, st2, drive.cylinder, drive.head, drive.sector);
+    raise_irq();
 }
 
 void FDC::execute_command_soon()
@@ -452,6 +562,8 @@ void FDC::execute_command_internal()
 
     if (is_read_data_command(d->command[0]))
         return execute_read_data_command();
+    if (is_write_data_command(d->command[0]))
+        return execute_write_data_command();
 
     switch (d->command[0]) {
     case SpecifyStepAndHeadLoad:
@@ -59,6 +59,9 @@ private:
     void execute_command();
     void execute_command_internal();
     void execute_read_data_command();
+    void execute_write_data_command();
+    void execute_data_transfer(bool to_disk);
+    void finish_data_transfer(u8 st0, u8 st1, u8 st2);
 
     struct Private;
     OwnPtr<Private> d;
@@ -25,6 +25,8 @@
 #include "ide.h"
 #include "Common.h"
 #include "DiskDrive.h"
+#include "CPU.h"
+#include "EventScheduler.h"
 #include "debug.h"
 #include "machine.h"
 
@@ -43,20 +45,80 @@ struct IDEController {
     u8 error { 0 };
     bool in_lba_mode { false };
 
-    void identify(IDE&);
-    void read_sectors(IDE&);
-    void write_sectors();
+    // Previous contents of the sector count and LBA registers.
+    // LBA48 commands take them as the high-order bytes of their parameters.
+    u8 hob_sector_count { 0 };
+    u8 hob_lba_low { 0 };
+    u8 hob_lba_mid { 0 };
+    u8 hob_lba_high { 0 };
+
+    // Device Control register (0x3F6/0x376.)
+    static constexpr u8 nIEN = 0x02;
+    static constexpr u8 SRST = 0x04;
+    static constexpr u8 HOB = 0x80;
+    u8 device_control { 0 };
+    bool reads_hob() const { return device_control & HOB; }
+
+    // Error register bits.
+    static constexpr u8 ABRT = 0x04;
+    static constexpr u8 IDNF = 0x10;
+
+    // After a reset, the Error register holds a diagnostic code instead, which doesn't set ERR.
+    static constexpr u8 diagnostic_passed = 0x01;
+    bool error_is_diagnostic_code { false };
+
+    // Largest block SET MULTIPLE MODE accepts, and the one in effect (0 means disabled.)
+    static constexpr u8 max_multiple_sectors = 16;
+    u8 multiple_sectors { 0 };
+
+    // Parameters of the transfer in progress, latched when the command was issued.
+    u32 transfer_lba { 0 };
+    u32 transfer_sectors { 0 };
+    // PIO transfers raise an interrupt for every block of this many sectors.
+    u32 sectors_per_block { 1 };
+
+    IDE::PendingIO pending_io { IDE::PendingIO::None };
+    bool busy() const { return pending_io != IDE::PendingIO::None || dma_active; }
+
+    u8 features { 0 };
+    u8 multiword_dma_mode { 2 };
+
+    // Bus master DMA registers for this channel.
+    u8 bus_master_command { 0 };
+    u8 bus_master_status { 0 };
+    u32 prd_table_address { 0 };
+
+    // A READ/WRITE DMA command is in progress. For reads, dma_data_ready says
+    // the sectors are in m_read_buffer, waiting for the bus master to be started.
+    bool dma_active { false };
+    bool dma_to_memory { false };
+    bool dma_data_ready { false };
 
-    u32 lba()
+    void identify(IDE&);
+    void read_sectors(IDE&, bool lba48, u32 sectors_per_block);
+    void write_sectors(IDE&, bool lba48, u32 sectors_per_block);
+    void read_dma(IDE&, bool lba48);
+    void write_dma(IDE&, bool lba48);
+    void set_multiple_mode(IDE&);
+    bool latch_transfer(IDE&, bool lba48);
+
+    u32 lba28()
     {
         if (in_lba_mode) {
-            return ((u32)cylinder_index << 8) | sector_index;
+            return ((u32)(head_index & 0xf) << 24) | ((u32)cylinder_index << 8) | sector_index;
         }
         return drive().to_lba(cylinder_index, head_index, sector_index);
     }
 
+    u64 lba48() const
+    {
+        return ((u64)hob_lba_high << 40) | ((u64)hob_lba_mid << 32) | ((u64)hob_lba_low << 24) | ((u32)cylinder_index << 8) | sector_index;
+    }
+
+    int bytes_per_block() { return drive().bytes_per_sector() * sectors_per_block; }
+
     template<typename T>
-    T read_from_sector_buffer();
+    T read_from_sector_buffer(IDE&);
     template<typename T>
     void write_to_sector_buffer(IDE&, T);
 
@@ -71,45 +133,124 @@ void IDEController::identify(IDE& ide)
 {
     u16 data[256];
     memset(data, 0, sizeof(data));
-    data[1] = drive().sectors() / (drive().sectors_per_track() * drive().heads());
+    data[1] = std::min(drive().sectors() / (drive().sectors_per_track() * drive().heads()), 16383u);
     data[3] = drive().heads();
     data[6] = drive().sectors_per_track();
+    data[47] = 0x8000 | max_multiple_sectors;
+    data[49] = (1 << 9) | (1 << 8); // LBA and DMA supported.
+    if (multiple_sectors)
+        data[59] = 0x0100 | multiple_sectors;
+    u32 lba28_sectors = std::min(drive().sectors(), 0x0fffffffu);
+    data[60] = lba28_sectors;
+    data[61] = lba28_sectors >> 16;
+    data[63] = 0x0007 | (0x0100 << multiword_dma_mode); // Multiword DMA modes 0-2 supported, and the selected one.
+    data[80] = 0x007e; // ATA-1 through ATA-6.
+    data[83] = 0x4000 | (1 << 10); // 48-bit address feature set supported...
+    data[86] = 1 << 10; // ...and enabled.
+    data[100] = drive().sectors();
+    data[101] = drive().sectors() >> 16;
     m_read_buffer.resize(512);
     memcpy(m_read_buffer.data(), data, sizeof(data));
     strcpy(m_read_buffer.data() + 54, "oCpmtuor niDks");
     m_read_buffer_index = 0;
-    ide.raise_irq();
+    sectors_per_block = 1;
+    ide.raise_irq(*this);
 }
 
-void IDEController::read_sectors(IDE& ide)
+bool IDEController::latch_transfer(IDE& ide, bool lba48)
 {
+    u64 lba;
+    if (lba48) {
+        lba = this->lba48();
+        transfer_sectors = weld<u16>(hob_sector_count, sector_count);
+        if (!transfer_sectors)
+            transfer_sectors = 65536;
+    } else {
+        lba = lba28();
+        transfer_sectors = sector_count ? sector_count : 256;
+    }
+    if (lba + transfer_sectors > drive().sectors()) {
+        vlog(LogIDE, "ide%u: Transfer out of range (LBA: %llu, count: %u)", controller_index, (unsigned long long)lba, transfer_sectors);
+        error = ABRT | IDNF;
+        ide.raise_irq(*this);
+        return false;
+    }
+    transfer_lba = lba;
+    return true;
+}
+
+void IDEController::read_sectors(IDE& ide, bool lba48, u32 block_size)
+{
+    if (!latch_transfer(ide, lba48))
+        return;
 #ifdef IDE_DEBUG
-    vlog(LogIDE, "ide%u: Read sectors (LBA: %u, count: %u)", controller_index, lba(), sector_count);
+    vlog(LogIDE, "ide%u: Read sectors (LBA: %u, count: %u, block: %u)", controller_index, transfer_lba, transfer_sectors, block_size);
 #endif
-    FILE* f = fopen(qPrintable(drive().image_path()), "rb");
-    RELEASE_ASSERT(f);
-    m_read_buffer.resize(drive().bytes_per_sector() * sector_count);
-    int result;
-    result = fseek(f, lba() * drive().bytes_per_sector(), SEEK_SET);
-    ASSERT(result != -1);
-    result = fread(m_read_buffer.data(), drive().bytes_per_sector(), sector_count, f);
-    ASSERT(result != -1);
-    result = fclose(f);
-    ASSERT(result != -1);
-    m_read_buffer_index = 0;
-    ide.raise_irq();
+    sectors_per_block = block_size;
+    m_read_buffer.resize(drive().bytes_per_sector() * transfer_sectors);
+    m_read_buffer_index = m_read_buffer.size();
+    drive().start_read_sectors(transfer_lba, transfer_sectors, reinterpret_cast<u8*>(m_read_buffer.data()));
+    ide.begin_io(*this, IDE::PendingIO::Read, m_read_buffer.size());
 }
 
-void IDEController::write_sectors()
+void IDEController::write_sectors(IDE& ide, bool lba48, u32 block_size)
 {
-    vlog(LogIDE, "ide%u: Write sectors (LBA: %u, count: %u)", controller_index, lba(), sector_count);
-    m_write_buffer.resize(drive().bytes_per_sector() * sector_count);
+    if (!latch_transfer(ide, lba48))
+        return;
+    vlog(LogIDE, "ide%u: Write sectors (LBA: %u, count: %u, block: %u)", controller_index, transfer_lba, transfer_sectors, block_size);
+    sectors_per_block = block_size;
+    m_write_buffer.resize(drive().bytes_per_sector() * transfer_sectors);
     m_write_buffer_index = 0;
 }
 
+void IDEController::read_dma(IDE& ide, bool lba48)
+{
+    if (!latch_transfer(ide, lba48))
+        return;
+#ifdef IDE_DEBUG
+    vlog(LogIDE, "ide%u: Read DMA (LBA: %u, count: %u)", controller_index, transfer_lba, transfer_sectors);
+#endif
+    // Fetch the sectors right away; they go to guest memory once the bus master has been started.
+    dma_active = true;
+    dma_to_memory = true;
+    dma_data_ready = false;
+    m_read_buffer.resize(drive().bytes_per_sector() * transfer_sectors);
+    m_read_buffer_index = m_read_buffer.size();
+    drive().start_read_sectors(transfer_lba, transfer_sectors, reinterpret_cast<u8*>(m_read_buffer.data()));
+    ide.begin_io(*this, IDE::PendingIO::Read, m_read_buffer.size());
+}
+
+void IDEController::write_dma(IDE& ide, bool lba48)
+{
+    if (!latch_transfer(ide, lba48))
+        return;
+#ifdef IDE_DEBUG
+    vlog(LogIDE, "ide%u: Write DMA (LBA: %u, count: %u)", controller_index, transfer_lba, transfer_sectors);
+#endif
+    dma_active = true;
+    dma_to_memory = false;
+    m_write_buffer.resize(drive().bytes_per_sector() * transfer_sectors);
+    m_write_buffer_index = m_write_buffer.size();
+    ide.try_dma_transfer(*this);
+}
+
+void IDEController::set_multiple_mode(IDE& ide)
+{
+    // 0 disables multiple mode; otherwise the block size must be a power of two we support.
+    if (sector_count > max_multiple_sectors || (sector_count & (sector_count - 1))) {
+        vlog(LogIDE, "ide%u: Unsupported multiple mode block size %u", controller_index, sector_count);
+        error = ABRT;
+    } else {
+        multiple_sectors = sector_count;
+    }
+    ide.raise_irq(*this);
+}
+
 template<typename T>
 void IDEController::write_to_sector_buffer(IDE& ide, T data)
 {
+    if (busy())
+        return;
     if (m_write_buffer_index >= m_write_buffer.size()) {
         vlog(LogIDE, "ide%u: Write buffer already full!");
         return;
@@ -122,24 +263,22 @@ void IDEController::write_to_sector_buffer(IDE& ide, T data)
     T* buffer_ptr = reinterpret_cast<T*>(&m_write_buffer.data()[m_write_buffer_index]);
     *buffer_ptr = data;
     m_write_buffer_index += sizeof(T);
-    if (m_write_buffer_index < m_write_buffer.size())
+    if (m_write_buffer_index < m_write_buffer.size()) {
+        // Ask for the next block.
+        if (!(m_write_buffer_index % bytes_per_block()))
+            ide.raise_irq(*this);
         return;
+    }
     vlog(LogIDE, "ide%u: Got all sector data, flushing to disk!", controller_index);
-    FILE* f = fopen(qPrintable(drive().image_path()), "rb+");
-    RELEASE_ASSERT(f);
-    int result;
-    result = fseek(f, lba() * drive().bytes_per_sector(), SEEK_SET);
-    ASSERT(result != -1);
-    result = fwrite(m_write_buffer.data(), drive().bytes_per_sector(), sector_count, f);
-    ASSERT(result != -1);
-    result = fclose(f);
-    ASSERT(result != -1);
-    ide.raise_irq();
+    drive().start_write_sectors(transfer_lba, transfer_sectors, reinterpret_cast<const u8*>(m_write_buffer.constData()));
+    ide.begin_io(*this, IDE::PendingIO::Write, m_write_buffer.size());
 }
 
 template<typename T>
-T IDEController::read_from_sector_buffer()
+T IDEController::read_from_sector_buffer(IDE& ide)
 {
+    if (busy())
+        return 0;
     if (m_read_buffer_index >= m_read_buffer.size()) {
         vlog(LogIDE, "ide%u: No data left in read buffer!", controller_index);
         return 0;
@@ -151,21 +290,55 @@ T IDEController::read_from_sector_buffer()
     }
     const T* data = reinterpret_cast<T*>(&m_read_buffer.data()[m_read_buffer_index]);
     m_read_buffer_index += sizeof(T);
+    // The next block is ready.
+    if (m_read_buffer_index < m_read_buffer.size() && !(m_read_buffer_index % bytes_per_block()))
+        ide.raise_irq(*this);
     return *data;
 }
 
 static const int num_controllers = 2;
 
+// Host I/O runs on the drive's I/O thread, but the completion IRQ is raised
+// at a modeled point in virtual time: a fixed command overhead plus the media
+// transfer at roughly ATA-33 rates. That lets the guest run while the host
+// reads, and keeps --deterministic runs independent of host disk speed.
+static const u64 command_overhead_ns = 20000;
+static const u64 transfer_ns_per_byte = 30;
+
+// Where the bus master registers (BAR4) live. There's no PCI BIOS, so this is fixed.
+static const u16 bus_master_base = 0xc000;
+
+// Bus master command and status register bits.
+static const u8 BM_START = 0x01;
+static const u8 BM_TO_MEMORY = 0x08;
+static const u8 BM_ACTIVE = 0x01;
+static const u8 BM_ERROR = 0x02;
+static const u8 BM_INTERRUPT = 0x04;
+static const u8 BM_DRIVE0_DMA_CAPABLE = 0x20;
+
 struct IDE::Private {
     IDEController controller[num_controllers];
+    OwnPtr<EventScheduler::Timer> completion_timer[num_controllers];
 };
 
 IDE::IDE(Machine& machine)
     : IODevice("IDE", machine, 14)
+    , PCI::Function(0x8086, 0x7010, 0x01, 0x01, 0x80)
     , d(make<Private>())
 {
+    // Both channels in compatibility mode, bus master capable.
+    set_config16(0x04, 0x0001);
+    set_config32(0x20, bus_master_base | 1);
+    // IDETIM: decode enable for both channels.
+    set_config16(0x40, 0x8000);
+    set_config16(0x42, 0x8000);
+    machine.pci().attach(1, 1, *this);
+
+    for (int i = 0; i < num_controllers; ++i)
+        d->completion_timer[i] = make<EventScheduler::Timer>(machine.scheduler(), [this, i] { complete_io(d->controller[i]); });
+
     listen(0x170, IODevice::ReadWrite);
-    listen(0x171, IODevice::ReadOnly);
+    listen(0x171, IODevice::ReadWrite);
     listen(0x172, IODevice::ReadWrite);
     listen(0x173, IODevice::ReadWrite);
     listen(0x174, IODevice::ReadWrite);
@@ -173,7 +346,7 @@ IDE::IDE(Machine& machine)
     listen(0x176, IODevice::ReadWrite);
     listen(0x177, IODevice::ReadWrite);
     listen(0x1F0, IODevice::ReadWrite);
-    listen(0x1F1, IODevice::ReadOnly);
+    listen(0x1F1, IODevice::ReadWrite);
     listen(0x1F2, IODevice::ReadWrite);
     listen(0x1F3, IODevice::ReadWrite);
     listen(0x1F4, IODevice::ReadWrite);
@@ -181,7 +354,11 @@ IDE::IDE(Machine& machine)
     listen(0x1F6, IODevice::ReadWrite);
     listen(0x1F7, IODevice::ReadWrite);
 
-    listen(0x3f6, IODevice::ReadOnly);
+    listen(0x376, IODevice::ReadWrite);
+    listen(0x3f6, IODevice::ReadWrite);
+
+    for (u16 port = bus_master_base; port < bus_master_base + 16; ++port)
+        listen(port, IODevice::ReadWrite);
 
     reset();
 }
@@ -192,12 +369,55 @@ IDE::~IDE()
 
 void IDE::reset()
 {
-    d->controller[0] = IDEController();
-    d->controller[0].controller_index = 0;
-    d->controller[0].drive_ptr = &machine().fixed0();
-    d->controller[1] = IDEController();
-    d->controller[1].controller_index = 1;
-    d->controller[1].drive_ptr = &machine().fixed1();
+    for (int i = 0; i < num_controllers; ++i) {
+        reset_controller(d->controller[i]);
+        d->controller[i].device_control = 0;
+        d->controller[i].bus_master_command = 0;
+        d->controller[i].bus_master_status = d->controller[i].drive().present() ? BM_DRIVE0_DMA_CAPABLE : 0;
+        d->controller[i].prd_table_address = 0;
+    }
+}
+
+void IDE::reset_controller(IDEController& controller)
+{
+    const unsigned index = &controller - d->controller;
+    d->completion_timer[index]->stop();
+    if (controller.pending_io != PendingIO::None)
+        controller.drive().finish_async();
+
+    // The bus master registers belong to the PIIX, and the Device Control register to the host,
+    // so a software reset of the drive leaves them alone.
+    IDEController fresh;
+    fresh.controller_index = index;
+    fresh.drive_ptr = index ? &machine().fixed1() : &machine().fixed0();
+    fresh.device_control = controller.device_control;
+    fresh.bus_master_command = controller.bus_master_command;
+    fresh.bus_master_status = controller.bus_master_status;
+    fresh.prd_table_address = controller.prd_table_address;
+    // The ATA signature: a non-packet device, and diagnostic code 01h (no error) in the Error register.
+    fresh.sector_count = 1;
+    fresh.sector_index = 1;
+    fresh.error = IDEController::diagnostic_passed;
+    fresh.error_is_diagnostic_code = true;
+    controller = std::move(fresh);
+}
+
+void IDE::raise_irq(IDEController& controller)
+{
+    if (controller.device_control & IDEController::nIEN)
+        return;
+    IODevice::raise_irq();
+}
+
+void IDE::write_device_control(IDEController& controller, u8 data)
+{
+#ifdef IDE_DEBUG
+    vlog(LogIDE, "Controller %u device control set: %02X", controller.controller_index, data);
+#endif
+    bool entering_reset = (data & IDEController::SRST) && !(controller.device_control & IDEController::SRST);
+    controller.device_control = data;
+    if (entering_reset)
+        reset_controller(controller);
 }
 
 void IDE::out8(u16 port, u8 data)
@@ -206,35 +426,51 @@ void IDE::out8(u16 port, u8 data)
     vlog(LogIDE, "out8 %03x, %02x", port, data);
 #endif
 
+    if (port >= bus_master_base)
+        return bus_master_out8(port, data);
+
     const int controller_index = (((port)&0x1F0) == 0x170);
     IDEController& controller = d->controller[controller_index];
 
+    if (port == 0x3f6 || port == 0x376)
+        return write_device_control(controller, data);
+
+    // Any write to the command block goes back to reading the current registers.
+    controller.device_control &= ~IDEController::HOB;
+
     switch (port & 0xF) {
     case 0x0:
         controller.write_to_sector_buffer<u8>(*this, data);
         break;
+    case 0x1:
+        controller.features = data;
+        break;
     case 0x2:
 #ifdef IDE_DEBUG
         vlog(LogIDE, "Controller %d sector count set: %u", controller_index, data);
 #endif
+        controller.hob_sector_count = controller.sector_count;
         controller.sector_count = data;
         break;
     case 0x3:
 #ifdef IDE_DEBUG
         vlog(LogIDE, "Controller %d sector index set: %u", controller_index, data);
 #endif
+        controller.hob_lba_low = controller.sector_index;
         controller.sector_index = data;
         break;
     case 0x4:
 #ifdef IDE_DEBUG
         vlog(LogIDE, "Controller %d cylinder LSB set: %u", controller_index, data);
 #endif
+        controller.hob_lba_mid = least_significant<u8>(controller.cylinder_index);
         controller.cylinder_index = weld<u16>(most_significant<u8>(controller.cylinder_index), data);
         break;
     case 0x5:
 #ifdef IDE_DEBUG
         vlog(LogIDE, "Controller %d cylinder MSB set: %u", controller_index, data);
 #endif
+        controller.hob_lba_high = most_significant<u8>(controller.cylinder_index);
         controller.cylinder_index = weld<u16>(data, least_significant<u8>(controller.cylinder_index));
         break;
     case 0x6:
@@ -259,11 +495,13 @@ void IDE::out8(u16 port, u8 data)
 
 u8 IDE::in8(u16 port)
 {
+    if (port >= bus_master_base)
+        return bus_master_in8(port);
+
     int controller_index = (((port)&0x1F0) == 0x170);
     IDEController& controller = d->controller[controller_index];
 
-    // FIXME: This port should maybe be managed by the FDC?
-    if (port == 0x3f6) {
+    if (port == 0x3f6 || port == 0x376) {
 #ifdef IDE_DEBUG
         vlog(LogIDE, "Controller %d alternate status queried: %02X", controller_index, status(controller));
 #endif
@@ -272,7 +510,7 @@ u8 IDE::in8(u16 port)
 
     switch (port & 0xF) {
     case 0:
-        return controller.read_from_sector_buffer<u8>();
+        return controller.read_from_sector_buffer<u8>(*this);
     case 0x1:
 #ifdef IDE_DEBUG
         vlog(LogIDE, "Controller %d error queried: %02X", controller_index, controller.error);
@@ -282,22 +520,22 @@ u8 IDE::in8(u16 port)
 #ifdef IDE_DEBUG
         vlog(LogIDE, "Controller %d sector count queried: %u", controller_index, controller.sector_count);
 #endif
-        return controller.sector_count;
+        return controller.reads_hob() ? controller.hob_sector_count : controller.sector_count;
     case 0x3:
 #ifdef IDE_DEBUG
         vlog(LogIDE, "Controller %d sector index queried: %u", controller_index, controller.sectorIndex);
 #endif
-        return controller.sector_index;
+        return controller.reads_hob() ? controller.hob_lba_low : controller.sector_index;
     case 0x4:
 #ifdef IDE_DEBUG
         vlog(LogIDE, "Controller %d cylinder LSB queried: %02X", controller_index, least_significant<BYTE>(controller.cylinderIndex));
 #endif
-        return least_significant<u8>(controller.cylinder_index);
+        return controller.reads_hob() ? controller.hob_lba_mid : least_significant<u8>(controller.cylinder_index);
     case 0x5:
 #ifdef IDE_DEBUG
         vlog(LogIDE, "Controller %d cylinder MSB queried: %02X", controller_index, most_significant<BYTE>(controller.cylinderIndex));
 #endif
-        return most_significant<u8>(controller.cylinder_index);
+        return controller.reads_hob() ? controller.hob_lba_high : most_significant<u8>(controller.cylinder_index);
     case 0x6:
 #ifdef IDE_DEBUG
         vlog(LogIDE, "Controller %d head index queried: %u", controller_index, controller.head_index);
@@ -317,12 +555,15 @@ u8 IDE::in8(u16 port)
 
 u16 IDE::in16(u16 port)
 {
+    if (port >= bus_master_base)
+        return bus_master_in16(port);
+
     int controller_index = (((port)&0x1f0) == 0x170);
     IDEController& controller = d->controller[controller_index];
 
     switch (port & 0xF) {
     case 0:
-        return controller.read_from_sector_buffer<u16>();
+        return controller.read_from_sector_buffer<u16>(*this);
     default:
         return IODevice::in16(port);
     }
@@ -330,12 +571,17 @@ u16 IDE::in16(u16 port)
 
 u32 IDE::in32(u16 port)
 {
+    if (port >= bus_master_base && (port & 7) == 4)
+        return d->controller[(port >> 3) & 1].prd_table_address;
+    if (port >= bus_master_base)
+        return IODevice::in32(port);
+
     int controller_index = (((port)&0x1f0) == 0x170);
     IDEController& controller = d->controller[controller_index];
 
     switch (port & 0xF) {
     case 0:
-        return controller.read_from_sector_buffer<u32>();
+        return controller.read_from_sector_buffer<u32>(*this);
     default:
         return IODevice::in16(port);
     }
@@ -347,6 +593,9 @@ void IDE::out16(u16 port, u16 data)
     vlog(LogIDE, "out16 %03x, %04x", port, data);
 #endif
 
+    if (port >= bus_master_base)
+        return bus_master_out16(port, data);
+
     const int controller_index = (((port)&0x1F0) == 0x170);
     IDEController& controller = d->controller[controller_index];
 
@@ -365,6 +614,9 @@ void IDE::out32(u16 port, u32 data)
     vlog(LogIDE, "out32 %03x, %08x", port, data);
 #endif
 
+    if (port >= bus_master_base)
+        return bus_master_out32(port, data);
+
     const int controller_index = (((port)&0x1F0) == 0x170);
     IDEController& controller = d->controller[controller_index];
 
@@ -377,15 +629,264 @@ void IDE::out32(u16 port, u32 data)
     }
 }
 
+void IDE::begin_io(IDEController& controller, PendingIO io, u32 byte_count)
+{
+    controller.pending_io = io;
+    d->completion_timer[controller.controller_index]->start_after(command_overhead_ns + byte_count * transfer_ns_per_byte);
+}
+
+void IDE::complete_io(IDEController& controller)
+{
+    // Usually the host is long done by now; otherwise this waits for the remainder.
+    bool ok = controller.drive().finish_async();
+    auto io = controller.pending_io;
+    controller.pending_io = PendingIO::None;
+
+    if (!ok) {
+        vlog(LogIDE, "ide%u: I/O failed (LBA: %u, count: %u)", controller.controller_index, controller.transfer_lba, controller.transfer_sectors);
+        controller.error = IDEController::ABRT;
+    }
+    if (controller.dma_active) {
+        if (!ok)
+            return finish_dma(controller, false);
+        if (io == PendingIO::Read) {
+            controller.dma_data_ready = true;
+            return try_dma_transfer(controller);
+        }
+        return finish_dma(controller, true);
+    }
+
+    if (io == PendingIO::Read)
+        controller.m_read_buffer_index = ok ? 0 : controller.m_read_buffer.size();
+    raise_irq(controller);
+}
+
+void IDE::try_dma_transfer(IDEController& controller)
+{
+    if (!controller.dma_active || controller.pending_io != PendingIO::None)
+        return;
+    if (!(controller.bus_master_command & BM_START) || !is_bus_master_enabled())
+        return;
+    if (controller.dma_to_memory && !controller.dma_data_ready)
+        return;
+
+    if (!!(controller.bus_master_command & BM_TO_MEMORY) != controller.dma_to_memory) {
+        vlog(LogIDE, "ide%u: Bus master direction doesn't match the DMA command", controller.controller_index);
+        return finish_dma(controller, false);
+    }
+
+    if (controller.dma_to_memory) {
+        bool ok = transfer_prd_table(controller, reinterpret_cast<u8*>(controller.m_read_buffer.data()), controller.m_read_buffer.size(), true);
+        controller.m_read_buffer.clear();
+        controller.m_read_buffer_index = 0;
+        return finish_dma(controller, ok);
+    }
+
+    // Gather the data from guest memory first, then write it out like a PIO write.
+    if (!transfer_prd_table(controller, reinterpret_cast<u8*>(controller.m_write_buffer.data()), controller.m_write_buffer.size(), false))
+        return finish_dma(controller, false);
+    controller.drive().start_write_sectors(controller.transfer_lba, controller.transfer_sectors, reinterpret_cast<const u8*>(controller.m_write_buffer.constData()));
+    begin_io(controller, PendingIO::Write, controller.m_write_buffer.size());
+}
+
+bool IDE::transfer_prd_table(IDEController& controller, u8* data, u32 size, bool to_memory)
+{
+    // Each PRD is a dword-aligned physical base address, then a byte count (0 meaning 64 KiB)
+    // with the end-of-table flag in bit 31. A table can't cross a 64 KiB boundary.
+    auto& cpu = machine().cpu();
+    u32 prd_address = controller.prd_table_address;
+    u32 offset = 0;
+    for (;;) {
+        u32 base = cpu.read_physical_memory<u32>(PhysicalAddress(prd_address)) & ~1u;
+        u32 count_and_flags = cpu.read_physical_memory<u32>(PhysicalAddress(prd_address + 4));
+        u32 count = count_and_flags & 0xfffe;
+        if (!count)
+            count = 0x10000;
+        u32 chunk = std::min(count, size - offset);
+        if (to_memory)
+            cpu.write_physical_memory_block(PhysicalAddress(base), data + offset, chunk);
+        else
+            cpu.read_physical_memory_block(PhysicalAddress(base), data + offset, chunk);
+        offset += chunk;
+        if (offset == size)
+            return true;
+        if ((count_and_flags & 0x80000000) || ((prd_address + 8) & 0xffff) == 0) {
+            vlog(LogIDE, "ide%u: PRD table too short (%u of %u bytes)", controller.controller_index, offset, size);
+            return false;
+        }
+        prd_address += 8;
+    }
+}
+
+void IDE::finish_dma(IDEController& controller, bool ok)
+{
+    controller.dma_active = false;
+    controller.dma_data_ready = false;
+    controller.bus_master_status &= ~BM_ACTIVE;
+    controller.bus_master_status |= BM_INTERRUPT;
+    if (!ok) {
+        controller.bus_master_status |= BM_ERROR;
+        controller.error = IDEController::ABRT;
+    }
+    raise_irq(controller);
+}
+
+u8 IDE::bus_master_in8(u16 port)
+{
+    IDEController& controller = d->controller[(port >> 3) & 1];
+    switch (port & 7) {
+    case 0:
+        return controller.bus_master_command;
+    case 2:
+        return controller.bus_master_status;
+    case 4:
+    case 5:
+    case 6:
+    case 7:
+        return controller.prd_table_address >> ((port & 3) * 8);
+    default:
+        return 0;
+    }
+}
+
+void IDE::bus_master_out8(u16 port, u8 data)
+{
+    IDEController& controller = d->controller[(port >> 3) & 1];
+    switch (port & 7) {
+    case 0: {
+        bool was_started = controller.bus_master_command & BM_START;
+        controller.bus_master_command = data & (BM_START | BM_TO_MEMORY);
+        if (!(data & BM_START)) {
+            // Stopping the engine aborts whatever it was doing.
+            controller.bus_master_status &= ~BM_ACTIVE;
+        } else if (!was_started) {
+            controller.bus_master_status |= BM_ACTIVE;
+            try_dma_transfer(controller);
+        }
+        break;
+    }
+    case 2:
+        // Error and interrupt are write-1-to-clear; the drive DMA capable bits are plain storage.
+        controller.bus_master_status &= ~(data & (BM_ERROR | BM_INTERRUPT));
+        controller.bus_master_status = (controller.bus_master_status & ~0x60) | (data & 0x60);
+        break;
+    case 4:
+    case 5:
+    case 6:
+    case 7: {
+        unsigned shift = (port & 3) * 8;
+        u32 value = (controller.prd_table_address & ~(0xffu << shift)) | ((u32)data << shift);
+        controller.prd_table_address = value & ~3u;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// The bus master registers are byte-wide (the PRD table address is four of them), so wider accesses are split.
+u16 IDE::bus_master_in16(u16 port)
+{
+    return weld<u16>(bus_master_in8(port + 1), bus_master_in8(port));
+}
+
+void IDE::bus_master_out16(u16 port, u16 data)
+{
+    bus_master_out8(port, least_significant<u8>(data));
+    bus_master_out8(port + 1, most_significant<u8>(data));
+}
+
+void IDE::bus_master_out32(u16 port, u32 data)
+{
+    if ((port & 7) == 4) {
+        d->controller[(port >> 3) & 1].prd_table_address = data & ~3u;
+        return;
+    }
+    IODevice::out32(port, data);
+}
+
+u32 IDE::writable_bits(u8 reg) const
+{
+    // BAR4 answers size probes for its 16 bytes of I/O space.
+    if (reg == 0x20)
+        return 0x0000fff0;
+    return PCI::Function::writable_bits(reg);
+}
+
+void IDE::did_write_config(u8 reg)
+{
+    if (reg != 0x20)
+        return;
+    u16 base = config32(0x20) & 0xfff0;
+    if (base != 0xfff0 && base != bus_master_base) {
+        vlog(LogIDE, "Guest tried to move the bus master registers to %04x, keeping them at %04x", base, bus_master_base);
+        set_config32(0x20, bus_master_base | 1);
+    }
+}
+
 void IDE::execute_command(IDEController& controller, u8 command)
 {
+    if (controller.busy()) {
+        vlog(LogIDE, "ide%u: Command %02x issued while busy, ignoring", controller.controller_index, command);
+        return;
+    }
+    controller.error = 0;
+    controller.error_is_diagnostic_code = false;
     switch (command) {
-    case 0x20:
+    case 0x20: // READ SECTORS
     case 0x21:
-        controller.read_sectors(*this);
+        controller.read_sectors(*this, false, 1);
+        break;
+    case 0x24: // READ SECTORS EXT
+        controller.read_sectors(*this, true, 1);
+        break;
+    case 0xC4: // READ MULTIPLE
+    case 0x29: // READ MULTIPLE EXT
+        if (!controller.multiple_sectors)
+            return abort_command(controller);
+        controller.read_sectors(*this, command == 0x29, controller.multiple_sectors);
+        break;
+    case 0x30: // WRITE SECTORS
+    case 0x31:
+        controller.write_sectors(*this, false, 1);
+        break;
+    case 0x34: // WRITE SECTORS EXT
+        controller.write_sectors(*this, true, 1);
+        break;
+    case 0xC5: // WRITE MULTIPLE
+    case 0x39: // WRITE MULTIPLE EXT
+        if (!controller.multiple_sectors)
+            return abort_command(controller);
+        controller.write_sectors(*this, command == 0x39, controller.multiple_sectors);
+        break;
+    case 0xC6: // SET MULTIPLE MODE
+        controller.set_multiple_mode(*this);
+        break;
+    case 0xC8: // READ DMA
+    case 0xC9:
+        controller.read_dma(*this, false);
         break;
-    case 0x30:
-        controller.write_sectors();
+    case 0x25: // READ DMA EXT
+        controller.read_dma(*this, true);
+        break;
+    case 0xCA: // WRITE DMA
+    case 0xCB:
+        controller.write_dma(*this, false);
+        break;
+    case 0x35: // WRITE DMA EXT
+        controller.write_dma(*this, true);
+        break;
+    case 0xEF: // SET FEATURES
+        if (controller.features == 0x03 && (controller.sector_count & 0xf8) == 0x20) {
+            // Set transfer mode: multiword DMA.
+            controller.multiword_dma_mode = std::min(controller.sector_count & 7, 2);
+        }
+        raise_irq(controller);
+        break;
+    case 0xE7: // FLUSH CACHE
+    case 0xEA: // FLUSH CACHE EXT
+        controller.drive().start_flush();
+        begin_io(controller, PendingIO::Flush, 0);
         break;
     case 0xEC:
         controller.identify(*this);
@@ -394,7 +895,7 @@ void IDE::execute_command(IDEController& controller, u8 command)
     case 0x90:
         // Run diagnostics, FIXME: this isn't a very nice implementation lol.
         controller.error = 0;
-        raise_irq();
+        raise_irq(controller);
         break;
 #endif
     default:
@@ -403,8 +904,18 @@ void IDE::execute_command(IDEController& controller, u8 command)
     }
 }
 
+void IDE::abort_command(IDEController& controller)
+{
+    controller.error = IDEController::ABRT;
+    raise_irq(controller);
+}
+
 IDE::Status IDE::status(const IDEController& controller) const
 {
+    // While BSY is set, the other status bits aren't valid.
+    if (controller.busy() || (controller.device_control & IDEController::SRST))
+        return BUSY;
+
     // FIXME: ...
     unsigned status = INDEX | DRDY;
     if (controller.m_read_buffer_index < controller.m_read_buffer.size()) {
@@ -413,6 +924,8 @@ IDE::Status IDE::status(const IDEController& controller) const
     if (controller.m_write_buffer_index < controller.m_write_buffer.size()) {
         status |= DRQ;
     }
+    if (controller.error && !controller.error_is_diagnostic_code)
+        status |= ERROR;
 
     return static_cast<Status>(status);
 }
@@ -25,11 +25,15 @@
 #pragma once
 
 #include "OwnPtr.h"
+#include "PCI.h"
 #include "iodevice.h"
 
 struct IDEController;
 
-class IDE final : public IODevice {
+// Two legacy IDE channels, exposed as the IDE function of a PIIX3 so that guests can find the bus master DMA registers.
+class IDE final
+    : public IODevice
+    , public PCI::Function {
 public:
     enum Status {
         ERROR = 0x01,
@@ -54,7 +58,37 @@ public:
     virtual void out32(u16 port, u32 data) override;
 
 private:
+    friend struct IDEController;
+
+    // PCI::Function
+    virtual u32 writable_bits(u8 reg) const override;
+    virtual void did_write_config(u8 reg) override;
+
+    u8 bus_master_in8(u16 port);
+    void bus_master_out8(u16 port, u8 data);
+    u16 bus_master_in16(u16 port);
+    void bus_master_out16(u16 port, u16 data);
+    void bus_master_out32(u16 port, u32 data);
+    void try_dma_transfer(IDEController&);
+    bool transfer_prd_table(IDEController&, u8* data, u32 size, bool to_memory);
+    void finish_dma(IDEController&, bool ok);
+    void abort_command(IDEController&);
+    void reset_controller(IDEController&);
+    void write_device_control(IDEController&, u8);
+    // Raises IRQ 14 unless the host has masked it with nIEN.
+    void raise_irq(IDEController&);
+
+    // A command waiting for its host I/O. The drive reports BSY until it completes.
+    enum class PendingIO {
+        None,
+        Read,
+        Write,
+        Flush,
+    };
+
     void execute_command(IDEController&, u8);
+    void begin_io(IDEController&, PendingIO, u32 byte_count);
+    void complete_io(IDEController&);
     Status status(const IDEController&) const;
 
     struct Private;
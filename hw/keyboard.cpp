@@ -55,8 +55,6 @@
 #define CMD_DISABLE_KBD 0xAD
 #define CMD_ENABLE_KBD 0xAE
 
-extern bool kbd_has_data();
-
 Keyboard::Keyboard(Machine& machine)
     : IODevice("Keyboard", machine, 1)
 {
@@ -82,6 +80,9 @@ void Keyboard::reset()
 
     m_leds = 0;
 
+    m_key_queue.clear();
+    m_raw_queue.clear();
+
     m_ram[0] |= CCB_SYSTEM_FLAG;
 
     // FIXME: The BIOS should do this, no?
@@ -91,7 +92,6 @@ void Keyboard::reset()
 
 u8 Keyboard::in8(u16 port)
 {
-    extern u8 kbd_pop_raw();
     u8 data = 0;
 
     if (port == 0x60) {
@@ -103,17 +103,21 @@ u8 Keyboard::in8(u16 port)
         } else if (m_last_was_command && m_command == CMD_SET_LEDS) {
             data = 0xFA; // ACK
         } else {
-            u8 key = kbd_pop_raw();
+            u8 key = m_raw_queue.isEmpty() ? 0 : m_raw_queue.dequeue();
 #ifdef KBD_DEBUG
             vlog(LogKeyboard, "keyboard_data = %02X", key);
 #endif
             data = key;
+
+            // Let the guest know there's more where that came from.
+            if (!m_raw_queue.isEmpty())
+                did_enqueue_data();
         }
     } else if (port == 0x64) {
         // POST completed successfully.
         u8 status = (m_ram[0] & ATKBD_SYSTEM_FLAG);
         status |= m_last_was_command ? ATKBD_CMD_DATA : 0;
-        if (kbd_has_data())
+        if (!m_raw_queue.isEmpty())
             status |= ATKBD_OUTPUT_STATUS;
         if (is_enabled())
             status |= ATKBD_UNLOCKED;
@@ -225,3 +229,50 @@ void Keyboard::did_enqueue_data()
     if (m_ram[0] & CCB_KEYBOARD_INTERRUPT_ENABLE)
         raise_irq();
 }
+
+void Keyboard::enqueue_key_press(u16 scan_code, bool extended, u8 make_code)
+{
+    if (!is_enabled()) {
+        vlog(LogKeyboard, "KeyPress while keyboard disabled");
+        return;
+    }
+
+    if (scan_code != 0)
+        m_key_queue.enqueue(scan_code);
+
+    if (extended)
+        m_raw_queue.enqueue(0xE0);
+    m_raw_queue.enqueue(make_code);
+
+    did_enqueue_data();
+}
+
+void Keyboard::enqueue_key_release(bool extended, u8 break_code)
+{
+    if (!is_enabled()) {
+        vlog(LogKeyboard, "KeyRelease while keyboard disabled");
+        return;
+    }
+
+    if (extended)
+        m_raw_queue.enqueue(0xE0);
+    m_raw_queue.enqueue(break_code);
+
+    did_enqueue_data();
+}
+
+u16 Keyboard::next_key()
+{
+    m_raw_queue.clear();
+    if (!m_key_queue.isEmpty())
+        return m_key_queue.dequeue();
+    return 0;
+}
+
+u16 Keyboard::peek_key()
+{
+    m_raw_queue.clear();
+    if (!m_key_queue.isEmpty())
+        return m_key_queue.head();
+    return 0;
+}
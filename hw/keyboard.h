@@ -25,6 +25,7 @@
 #pragma once
 
 #include "iodevice.h"
+#include <QtCore/QQueue>
 
 class Keyboard final : public QObject
     , public IODevice {
@@ -45,12 +46,23 @@ public:
 
     bool is_enabled() const { return m_enabled; }
 
-    void did_enqueue_data();
+    // Called by InputLog on the worker thread.
+    void enqueue_key_press(u16 scan_code, bool extended, u8 make_code);
+    void enqueue_key_release(bool extended, u8 break_code);
+
+    // For the BIOS keyboard services.
+    u16 next_key();
+    u16 peek_key();
 
 signals:
     void leds_changed(int);
 
 private:
+    void did_enqueue_data();
+
+    QQueue<u16> m_key_queue;
+    QQueue<u8> m_raw_queue;
+
     u8 m_system_control_port_data;
     u8 m_ram[64];
     u8 m_command;
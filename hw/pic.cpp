@@ -25,6 +25,7 @@
 #include "pic.h"
 #include "CPU.h"
 #include "Common.h"
+#include "InputLog.h"
 #include "debug.h"
 #include "machine.h"
 
@@ -229,6 +230,7 @@ void PIC::raise_irq(Machine& machine, u8 num)
     }
 
     update_pending_requests(machine);
+    machine.cpu().wake_up();
 }
 
 void PIC::lower_irq(Machine& machine, u8 num)
@@ -274,6 +276,9 @@ void PIC::service_irq(CPU& cpu)
     if (irqToService == 0xFF)
         return;
 
+    if (UNLIKELY(machine.input_log().mode() != InputLog::Mode::Live))
+        machine.input_log().did_service_irq(Badge<PIC>(), irqToService);
+
     if (irqToService < 8) {
         machine.master_pic().m_irr &= ~(1 << irqToService);
         machine.master_pic().m_isr |= (1 << irqToService);
@@ -24,14 +24,15 @@
 
 #include "pit.h"
 #include "Common.h"
+#include "EventScheduler.h"
 #include "debug.h"
+#include "machine.h"
 #include "pic.h"
-#include <QElapsedTimer>
-#include <math.h>
 
 //#define PIT_DEBUG
 
-static const double base_frequency = 1193.1816666; // 1.193182 MHz
+static const u64 base_frequency = 1193182; // 1.193182 MHz
+static const u64 nanoseconds_per_second = 1000000000;
 
 enum DecrementMode {
     DecrementBinary = 0,
@@ -46,31 +47,59 @@ enum CounterAccessState {
     AccessMSBThenLSB
 };
 
+static CounterAccessState access_state_for_format(u8 format)
+{
+    switch (format) {
+    case 1:
+        return AccessMSBOnly;
+    case 2:
+        return AccessLSBOnly;
+    case 3:
+        return AccessLSBThenMSB;
+    default:
+        return ReadLatchedLSB;
+    }
+}
+
+static u64 ns_to_ticks(u64 ns)
+{
+    return (ns / nanoseconds_per_second) * base_frequency + (ns % nanoseconds_per_second) * base_frequency / nanoseconds_per_second;
+}
+
+static u64 ticks_to_ns(u64 ticks)
+{
+    // Round up, so that ns_to_ticks() of the result is at least `ticks'.
+    return (ticks / base_frequency) * nanoseconds_per_second + ((ticks % base_frequency) * nanoseconds_per_second + base_frequency - 1) / base_frequency;
+}
+
 struct CounterInfo {
-    u16 start_value { 0xffff };
     u16 reload { 0xffff };
-    u16 value();
     u8 mode { 0 };
     DecrementMode decrement_mode { DecrementBinary };
     u16 latched_value { 0xffff };
     CounterAccessState access_state { ReadLatchedLSB };
     u8 format { 0 };
-    QElapsedTimer qtimer;
 
-    void check(PIT&);
-    bool rolled_over { false };
+    // Virtual time (see EventScheduler) at which the counter was last (re)started.
+    u64 start_ns { 0 };
+
+    u32 period() const { return reload ? reload : 0x10000; }
+    u16 value(u64 now_ns) const;
 };
 
 struct PIT::Private {
     CounterInfo counter[3];
-    int frequency { 0 };
-    OwnPtr<ThreadedTimer> threaded_timer;
+
+    OwnPtr<EventScheduler::Timer> irq_timer;
+    u64 next_irq_tick { 0 };
 };
 
 PIT::PIT(Machine& machine)
     : IODevice("PIT", machine, 0)
     , d(make<Private>())
 {
+    d->irq_timer = make<EventScheduler::Timer>(machine.scheduler(), [this] { irq_timer_fired(); });
+
     listen(0x40, IODevice::ReadWrite);
     listen(0x41, IODevice::ReadWrite);
     listen(0x42, IODevice::ReadWrite);
@@ -85,72 +114,58 @@ PIT::~PIT()
 
 void PIT::reset()
 {
-    d->frequency = 0;
     d->counter[0] = CounterInfo();
     d->counter[1] = CounterInfo();
     d->counter[2] = CounterInfo();
+
+    // FIXME: This should be done by the BIOS instead.
+    reconfigure_timer(0);
+    reconfigure_timer(1);
+    reconfigure_timer(2);
 }
 
-u16 CounterInfo::value()
+u16 CounterInfo::value(u64 now_ns) const
 {
-    double nsec = qtimer.nsecsElapsed() / 1000;
-    int ticks = floor(nsec * base_frequency);
-
-    int current_value = start_value - ticks;
-    if (current_value >= reload) {
-        vlog(LogTimer, "Current value{%d} >= reload{%d}", current_value, reload);
-        if (reload == 0)
-            current_value = 0;
-        else
-            current_value %= reload;
-        rolled_over = true;
-    } else if (current_value < 0) {
-        if (reload == 0)
-            current_value = 0;
-        else
-            current_value = current_value % reload + reload;
-        rolled_over = true;
-    }
+    u64 ticks = ns_to_ticks(now_ns - start_ns);
+    u16 current_value = period() - ticks % period();
 
 #ifdef PIT_DEBUG
-    vlog(LogTimer, "nsec elapsed: %g, ticks: %g, value: %u", nsec, ticks, currentValue);
+    vlog(LogTimer, "ns elapsed: %llu, ticks: %llu, value: %u", (unsigned long long)(now_ns - start_ns), (unsigned long long)ticks, current_value);
 #endif
     return current_value;
 }
 
-void CounterInfo::check(PIT& pit)
-{
-    value();
-    if (rolled_over) {
-        if (mode == 0)
-            pit.raise_irq();
-        rolled_over = false;
-    }
-}
-
 void PIT::reconfigure_timer(u8 index)
 {
     auto& counter = d->counter[index];
-    counter.qtimer.start();
+    counter.start_ns = machine().scheduler().now();
+
+    if (index == 0) {
+        d->next_irq_tick = 0;
+        schedule_next_irq();
+    }
 }
 
-void PIT::boot()
+void PIT::schedule_next_irq()
 {
-    d->threaded_timer = make<ThreadedTimer>(*this, 5);
+    auto& counter = d->counter[0];
 
-    // FIXME: This should be done by the BIOS instead.
-    reconfigure_timer(0);
-    reconfigure_timer(1);
-    reconfigure_timer(2);
+    // FIXME: Mode 0 should only fire once, but we've always treated it as periodic,
+    //        and the BIOS leaves counter 0 in mode 0.
+    if (counter.mode != 0 && counter.mode != 2 && counter.mode != 3) {
+        d->irq_timer->stop();
+        return;
+    }
+
+    // Deadlines are computed from the counter start time, so rounding doesn't accumulate.
+    d->next_irq_tick += counter.period();
+    d->irq_timer->start_at(counter.start_ns + ticks_to_ns(d->next_irq_tick));
 }
 
-void PIT::threaded_timer_fired(Badge<ThreadedTimer>)
+void PIT::irq_timer_fired()
 {
-#ifndef CT_DETERMINISTIC
-    d->counter[0].check(*this);
-    d->counter[1].check(*this);
-    d->counter[2].check(*this);
-#endif
+    raise_irq();
+    schedule_next_irq();
 }
 
 u8 PIT::read_counter(u8 index)
@@ -164,7 +179,7 @@ u8 PIT::read_counter(u8 index)
         break;
     case ReadLatchedMSB:
         data = most_significant<u8>(counter.latched_value);
-        counter.access_state = ReadLatchedLSB;
+        counter.access_state = access_state_for_format(counter.format);
         break;
     case AccessLSBOnly:
         data = least_significant<u8>(counter.latched_value);
@@ -173,11 +188,11 @@ u8 PIT::read_counter(u8 index)
         data = most_significant<u8>(counter.latched_value);
         break;
     case AccessLSBThenMSB:
-        data = least_significant<u8>(counter.value());
+        data = least_significant<u8>(counter.value(machine().scheduler().now()));
         counter.access_state = AccessMSBThenLSB;
         break;
     case AccessMSBThenLSB:
-        data = most_significant<u8>(counter.value());
+        data = most_significant<u8>(counter.value(machine().scheduler().now()));
         counter.access_state = AccessLSBThenMSB;
         break;
     }
@@ -262,25 +277,22 @@ void PIT::mode_control(int timer_index, u8 data)
     ASSERT(counter_index <= 2);
     CounterInfo& counter = d->counter[counter_index];
 
+    if (((data >> 4) & 3) == 0) {
+        // Counter latch command, this doesn't touch the counter's mode or format.
+        counter.access_state = ReadLatchedLSB;
+        counter.latched_value = counter.value(machine().scheduler().now());
+        return;
+    }
+
     counter.decrement_mode = static_cast<DecrementMode>(data & 1);
     counter.mode = (data >> 1) & 7;
 
+    // Modes 6 and 7 are aliases for modes 2 and 3.
+    if (counter.mode > 5)
+        counter.mode -= 4;
+
     counter.format = (data >> 4) & 3;
-    switch (counter.format) {
-    case 0:
-        counter.access_state = ReadLatchedLSB;
-        counter.latched_value = counter.value();
-        break;
-    case 1:
-        counter.access_state = AccessMSBOnly;
-        break;
-    case 2:
-        counter.access_state = AccessLSBOnly;
-        break;
-    case 3:
-        counter.access_state = AccessLSBThenMSB;
-        break;
-    }
+    counter.access_state = access_state_for_format(counter.format);
 
 #ifdef PIT_DEBUG
     vlog(LogTimer, "Setting mode for counter %u { dec: %s, mode: %u, fmt: %02x }",
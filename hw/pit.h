@@ -25,12 +25,9 @@
 #pragma once
 
 #include "OwnPtr.h"
-#include "ThreadedTimer.h"
 #include "iodevice.h"
 
-class PIT final
-    : public IODevice
-    , public ThreadedTimer::Listener {
+class PIT final : public IODevice {
 public:
     explicit PIT(Machine&);
     virtual ~PIT();
@@ -39,10 +36,6 @@ public:
     virtual u8 in8(u16 port) override;
     virtual void out8(u16 port, u8 data) override;
 
-    void boot();
-
-    virtual void threaded_timer_fired(Badge<ThreadedTimer>) override;
-
 private:
     friend class CPU;
 
@@ -51,6 +44,8 @@ private:
 
     void mode_control(int timerIndex, u8 data);
     void reconfigure_timer(u8 index);
+    void schedule_next_irq();
+    void irq_timer_fired();
 
     struct Private;
     OwnPtr<Private> d;
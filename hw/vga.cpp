@@ -25,10 +25,14 @@
 #include "vga.h"
 #include "CPU.h"
 #include "Common.h"
+#include "EventScheduler.h"
+#include "VBE.h"
 #include "debug.h"
 #include "machine.h"
+#include <QtCore/QMutex>
 #include <QtGui/QBrush>
 #include <QtGui/QColor>
+#include <algorithm>
 
 struct RGBColor {
     u8 red;
@@ -42,7 +46,21 @@ struct VGA::Private {
     QBrush brush[16];
     u8* memory { nullptr };
     u8* plane[4];
-    u8 latch[4];
+
+    // What the last read loaded from each plane, plane N in byte N.
+    u32 latch { 0 };
+
+    // The graphics controller and sequencer state that write_memory8() needs, expanded to one byte per plane.
+    // Rebuilt by update_write_pipeline() whenever those registers change.
+    struct {
+        u8 write_mode;
+        u8 rotate_count;
+        u8 logical_op;
+        u8 map_mask;
+        u32 set_reset;
+        u32 enable_set_reset;
+        u32 bit_mask;
+    } write_pipeline;
 
     struct {
         u8 reg_index;
@@ -102,8 +120,36 @@ struct VGA::Private {
 
     bool write_protect;
 
-    bool screen_in_refresh { false };
-    u8 status_register { 0 };
+    // Display timing in emulated time, derived from the CRTC by update_timing().
+    struct {
+        u64 line_ns;
+        u64 horizontal_display_ns;
+        u32 display_lines;
+        u32 retrace_start_line;
+        u32 retrace_end_line;
+        u32 total_lines;
+    } timing;
+
+    // Fires at the start of the next vertical retrace once something visible has changed.
+    OwnPtr<EventScheduler::Timer> retrace_timer;
+
+    // The snapshot double buffer, see publish_snapshot() and acquire_snapshot().
+    Snapshot snapshots[2];
+    QMutex snapshot_lock;
+    int ready_snapshot { -1 };
+    int reading_snapshot { -1 };
+    // Blocks that changed in published snapshots the reader hasn't acquired yet.
+    DirtyMap unacquired;
+
+    // Back-to-back status register reads that came back the same, see in8(0x3DA).
+    u8 last_status { 0 };
+    u64 last_status_read_cycle { 0 };
+    unsigned status_poll_count { 0 };
+
+    // Blocks written since the last published snapshot. Only the CPU thread touches these;
+    // the renderer learns about changes through the snapshot handoff.
+    u64 dirty[DirtyMap::word_count] {};
+    bool all_dirty { true };
 };
 
 static const RGBColor default_vga_color_registers[256] = {
@@ -183,6 +229,8 @@ VGA::VGA(Machine& m)
     , MemoryProvider(PhysicalAddress(0xa0000), 131072)
     , d(make<Private>())
 {
+    d->retrace_timer = make<EventScheduler::Timer>(machine().scheduler(), [this] { retrace_timer_fired(); });
+
     machine().cpu().register_memory_provider(*this);
 
     listen(0x3B4, IODevice::ReadWrite);
@@ -226,6 +274,10 @@ void VGA::reset()
     d->crtc.vertical_display_end = 399;
     d->crtc.maximum_scanline = 0;
     d->crtc.reg[0x13] = 80;
+    // Line compare at its maximum, so there's no split screen until a guest asks for one.
+    d->crtc.reg[0x07] = 0x10;
+    d->crtc.reg[0x09] = 0x40;
+    d->crtc.reg[0x18] = 0xff;
 
     d->dac.data_read_index = 0;
     d->dac.data_read_subindex = 0;
@@ -256,8 +308,7 @@ void VGA::reset()
     memcpy(d->dac.color, default_vga_color_registers, sizeof(default_vga_color_registers));
 
     d->palette_dirty = true;
-    d->screen_in_refresh = false;
-    d->status_register = 0;
+    d->status_poll_count = 0;
 
     d->memory = new u8[0x40000];
     d->plane[0] = d->memory;
@@ -267,20 +318,22 @@ void VGA::reset()
 
     memset(d->memory, 0x00, 0x40000);
 
-    d->latch[0] = 0;
-    d->latch[1] = 0;
-    d->latch[2] = 0;
-    d->latch[3] = 0;
+    d->latch = 0;
 
     d->write_protect = false;
 
+    update_write_pipeline();
+    update_timing();
+
     synchronize_colors();
     set_palette_dirty(true);
+    invalidate_all();
+    publish_snapshot();
 }
 
 void VGA::out8(u16 port, u8 data)
 {
-    machine().notify_screen();
+    request_present();
 
     switch (port) {
     case 0x3B4:
@@ -323,6 +376,10 @@ void VGA::out8(u16 port, u8 data)
                 d->crtc.vertical_display_end |= 0x200;
         }
         d->crtc.reg[d->crtc.reg_index] = data;
+        update_timing();
+        // Cursor changes are drawn on top of the screen contents, everything else may change the layout.
+        if (d->crtc.reg_index != 0x0A && d->crtc.reg_index != 0x0B && d->crtc.reg_index != 0x0E && d->crtc.reg_index != 0x0F)
+            invalidate_all();
         break;
 
     case 0x3BA:
@@ -339,6 +396,7 @@ void VGA::out8(u16 port, u8 data)
         d->misc_output.vertical_sync_polarity = (data >> 7) & 1;
         // FIXME: Support remapping between 3bx/3dx
         ASSERT(d->misc_output.input_output_address_select == true);
+        update_timing();
         break;
 
     case 0x3C0: {
@@ -370,6 +428,7 @@ void VGA::out8(u16 port, u8 data)
                     break;
                 }
             }
+            invalidate_all();
         }
         d->attr.next_3c0_is_index = !d->attr.next_3c0_is_index;
         break;
@@ -391,6 +450,12 @@ void VGA::out8(u16 port, u8 data)
             break;
         }
         d->sequencer.reg[d->sequencer.reg_index] = data;
+        update_write_pipeline();
+        if (d->sequencer.reg_index == 1)
+            update_timing();
+        // The map mask only affects how the CPU writes to memory.
+        if (d->sequencer.reg_index != 2)
+            invalidate_all();
         break;
 
     case 0x3C6:
@@ -448,11 +513,13 @@ void VGA::out8(u16 port, u8 data)
             break;
         }
         d->graphics_ctrl.reg[d->graphics_ctrl.reg_index] = data;
+        update_write_pipeline();
         if (d->graphics_ctrl.reg_index == 6) {
             d->graphics_ctrl.memory_map_select = (data >> 2) & 3;
             d->graphics_ctrl.alphanumeric_mode_disable = data & 1;
             //vlog(LogVGA, "Memory map select: %u", d->graphics_ctrl.memory_map_select);
             //vlog(LogVGA, "Alphanumeric mode disable: %u", d->graphics_ctrl.alphanumeric_mode_disable);
+            invalidate_all();
         }
         break;
 
@@ -463,15 +530,234 @@ void VGA::out8(u16 port, u8 data)
     }
 }
 
-void VGA::will_refresh_screen()
+// Standard VGA 70 Hz timing (400 lines at 25.175 MHz), for when the CRTC doesn't hold anything sensible.
+static const u64 default_line_ns = 31778;
+static const u64 default_horizontal_display_ns = 25422;
+static const u32 default_display_lines = 400;
+static const u32 default_retrace_start_line = 412;
+static const u32 default_retrace_end_line = 414;
+static const u32 default_total_lines = 449;
+
+// Status register reads at most this many cycles apart, returning the same value this many times in a row, count as polling.
+static const u64 status_poll_max_cycles = 64;
+static const unsigned status_poll_threshold = 4;
+
+void VGA::update_timing()
+{
+    auto& reg = d->crtc.reg;
+    auto& timing = d->timing;
+
+    u64 dot_clock = d->misc_output.clock_select == 1 ? 28322000 : 25175000;
+    u64 dots_per_character = (d->sequencer.reg[1] & 1) ? 8 : 9;
+    u64 horizontal_total = reg[0x00] + 5;
+    u64 horizontal_display = reg[0x01] + 1;
+
+    u32 vertical_total = reg[0x06] + 2;
+    if (reg[0x07] & 0x01)
+        vertical_total += 0x100;
+    if (reg[0x07] & 0x20)
+        vertical_total += 0x200;
+
+    u32 retrace_start = reg[0x10];
+    if (reg[0x07] & 0x04)
+        retrace_start |= 0x100;
+    if (reg[0x07] & 0x80)
+        retrace_start |= 0x200;
+    // Only the low 4 bits of the end line are programmed, it's the next line where those match.
+    u32 retrace_length = ((reg[0x11] & 0x0f) - retrace_start) & 0x0f;
+    if (!retrace_length)
+        retrace_length = 16;
+
+    u32 display_lines = d->crtc.vertical_display_end + 1;
+
+    if (horizontal_total <= horizontal_display || display_lines >= vertical_total || retrace_start < display_lines || retrace_start + retrace_length > vertical_total) {
+        timing.line_ns = default_line_ns;
+        timing.horizontal_display_ns = default_horizontal_display_ns;
+        timing.display_lines = default_display_lines;
+        timing.retrace_start_line = default_retrace_start_line;
+        timing.retrace_end_line = default_retrace_end_line;
+        timing.total_lines = default_total_lines;
+        return;
+    }
+
+    timing.line_ns = horizontal_total * dots_per_character * 1000000000 / dot_clock;
+    timing.horizontal_display_ns = horizontal_display * dots_per_character * 1000000000 / dot_clock;
+    timing.display_lines = display_lines;
+    timing.retrace_start_line = retrace_start;
+    timing.retrace_end_line = retrace_start + retrace_length;
+    timing.total_lines = vertical_total;
+}
+
+u64 VGA::frame_duration_ns() const
+{
+    return d->timing.line_ns * d->timing.total_lines;
+}
+
+u64 VGA::next_retrace_ns(u64 now_ns) const
+{
+    u64 frame_ns = frame_duration_ns();
+    u64 retrace_ns = now_ns - now_ns % frame_ns + d->timing.retrace_start_line * d->timing.line_ns;
+    if (retrace_ns <= now_ns)
+        retrace_ns += frame_ns;
+    return retrace_ns;
+}
+
+// Returns the 0x3DA status bits at the given time, and when they'll change next.
+u8 VGA::status_at(u64 now_ns, u64& next_change_ns) const
+{
+    auto& timing = d->timing;
+    u64 frame_ns = frame_duration_ns();
+    u64 frame_start = now_ns - now_ns % frame_ns;
+    u32 line = (now_ns - frame_start) / timing.line_ns;
+    u64 line_start = frame_start + line * timing.line_ns;
+
+    u8 status = 0;
+    if (line >= timing.retrace_start_line && line < timing.retrace_end_line)
+        status |= 0x08;
+
+    if (line < timing.display_lines) {
+        if (now_ns - line_start < timing.horizontal_display_ns) {
+            next_change_ns = line_start + timing.horizontal_display_ns;
+        } else {
+            // Horizontal blanking.
+            status |= 0x01;
+            next_change_ns = line_start + timing.line_ns;
+        }
+        return status;
+    }
+
+    // Vertical blanking, only the retrace bit moves until the next frame starts.
+    status |= 0x01;
+    if (line < timing.retrace_start_line)
+        next_change_ns = frame_start + timing.retrace_start_line * timing.line_ns;
+    else if (line < timing.retrace_end_line)
+        next_change_ns = frame_start + timing.retrace_end_line * timing.line_ns;
+    else
+        next_change_ns = frame_start + frame_ns;
+    return status;
+}
+
+void VGA::request_present()
+{
+    // Changes are presented when the retrace starts, so the screen refreshes at most once per emulated frame.
+    if (!d->retrace_timer->is_active())
+        d->retrace_timer->start_at(next_retrace_ns(machine().scheduler().now()));
+}
+
+void VGA::retrace_timer_fired()
+{
+    publish_snapshot();
+    machine().notify_screen();
+
+    // Writes to the linear framebuffer don't come through us, so keep presenting every frame while it's in use.
+    if (machine().vbe().is_enabled())
+        request_present();
+}
+
+VGA::Snapshot::Snapshot()
+    : m_memory(0x40000)
+{
+}
+
+void VGA::publish_snapshot()
+{
+    DirtyMap changed;
+    take_dirty_map(changed);
+
+    int target;
+    {
+        QMutexLocker locker(&d->snapshot_lock);
+        // Never touch the snapshot the reader holds. Otherwise, leave the one it hasn't picked up yet alone while we work.
+        if (d->reading_snapshot != -1)
+            target = 1 - d->reading_snapshot;
+        else if (d->ready_snapshot != -1)
+            target = 1 - d->ready_snapshot;
+        else
+            target = 0;
+        if (d->ready_snapshot == target)
+            d->ready_snapshot = -1;
+    }
+
+    for (auto& snapshot : d->snapshots)
+        snapshot.m_stale.merge(changed);
+
+    // Bring the target up to date with everything that changed since it was last published, not just this frame.
+    auto& snapshot = d->snapshots[target];
+    for (u32 i = 0; i < DirtyMap::word_count; ++i) {
+        u64 bits = snapshot.m_stale.m_bits[i];
+        while (bits) {
+            u32 block = i * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            memcpy(&snapshot.m_memory[block * dirty_block_size], &d->memory[block * dirty_block_size], dirty_block_size);
+        }
+    }
+    snapshot.m_stale.clear();
+
+    memcpy(snapshot.m_crtc, d->crtc.reg, sizeof(snapshot.m_crtc));
+    for (int i = 0; i < 256; ++i)
+        snapshot.m_color[i] = color(i).rgb();
+    for (int i = 0; i < 16; ++i)
+        snapshot.m_palette_color[i] = palette_color(i).rgb();
+    snapshot.m_video_mode = current_video_mode();
+    // FIXME: Don't get this through the BDA.
+    snapshot.m_text_columns = machine().cpu().read_physical_memory<u8>(PhysicalAddress(0x44a));
+    snapshot.m_line_compare = line_compare();
+    snapshot.m_vertical_display_end = vertical_display_end();
+    publish_font(snapshot);
+    publish_vbe(snapshot);
+    set_palette_dirty(false);
+
+    QMutexLocker locker(&d->snapshot_lock);
+    d->ready_snapshot = target;
+    d->unacquired.merge(changed);
+}
+
+void VGA::publish_font(Snapshot& snapshot)
+{
+    // FIXME: The font should live in plane 2, not wherever the BIOS font vector points.
+    auto vector = machine().cpu().get_real_mode_interrupt_vector(0x43);
+    auto* font = machine().cpu().pointer_to_physical_memory(PhysicalAddress::from_real_mode(vector));
+    if (font)
+        memcpy(snapshot.m_font, font, sizeof(snapshot.m_font));
+}
+
+void VGA::publish_vbe(Snapshot& snapshot)
+{
+    auto& vbe = machine().vbe();
+    snapshot.m_vbe_enabled = vbe.is_enabled();
+    if (!snapshot.m_vbe_enabled) {
+        snapshot.m_vbe_display.clear();
+        return;
+    }
+
+    snapshot.m_vbe_width = vbe.width();
+    snapshot.m_vbe_height = vbe.height();
+    snapshot.m_vbe_bits_per_pixel = vbe.bits_per_pixel();
+    snapshot.m_vbe_bytes_per_line = vbe.bytes_per_line();
+
+    // Only copy what's on screen. Panning can put the bottom of it past the end of the framebuffer.
+    const u8* start = vbe.display_start();
+    size_t available = vbe.framebuffer() + VBE::framebuffer_size - start;
+    size_t visible = (size_t)(vbe.height() - 1) * vbe.bytes_per_line() + vbe.width() * ((vbe.bits_per_pixel() + 7) / 8);
+    snapshot.m_vbe_display.resize(std::min(visible, available));
+    memcpy(snapshot.m_vbe_display.data(), start, snapshot.m_vbe_display.size());
+}
+
+const VGA::Snapshot& VGA::acquire_snapshot(DirtyMap& dirty)
 {
-    d->screen_in_refresh = true;
+    QMutexLocker locker(&d->snapshot_lock);
+    if (d->ready_snapshot != -1) {
+        d->reading_snapshot = d->ready_snapshot;
+        d->ready_snapshot = -1;
+        dirty.merge(d->unacquired);
+        d->unacquired.clear();
+    }
+    return snapshot();
 }
 
-void VGA::did_refresh_screen()
+const VGA::Snapshot& VGA::snapshot() const
 {
-    d->screen_in_refresh = false;
-    d->status_register |= 0x08;
+    return d->snapshots[std::max(d->reading_snapshot, 0)];
 }
 
 u8 VGA::in8(u16 port)
@@ -512,7 +798,6 @@ u8 VGA::in8(u16 port)
 
     case 0x3BA:
     case 0x3DA: {
-        u8 value = d->status_register;
         // 6845 - Port 3DA Status Register
         //
         //  |7|6|5|4|3|2|1|0|  3DA Status Register
@@ -522,8 +807,24 @@ u8 VGA::in8(u16 port)
         //  | | | | `------- 1 = vertical retrace, RAM access OK for next 1.25ms
         //  `-------------- unused
 
-        d->status_register ^= 0x01;
-        d->status_register &= 0x01;
+        auto& scheduler = machine().scheduler();
+        u64 next_change_ns;
+        u8 value = status_at(scheduler.now(), next_change_ns);
+
+        // A guest reading the same status over and over is just waiting for the next edge (usually the retrace.)
+        // Skip virtual time ahead to it instead of spinning through the loop on the host.
+        u64 cycle = machine().cpu().cycle();
+        if (value == d->last_status && cycle - d->last_status_read_cycle <= status_poll_max_cycles) {
+            if (++d->status_poll_count >= status_poll_threshold) {
+                machine().cpu().idle_until(next_change_ns);
+                value = status_at(scheduler.now(), next_change_ns);
+                d->status_poll_count = 0;
+            }
+        } else {
+            d->status_poll_count = 0;
+        }
+        d->last_status = value;
+        d->last_status_read_cycle = machine().cpu().cycle();
 
         d->attr.next_3c0_is_index = true;
         return value;
@@ -647,6 +948,73 @@ bool VGA::is_palette_dirty()
     return d->palette_dirty;
 }
 
+void VGA::did_write_to_memory(u32 memory_offset)
+{
+    u32 block = (memory_offset & 0x3ffff) / dirty_block_size;
+    u64 bit = 1ull << (block % 64);
+    // Only ask for a refresh when a block goes from clean to dirty, the screen will pick up the rest in one go.
+    u64& word = d->dirty[block / 64];
+    if (!(word & bit)) {
+        word |= bit;
+        request_present();
+    }
+}
+
+void VGA::invalidate_all()
+{
+    d->all_dirty = true;
+    request_present();
+}
+
+void VGA::take_dirty_map(DirtyMap& map)
+{
+    if (d->all_dirty) {
+        d->all_dirty = false;
+        memset(d->dirty, 0, sizeof(d->dirty));
+        map.set_all();
+        return;
+    }
+    memcpy(map.m_bits, d->dirty, sizeof(d->dirty));
+    memset(d->dirty, 0, sizeof(d->dirty));
+}
+
+void VGA::DirtyMap::set_all()
+{
+    for (auto& word : m_bits)
+        word = ~0ull;
+}
+
+void VGA::DirtyMap::clear()
+{
+    for (auto& word : m_bits)
+        word = 0;
+}
+
+void VGA::DirtyMap::merge(const DirtyMap& other)
+{
+    for (u32 i = 0; i < word_count; ++i)
+        m_bits[i] |= other.m_bits[i];
+}
+
+bool VGA::DirtyMap::is_dirty(int plane, u32 offset, u32 length) const
+{
+    ASSERT(plane >= 0 && plane <= 3);
+    if (!length)
+        return false;
+    u32 first_block = (plane * 0x10000 + offset) / dirty_block_size;
+    u32 last_block = std::min((plane * 0x10000 + offset + length - 1) / dirty_block_size, word_count * 64 - 1);
+    for (u32 block = first_block; block <= last_block; ++block) {
+        if (m_bits[block / 64] & (1ull << (block % 64)))
+            return true;
+    }
+    return false;
+}
+
+bool VGA::DirtyMap::is_any_plane_dirty(u32 offset, u32 length) const
+{
+    return is_dirty(0, offset, length) || is_dirty(1, offset, length) || is_dirty(2, offset, length) || is_dirty(3, offset, length);
+}
+
 QColor VGA::palette_color(int attribute_register_index) const
 {
     const RGBColor& c = d->dac.color[d->attr.palette_reg[attribute_register_index]];
@@ -664,6 +1032,21 @@ u16 VGA::start_address() const
     return weld<u16>(d->crtc.reg[0x0C], d->crtc.reg[0x0D]);
 }
 
+u16 VGA::line_compare() const
+{
+    u16 value = d->crtc.reg[0x18];
+    if (d->crtc.reg[0x07] & 0x10)
+        value |= 0x100;
+    if (d->crtc.reg[0x09] & 0x40)
+        value |= 0x200;
+    return value;
+}
+
+u16 VGA::vertical_display_end() const
+{
+    return d->crtc.vertical_display_end;
+}
+
 u8 VGA::current_video_mode() const
 {
     // FIXME: This is not the correct way to obtain the video mode (BDA.)
@@ -706,6 +1089,36 @@ u8 VGA::read_map_select() const
     return d->graphics_ctrl.reg[4] & 3;
 }
 
+// Repeats a byte once for each plane.
+static inline u32 expand_to_planes(u8 value)
+{
+    return value * 0x01010101u;
+}
+
+// Turns bit N into 0xFF in byte N.
+static inline u32 plane_bits_to_bytes(u8 bits)
+{
+    return ((bits & 1) ? 0x000000ff : 0) | ((bits & 2) ? 0x0000ff00 : 0) | ((bits & 4) ? 0x00ff0000 : 0) | ((bits & 8) ? 0xff000000 : 0);
+}
+
+static inline u8 rotate_right(u8 value, u8 count)
+{
+    return (value >> count) | (value << (8 - count));
+}
+
+void VGA::update_write_pipeline()
+{
+    auto& pipeline = d->write_pipeline;
+    pipeline.write_mode = write_mode();
+    pipeline.rotate_count = rotate_count();
+    // Write mode 1 copies the latches as they are.
+    pipeline.logical_op = pipeline.write_mode == 1 ? 0 : logical_op();
+    pipeline.map_mask = d->sequencer.reg[2] & 0x0f;
+    pipeline.set_reset = plane_bits_to_bytes(d->graphics_ctrl.reg[0]);
+    pipeline.enable_set_reset = plane_bits_to_bytes(d->graphics_ctrl.reg[1]);
+    pipeline.bit_mask = expand_to_planes(bit_mask());
+}
+
 void VGA::write_memory8(u32 address, u8 value)
 {
     u32 offset;
@@ -732,205 +1145,57 @@ void VGA::write_memory8(u32 address, u8 value)
         break;
     }
 
-    machine().notify_screen();
-
     if (in_chain4_mode()) {
-        d->memory[(offset & ~0x03) + (offset % 4) * 65536] = value;
+        u32 memory_offset = (offset & ~0x03) + (offset % 4) * 65536;
+        d->memory[memory_offset] = value;
+        did_write_to_memory(memory_offset);
         return;
     }
 
-    u8 new_val[4];
-
-    if (write_mode() == 2) {
-        new_val[0] = d->latch[0] & ~bit_mask();
-        new_val[1] = d->latch[1] & ~bit_mask();
-        new_val[2] = d->latch[2] & ~bit_mask();
-        new_val[3] = d->latch[3] & ~bit_mask();
-
-        switch (logical_op()) {
-        case 0:
-            new_val[0] |= (value & 1) ? bit_mask() : 0;
-            new_val[1] |= (value & 2) ? bit_mask() : 0;
-            new_val[2] |= (value & 4) ? bit_mask() : 0;
-            new_val[3] |= (value & 8) ? bit_mask() : 0;
-            break;
-        default:
-            vlog(LogVGA, "Gaah, unsupported draw_op %d in mode 2 :(\n", logical_op());
-            hard_exit(1);
-        }
-    } else if (write_mode() == 0) {
-        u8 set_reset = d->graphics_ctrl.reg[0];
-        u8 enable_set_reset = d->graphics_ctrl.reg[1];
-        u8 val = value;
-
-        if (rotate_count()) {
-            vlog(LogVGA, "rotate_count non-zero!");
-            val = (val >> rotate_count()) | (val << (8 - rotate_count()));
-        }
-
-        new_val[0] = d->latch[0] & ~bit_mask();
-        new_val[1] = d->latch[1] & ~bit_mask();
-        new_val[2] = d->latch[2] & ~bit_mask();
-        new_val[3] = d->latch[3] & ~bit_mask();
+    auto& pipeline = d->write_pipeline;
+    u32 latch = d->latch;
+    u32 bit_mask = pipeline.bit_mask;
+    u32 data;
 
-        val &= bit_mask();
-
-        switch (logical_op()) {
-        case 0:
-            new_val[0] |= ((enable_set_reset & 1)
-                    ? ((set_reset & 1) ? bit_mask() : 0)
-                    : (val & bit_mask()));
-            new_val[1] |= ((enable_set_reset & 2)
-                    ? ((set_reset & 2) ? bit_mask() : 0)
-                    : (val & bit_mask()));
-            new_val[2] |= ((enable_set_reset & 4)
-                    ? ((set_reset & 4) ? bit_mask() : 0)
-                    : (val & bit_mask()));
-            new_val[3] |= ((enable_set_reset & 8)
-                    ? ((set_reset & 8) ? bit_mask() : 0)
-                    : (val & bit_mask()));
-            break;
-        case 1:
-            new_val[0] |= ((enable_set_reset & 1)
-                    ? ((set_reset & 1)
-                            ? (~d->latch[0] & bit_mask())
-                            : (d->latch[0] & bit_mask()))
-                    : (val & d->latch[0]) & bit_mask());
-
-            new_val[1] |= ((enable_set_reset & 2)
-                    ? ((set_reset & 2)
-                            ? (~d->latch[1] & bit_mask())
-                            : (d->latch[1] & bit_mask()))
-                    : (val & d->latch[1]) & bit_mask());
-
-            new_val[2] |= ((enable_set_reset & 4)
-                    ? ((set_reset & 4)
-                            ? (~d->latch[2] & bit_mask())
-                            : (d->latch[2] & bit_mask()))
-                    : (val & d->latch[2]) & bit_mask());
-
-            new_val[3] |= ((enable_set_reset & 8)
-                    ? ((set_reset & 8)
-                            ? (~d->latch[3] & bit_mask())
-                            : (d->latch[3] & bit_mask()))
-                    : (val & d->latch[3]) & bit_mask());
-            break;
-        case 2:
-            new_val[0] |= ((enable_set_reset & 1)
-                    ? ((set_reset & 1)
-                            ? (~d->latch[0] & bit_mask())
-                            : (d->latch[0] & bit_mask()))
-                    : (val | d->latch[0]) & bit_mask());
-
-            new_val[1] |= ((enable_set_reset & 2)
-                    ? ((set_reset & 2)
-                            ? (~d->latch[1] & bit_mask())
-                            : (d->latch[1] & bit_mask()))
-                    : (val | d->latch[1]) & bit_mask());
-
-            new_val[2] |= ((enable_set_reset & 4)
-                    ? ((set_reset & 4)
-                            ? (~d->latch[2] & bit_mask())
-                            : (d->latch[2] & bit_mask()))
-                    : (val | d->latch[2]) & bit_mask());
-
-            new_val[3] |= ((enable_set_reset & 8)
-                    ? ((set_reset & 8)
-                            ? (~d->latch[3] & bit_mask())
-                            : (d->latch[3] & bit_mask()))
-                    : (val | d->latch[3]) & bit_mask());
-            break;
-        case 3:
-            new_val[0] |= ((enable_set_reset & 1)
-                    ? ((set_reset & 1)
-                            ? (~d->latch[0] & bit_mask())
-                            : (d->latch[0] & bit_mask()))
-                    : (val ^ d->latch[0]) & bit_mask());
-
-            new_val[1] |= ((enable_set_reset & 2)
-                    ? ((set_reset & 2)
-                            ? (~d->latch[1] & bit_mask())
-                            : (d->latch[1] & bit_mask()))
-                    : (val ^ d->latch[1]) & bit_mask());
-
-            new_val[2] |= ((enable_set_reset & 4)
-                    ? ((set_reset & 4)
-                            ? (~d->latch[2] & bit_mask())
-                            : (d->latch[2] & bit_mask()))
-                    : (val ^ d->latch[2]) & bit_mask());
-
-            new_val[3] |= ((enable_set_reset & 8)
-                    ? ((set_reset & 8)
-                            ? (~d->latch[3] & bit_mask())
-                            : (d->latch[3] & bit_mask()))
-                    : (val ^ d->latch[3]) & bit_mask());
-            break;
-        }
-    } else if (write_mode() == 3) {
-        u8 set_reset = d->graphics_ctrl.reg[0];
-        u8 val = value;
-
-        if (rotate_count()) {
-            vlog(LogVGA, "rotate_count non-zero!");
-            val = (val >> rotate_count()) | (val << (8 - rotate_count()));
-        }
-
-        new_val[0] = d->latch[0] & ~bit_mask();
-        new_val[1] = d->latch[1] & ~bit_mask();
-        new_val[2] = d->latch[2] & ~bit_mask();
-        new_val[3] = d->latch[3] & ~bit_mask();
-
-        val &= bit_mask();
-
-        switch (logical_op()) {
-        case 0:
-            new_val[0] |= (set_reset & 1) ? value : 0;
-            new_val[1] |= (set_reset & 2) ? value : 0;
-            new_val[2] |= (set_reset & 4) ? value : 0;
-            new_val[3] |= (set_reset & 8) ? value : 0;
-            break;
-        case 1:
-            new_val[0] |= ((set_reset & 1) ? value : 0) & d->latch[0];
-            new_val[1] |= ((set_reset & 2) ? value : 0) & d->latch[1];
-            new_val[2] |= ((set_reset & 4) ? value : 0) & d->latch[2];
-            new_val[3] |= ((set_reset & 8) ? value : 0) & d->latch[3];
-            break;
-        case 2:
-            new_val[0] |= ((set_reset & 1) ? value : 0) | d->latch[0];
-            new_val[1] |= ((set_reset & 2) ? value : 0) | d->latch[1];
-            new_val[2] |= ((set_reset & 4) ? value : 0) | d->latch[2];
-            new_val[3] |= ((set_reset & 8) ? value : 0) | d->latch[3];
-            break;
-        case 3:
-            new_val[0] |= ((set_reset & 1) ? value : 0) ^ d->latch[0];
-            new_val[1] |= ((set_reset & 2) ? value : 0) ^ d->latch[1];
-            new_val[2] |= ((set_reset & 4) ? value : 0) ^ d->latch[2];
-            new_val[3] |= ((set_reset & 8) ? value : 0) ^ d->latch[3];
-            break;
-        }
-    } else if (write_mode() == 1) {
-        new_val[0] = d->latch[0];
-        new_val[1] = d->latch[1];
-        new_val[2] = d->latch[2];
-        new_val[3] = d->latch[3];
-    } else {
-        vlog(LogVGA, "Unsupported VGA write mode %d", write_mode());
-        hard_exit(1);
+    switch (pipeline.write_mode) {
+    case 0:
+        data = expand_to_planes(rotate_right(value, pipeline.rotate_count));
+        data = (data & ~pipeline.enable_set_reset) | (pipeline.set_reset & pipeline.enable_set_reset);
+        break;
+    case 1:
+        // The latches go straight back to memory.
+        data = latch;
+        bit_mask = 0xffffffff;
+        break;
+    case 2:
+        data = plane_bits_to_bytes(value);
+        break;
+    default:
+        bit_mask &= expand_to_planes(rotate_right(value, pipeline.rotate_count));
+        data = pipeline.set_reset;
+        break;
+    }
 
-        // This is just here to make GCC stop worrying about accessing new_val[] uninitialized.
-        return;
+    switch (pipeline.logical_op) {
+    case 1:
+        data &= latch;
+        break;
+    case 2:
+        data |= latch;
+        break;
+    case 3:
+        data ^= latch;
+        break;
     }
 
-    u8 map_mask = d->sequencer.reg[2] & 0x0f;
+    data = (data & bit_mask) | (latch & ~bit_mask);
 
-    if (map_mask & 0x01)
-        d->plane[0][offset] = new_val[0];
-    if (map_mask & 0x02)
-        d->plane[1][offset] = new_val[1];
-    if (map_mask & 0x04)
-        d->plane[2][offset] = new_val[2];
-    if (map_mask & 0x08)
-        d->plane[3][offset] = new_val[3];
+    for (int i = 0; i < 4; ++i) {
+        if (!(pipeline.map_mask & (1 << i)))
+            continue;
+        d->plane[i][offset] = data >> (i * 8);
+        did_write_to_memory(i * 0x10000 + offset);
+    }
 }
 
 u8 VGA::read_memory8(u32 address)
@@ -965,12 +1230,8 @@ u8 VGA::read_memory8(u32 address)
         hard_exit(1);
     }
 
-    d->latch[0] = d->plane[0][offset];
-    d->latch[1] = d->plane[1][offset];
-    d->latch[2] = d->plane[2][offset];
-    d->latch[3] = d->plane[3][offset];
-
-    return d->latch[read_map_select()];
+    d->latch = d->plane[0][offset] | (d->plane[1][offset] << 8) | (d->plane[2][offset] << 16) | ((u32)d->plane[3][offset] << 24);
+    return d->latch >> (read_map_select() * 8);
 }
 
 const u8* VGA::plane(int index) const
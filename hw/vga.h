@@ -29,6 +29,7 @@
 #include "iodevice.h"
 #include <QtCore/QObject>
 #include <QtGui/QColor>
+#include <vector>
 
 class VGA final : public QObject
     , public IODevice
@@ -38,6 +39,88 @@ public:
     explicit VGA(Machine&);
     virtual ~VGA();
 
+    // Video memory is tracked for changes in blocks of this many bytes.
+    static constexpr u32 dirty_block_size = 64;
+
+    // A snapshot of which blocks of video memory have changed since the last one was taken.
+    // Offsets are relative to the start of a plane.
+    class DirtyMap {
+    public:
+        static constexpr u32 word_count = 0x40000 / dirty_block_size / 64;
+
+        bool is_dirty(int plane, u32 offset, u32 length) const;
+        bool is_any_plane_dirty(u32 offset, u32 length) const;
+        void set_all();
+        void clear();
+        void merge(const DirtyMap&);
+
+    private:
+        friend class VGA;
+        u64 m_bits[word_count] {};
+    };
+
+    // A consistent copy of video memory and the display state the renderers need, taken by the CPU
+    // at the start of a vertical retrace. The accessors mirror VGA's own.
+    class Snapshot {
+    public:
+        Snapshot();
+
+        const u8* plane(int index) const { return &m_memory[index * 0x10000]; }
+        const u8* text_memory() const { return m_memory.data(); }
+
+        u8 read_register(u8 index) const { return m_crtc[index]; }
+
+        u16 cursor_location() const { return (m_crtc[0x0e] << 8) | m_crtc[0x0f]; }
+        u8 cursor_start_scanline() const { return m_crtc[0x0a] & 0x1f; }
+        u8 cursor_end_scanline() const { return m_crtc[0x0b] & 0x1f; }
+        bool cursor_enabled() const { return (m_crtc[0x0a] & 0x20) == 0; }
+
+        QColor color(int index) const { return QColor(m_color[index]); }
+        QColor palette_color(int paletteIndex) const { return QColor(m_palette_color[paletteIndex]); }
+
+        u8 current_video_mode() const { return m_video_mode; }
+        u8 text_columns() const { return m_text_columns; }
+
+        u16 start_address() const { return (m_crtc[0x0c] << 8) | m_crtc[0x0d]; }
+        u16 line_compare() const { return m_line_compare; }
+        u16 vertical_display_end() const { return m_vertical_display_end; }
+
+        // The 8x16 text mode font (the one INT 43h points to), 16 bytes per character.
+        const u8* font() const { return m_font; }
+
+        // The VBE display mode, and a copy of the visible part of its linear framebuffer
+        // (the rows from its display start onwards, vbe_bytes_per_line() apart.)
+        bool vbe_enabled() const { return m_vbe_enabled; }
+        u16 vbe_width() const { return m_vbe_width; }
+        u16 vbe_height() const { return m_vbe_height; }
+        u8 vbe_bits_per_pixel() const { return m_vbe_bits_per_pixel; }
+        u32 vbe_bytes_per_line() const { return m_vbe_bytes_per_line; }
+        const u8* vbe_display() const { return m_vbe_display.data(); }
+        size_t vbe_display_size() const { return m_vbe_display.size(); }
+
+    private:
+        friend class VGA;
+        std::vector<u8> m_memory;
+        u8 m_crtc[0x19] {};
+        QRgb m_color[256] {};
+        QRgb m_palette_color[16] {};
+        u8 m_video_mode { 0 };
+        u8 m_text_columns { 0 };
+        u16 m_line_compare { 0 };
+        u16 m_vertical_display_end { 0 };
+        u8 m_font[256 * 16] {};
+
+        bool m_vbe_enabled { false };
+        u16 m_vbe_width { 0 };
+        u16 m_vbe_height { 0 };
+        u8 m_vbe_bits_per_pixel { 0 };
+        u32 m_vbe_bytes_per_line { 0 };
+        std::vector<u8> m_vbe_display;
+
+        // Blocks of video memory that changed since this copy was last brought up to date.
+        DirtyMap m_stale;
+    };
+
     // IODevice
     virtual void reset() override;
     virtual u8 in8(u16 port) override;
@@ -53,6 +136,18 @@ public:
     void set_palette_dirty(bool);
     bool is_palette_dirty();
 
+    void invalidate_all();
+
+    // Snapshots are double-buffered: the CPU publishes into one while the renderer reads the other.
+    // Only one thread may read them. acquire_snapshot() moves the reader to the latest published snapshot
+    // (if there's a new one) and adds the blocks that changed since its previous one to `dirty`.
+    // snapshot() is what the reader got from its last acquire_snapshot().
+    const Snapshot& acquire_snapshot(DirtyMap& dirty);
+    const Snapshot& snapshot() const;
+
+    // Publishes a snapshot (and tells the screen) when the next vertical retrace starts.
+    void request_present();
+
     u8 read_register(u8 index) const;
 
     u16 cursor_location() const;
@@ -67,8 +162,12 @@ public:
 
     u16 start_address() const;
 
-    void will_refresh_screen();
-    void did_refresh_screen();
+    // The scanline after which the display wraps around to address 0 (split screen.)
+    u16 line_compare() const;
+    u16 vertical_display_end() const;
+
+    // How long one emulated frame takes at the programmed CRTC timing.
+    u64 frame_duration_ns() const;
 
     bool in_chain4_mode() const;
 
@@ -79,6 +178,16 @@ signals:
 
 private:
     void synchronize_colors();
+    void did_write_to_memory(u32 memory_offset);
+    void retrace_timer_fired();
+    void publish_snapshot();
+    void publish_font(Snapshot&);
+    void publish_vbe(Snapshot&);
+    void take_dirty_map(DirtyMap&);
+    void update_timing();
+    u8 status_at(u64 now_ns, u64& next_change_ns) const;
+    u64 next_retrace_ns(u64 now_ns) const;
+    void update_write_pipeline();
     u8 read_mode() const;
     u8 write_mode() const;
     u8 rotate_count() const;
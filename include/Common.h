@@ -67,8 +67,13 @@ struct RuntimeOptions {
     bool crash_on_general_protection_fault { false };
     bool crash_on_exception { false };
     bool stacklog { false };
+    bool deterministic { false };
     QString autotest_path;
     QString config_path;
+    QString record_path;
+    QString replay_path;
+    QString capture_path;
+    unsigned capture_every_nth_frame { 1 };
 #ifdef DISASSEMBLE_EVERYTHING
     bool disassemble_everything { false };
 #endif
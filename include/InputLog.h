@@ -0,0 +1,132 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include "EventScheduler.h"
+#include "MouseObserver.h"
+#include "OwnPtr.h"
+#include "types.h"
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QMutex>
+#include <QtCore/QPair>
+#include <QtCore/QVector>
+
+class CPU;
+class Machine;
+class PIC;
+
+// InputLog funnels all nondeterministic input (keyboard and mouse) into the machine.
+// Input can arrive from any thread, but it's only delivered to devices on the worker
+// thread, at an instruction boundary, so it shows up at a well-defined cycle.
+//
+// With --record, every delivered input (and every serviced IRQ) is written to a log
+// along with the cycle it happened at. With --replay, live input is ignored and the
+// logged input is delivered at the same cycles instead, while serviced IRQs are
+// compared against the log to detect divergence.
+class InputLog final : public MouseObserver {
+public:
+    enum class Mode {
+        Live,
+        Record,
+        Replay,
+    };
+
+    struct Event {
+        enum Type : u8 {
+            KeyPress,
+            KeyRelease,
+            MouseMove,
+            MouseButtonPress,
+            MouseButtonRelease,
+            IRQ,
+        };
+
+        Type type { KeyPress };
+        u64 cycle { 0 };
+
+        // Key events
+        u16 scan_code { 0 };
+        u8 code { 0 };
+        bool extended { false };
+
+        // Mouse events
+        u16 x { 0 };
+        u16 y { 0 };
+        MouseButton button { MouseButton::Left };
+
+        // IRQ events
+        u8 irq { 0 };
+    };
+
+    explicit InputLog(Machine&);
+    virtual ~InputLog() override;
+
+    Mode mode() const { return m_mode; }
+
+    // These can be called from any thread.
+    void post_key_press(u16 scan_code, bool extended, u8 make_code);
+    void post_key_release(bool extended, u8 break_code);
+    virtual void move_event(u16 x, u16 y) override;
+    virtual void button_press_event(u16 x, u16 y, MouseButton) override;
+    virtual void button_release_event(u16 x, u16 y, MouseButton) override;
+
+    // These are called on the worker thread.
+    void deliver_pending_input(Badge<CPU>);
+    void did_service_irq(Badge<PIC>, u8 irq);
+
+    // Gets whatever recorded events are still buffered onto disk, for exit paths that skip the destructors.
+    static void flush_all_logs();
+
+private:
+    void post(Event&&);
+    void deliver(const Event&);
+    void record(const Event&);
+    void flush_recording();
+    void schedule_next_replay_event();
+
+    bool open_for_recording(const QString& path);
+    bool open_for_replay(const QString& path);
+    QVector<QPair<QString, QByteArray>> disk_image_hashes() const;
+
+    Machine& m_machine;
+    Mode m_mode { Mode::Live };
+
+    QMutex m_pending_lock;
+    QVector<Event> m_pending;
+
+    // Recorded events are buffered, and written out every so often (see record().)
+    QMutex m_file_lock;
+    QFile m_file;
+    QElapsedTimer m_since_flush;
+    u64 m_last_recorded_cycle { 0 };
+
+    QVector<Event> m_replay_inputs;
+    QVector<Event> m_replay_irqs;
+    int m_next_replay_input { 0 };
+    int m_next_replay_irq { 0 };
+    bool m_diverged { false };
+    OwnPtr<EventScheduler::Timer> m_replay_timer;
+};
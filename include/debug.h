@@ -70,6 +70,8 @@ enum VLogChannel {
     LogScreen,
     LogTimer,
     LogDMA,
+    LogReplay,
+    LogVBE,
 #ifdef DEBUG_SERENITY
     LogSerenity,
 #endif
@@ -60,6 +60,7 @@ private:
     void handle_dump_flat_memory(const QStringList&);
     void handle_tracing(const QStringList&);
     void handle_irq(const QStringList&);
+    void handle_disk_statistics();
     void handle_dump_unassembled(const QStringList&);
     void handle_selector(const QStringList&);
     void handle_stack(const QStringList&);
@@ -31,7 +31,9 @@
 #include <QHash>
 #include <QMutex>
 #include <QObject>
+#include <QPair>
 #include <QSet>
+#include <QVector>
 #include <QWaitCondition>
 #include <functional>
 
@@ -40,14 +42,18 @@ class BusMouse;
 class CMOS;
 class DMA;
 class DiskDrive;
+class EventScheduler;
 class FDC;
 class IDE;
+class InputLog;
 class Keyboard;
+class PCI;
 class PIC;
 class PIT;
 class PS2;
 class Settings;
 class CPU;
+class VBE;
 class VGA;
 class VomCtl;
 class Worker;
@@ -63,14 +69,19 @@ public:
     virtual ~Machine();
 
     CPU& cpu() { return *m_cpu; }
+    EventScheduler& scheduler() { return *m_scheduler; }
     VGA& vga() { return *m_vga; }
+    VBE& vbe() { return *m_vbe; }
     PIT& pit() { return *m_pit; }
     BusMouse& busmouse() { return *m_busmouse; }
     Keyboard& keyboard() { return *m_keyboard; }
     VomCtl& vomctl() { return *m_vomctl; }
     PIC& master_pic() { return *m_master_pic; }
     PIC& slave_pic() { return *m_slave_pic; }
+    DMA& dma() { return *m_dma; }
+    PCI& pci() { return *m_pci; }
     CMOS& cmos() { return *m_cmos; }
+    InputLog& input_log() { return *m_input_log; }
     Settings& settings() { return *m_settings; }
 
     DiskDrive& floppy0();
@@ -78,6 +89,11 @@ public:
     DiskDrive& fixed0();
     DiskDrive& fixed1();
 
+    // Puts a new image in a floppy drive. Can be called from any thread, but drives
+    // belong to the CPU thread, so the swap itself happens there.
+    void change_floppy_image(DiskDrive&, const QString& path);
+    void apply_pending_media_changes(Badge<CPU>);
+
     bool is_for_autotest() PURE;
 
     MachineWidget* widget() { return m_widget; }
@@ -86,6 +102,9 @@ public:
     void reset_all_io_devices();
     void notify_screen();
 
+    // Called on the CPU thread for every snapshot the VGA publishes, i.e. in virtual time.
+    void set_frame_observer(std::function<void()>);
+
     void for_each_io_device(std::function<void(IODevice&)>);
 
     IODevice* input_device_for_port(u16 port);
@@ -122,6 +141,7 @@ private:
 
     OwnPtr<Settings> m_settings;
     OwnPtr<CPU> m_cpu;
+    OwnPtr<EventScheduler> m_scheduler;
 
     OwnPtr<Worker> m_worker;
     QMutex m_worker_mutex;
@@ -129,10 +149,12 @@ private:
 
     // IODevices
     OwnPtr<VGA> m_vga;
+    OwnPtr<VBE> m_vbe;
     OwnPtr<PIT> m_pit;
     OwnPtr<BusMouse> m_busmouse;
     OwnPtr<CMOS> m_cmos;
     OwnPtr<FDC> m_fdc;
+    OwnPtr<PCI> m_pci;
     OwnPtr<IDE> m_ide;
     OwnPtr<Keyboard> m_keyboard;
     OwnPtr<PIC> m_master_pic;
@@ -141,6 +163,8 @@ private:
     OwnPtr<DMA> m_dma;
     OwnPtr<VomCtl> m_vomctl;
 
+    OwnPtr<InputLog> m_input_log;
+
     OwnPtr<DiskDrive> m_floppy0;
     OwnPtr<DiskDrive> m_floppy1;
     OwnPtr<DiskDrive> m_fixed0;
@@ -148,6 +172,9 @@ private:
 
     MachineWidget* m_widget { nullptr };
 
+    QMutex m_frame_observer_lock;
+    std::function<void()> m_frame_observer;
+
     QSet<IODevice*> m_allDevices;
 
     IODevice* m_fast_input_devices[1024];
@@ -157,6 +184,9 @@ private:
     QHash<u16, IODevice*> m_all_output_devices;
 
     QVector<ROM*> m_roms;
+
+    QMutex m_pending_media_lock;
+    QVector<QPair<DiskDrive*, QString>> m_pending_media_changes;
 };
 
 inline IODevice* Machine::input_device_for_port(u16 port)
@@ -26,7 +26,11 @@
 #include "CPU.h"
 #include "DMA.h"
 #include "DiskDrive.h"
+#include "EventScheduler.h"
+#include "InputLog.h"
+#include "PCI.h"
 #include "PS2.h"
+#include "VBE.h"
 #include "busmouse.h"
 #include "cmos.h"
 #include "fdc.h"
@@ -105,13 +109,12 @@ Machine::Machine(OwnPtr<Settings>&& settings, QObject* parent)
         IODevice::ignore_port(0xDC8F);
         IODevice::ignore_port(0xEC8F);
         IODevice::ignore_port(0xFC8F);
-
-        IODevice::ignore_port(0x3f6);
     }
 }
 
 Machine::~Machine()
 {
+    stop();
     qDeleteAll(m_roms);
 }
 
@@ -124,15 +127,16 @@ void Machine::make_cpu(Badge<Worker>)
 {
     RELEASE_ASSERT(QThread::currentThread() == m_worker.ptr());
     m_cpu = make<CPU>(*this);
+    m_scheduler = make<EventScheduler>(*this);
 }
 
 void Machine::make_devices(Badge<Worker>)
 {
     RELEASE_ASSERT(QThread::currentThread() == m_worker.ptr());
-    m_floppy0 = make<DiskDrive>("floppy0");
-    m_floppy1 = make<DiskDrive>("floppy1");
-    m_fixed0 = make<DiskDrive>("fixed0");
-    m_fixed1 = make<DiskDrive>("fixed1");
+    m_floppy0 = make<DiskDrive>("floppy0", *m_scheduler);
+    m_floppy1 = make<DiskDrive>("floppy1", *m_scheduler);
+    m_fixed0 = make<DiskDrive>("fixed0", *m_scheduler);
+    m_fixed1 = make<DiskDrive>("fixed1", *m_scheduler);
 
     apply_settings();
 
@@ -147,14 +151,17 @@ void Machine::make_devices(Badge<Worker>)
     m_busmouse = make<BusMouse>(*this);
     m_cmos = make<CMOS>(*this);
     m_fdc = make<FDC>(*this);
+    m_pci = make<PCI>(*this);
     m_ide = make<IDE>(*this);
     m_keyboard = make<Keyboard>(*this);
     m_ps2 = make<PS2>(*this);
     m_vomctl = make<VomCtl>(*this);
     m_pit = make<PIT>(*this);
+    // VGA snapshots include the VBE display, so it has to exist first.
+    m_vbe = make<VBE>(*this);
     m_vga = make<VGA>(*this);
 
-    pit().boot();
+    m_input_log = make<InputLog>(*this);
 }
 
 void Machine::apply_settings()
@@ -222,17 +229,17 @@ bool Machine::load_rom_image(u32 address, const QString& fileName)
 
 void Machine::start()
 {
-    worker().exit_debugger();
+    worker().resume();
 }
 
 void Machine::pause()
 {
-    worker().enter_debugger();
+    worker().pause();
 }
 
 void Machine::stop()
 {
-    worker().shutdown();
+    worker().stop();
 }
 
 void Machine::reboot()
@@ -254,6 +261,16 @@ void Machine::notify_screen()
 {
     if (widget())
         widget()->screen().notify();
+
+    QMutexLocker locker(&m_frame_observer_lock);
+    if (m_frame_observer)
+        m_frame_observer();
+}
+
+void Machine::set_frame_observer(std::function<void()> observer)
+{
+    QMutexLocker locker(&m_frame_observer_lock);
+    m_frame_observer = std::move(observer);
 }
 
 void Machine::for_each_io_device(std::function<void(IODevice&)> function)
@@ -304,6 +321,30 @@ void Machine::unregister_device(Badge<IODevice>, IODevice& device)
     m_allDevices.remove(&device);
 }
 
+void Machine::change_floppy_image(DiskDrive& drive, const QString& path)
+{
+    {
+        QMutexLocker locker(&m_pending_media_lock);
+        m_pending_media_changes.append({ &drive, path });
+    }
+    cpu().queue_command(CPU::ChangeMedia);
+}
+
+void Machine::apply_pending_media_changes(Badge<CPU>)
+{
+    QVector<QPair<DiskDrive*, QString>> changes;
+    {
+        QMutexLocker locker(&m_pending_media_lock);
+        changes = std::move(m_pending_media_changes);
+        m_pending_media_changes.clear();
+    }
+
+    for (auto& change : changes) {
+        change.first->set_image_path(change.second);
+        vlog(LogDisk, "%s image changed to %s", qPrintable(change.first->name()), qPrintable(change.second));
+    }
+}
+
 DiskDrive& Machine::floppy0()
 {
     return *m_floppy0;
@@ -71,6 +71,67 @@ static bool parseAddress(const QString& string, u32* address)
     return true;
 }
 
+static bool parse_disk_options(const QStringList& options, DiskDrive::Configuration& config)
+{
+    // Trailing <key>=<value> options on a disk line, e.g. "io=mmap readahead=128".
+
+    bool has_io_option = false;
+    bool has_cache_option = false;
+    for (auto& option : options) {
+        QStringList parts = option.split(QLatin1Char('='));
+        if (parts.count() != 2)
+            return false;
+        const QString& key = parts.at(0);
+        const QString& value = parts.at(1);
+        if (key == QLatin1String("io")) {
+            has_io_option = true;
+            if (value == QLatin1String("file"))
+                config.backend_type = DiskBackend::Type::File;
+            else if (value == QLatin1String("mmap"))
+                config.backend_type = DiskBackend::Type::Mapped;
+            else
+                return false;
+        } else if (key == QLatin1String("readahead")) {
+            // Read-ahead for sequential access, in KiB. 0 disables it.
+            bool ok;
+            config.read_ahead_kib = value.toUInt(&ok);
+            if (!ok)
+                return false;
+        } else if (key == QLatin1String("cache")) {
+            has_cache_option = true;
+            if (value == QLatin1String("writethrough"))
+                config.cache_mode = DiskCache::WriteMode::WriteThrough;
+            else if (value == QLatin1String("writeback"))
+                config.cache_mode = DiskCache::WriteMode::WriteBack;
+            else if (value == QLatin1String("unsafe"))
+                config.cache_mode = DiskCache::WriteMode::Unsafe;
+            else
+                return false;
+        } else if (key == QLatin1String("flushdelay")) {
+            // How long a write-back cache may hold written data, in milliseconds.
+            has_cache_option = true;
+            bool ok;
+            config.write_back_delay_ms = value.toUInt(&ok);
+            if (!ok)
+                return false;
+        } else {
+            vlog(LogConfig, "Unknown disk option: \"%s\"", qPrintable(option));
+            return false;
+        }
+    }
+
+    // Mapped images don't go through the block cache, so asking for a cache mode means file I/O,
+    // unless the line explicitly asked for a mapping too.
+    if (has_cache_option && config.backend_type == DiskBackend::Type::Mapped) {
+        if (has_io_option) {
+            vlog(LogConfig, "The cache= and flushdelay= disk options need io=file");
+            return false;
+        }
+        config.backend_type = DiskBackend::Type::File;
+    }
+    return true;
+}
+
 bool Settings::handle_load_file(const QStringList& arguments)
 {
     // load-file <segment:offset> <path/to/file>
@@ -136,9 +197,10 @@ bool Settings::handle_keymap(const QStringList& arguments)
 
 bool Settings::handle_fixed_disk(const QStringList& arguments)
 {
-    // fixed-disk <index> <path/to/file> <size>
+    // fixed-disk <index> <path/to/file> <size> [io=file|mmap] [readahead=<KiB>]
+    //            [cache=writethrough|writeback|unsafe] [flushdelay=<ms>]
 
-    if (arguments.count() != 3)
+    if (arguments.count() < 3)
         return false;
 
     bool ok;
@@ -154,23 +216,26 @@ bool Settings::handle_fixed_disk(const QStringList& arguments)
     if (!ok)
         return false;
 
-    vlog(LogConfig, "Fixed disk %u: %s (%ld KiB)", index, qPrintable(fileName), size);
+    vlog(LogConfig, "Fixed disk %u: %s (%u KiB)", index, qPrintable(fileName), size);
 
     DiskDrive::Configuration& config = index == 0 ? m_fixed0 : m_fixed1;
     config.image_path = fileName;
     config.sectors_per_track = 63;
     config.heads = 16;
     config.bytes_per_sector = 512;
-    config.sectors = (size * 1024) / config.bytes_per_sector;
+    config.sectors = ((u64)size * 1024) / config.bytes_per_sector;
+    config.backend_type = DiskBackend::Type::File;
 
-    return true;
+    return parse_disk_options(arguments.mid(3), config);
 }
 
 bool Settings::handle_floppy_disk(const QStringList& arguments)
 {
-    // floppy-disk <index> <type> <path/to/file>
+    // floppy-disk <index> <type> <path/to/file> [io=file|mmap] [readahead=<KiB>]
+    //             [cache=writethrough|writeback|unsafe] [flushdelay=<ms>]
+    // cache= and flushdelay= imply io=file, since mapped images aren't cached.
 
-    if (arguments.count() != 3)
+    if (arguments.count() < 3)
         return false;
 
     bool ok;
@@ -201,6 +266,11 @@ bool Settings::handle_floppy_disk(const QStringList& arguments)
     config.sectors = ft->sectors;
     config.floppy_type_for_cmos = ft->mediaType;
     config.bytes_per_sector = ft->bytesPerSector;
+    // Floppy images are small and read-mostly, so map them by default (unless a cache mode is given.)
+    config.backend_type = DiskBackend::Type::Mapped;
+
+    if (!parse_disk_options(arguments.mid(3), config))
+        return false;
 
     vlog(LogConfig, "Floppy %u: %s (%uspt, %uh, %us (%ub))", index, qPrintable(fileName), config.sectors_per_track, config.heads, config.sectors, config.bytes_per_sector);
     return true;
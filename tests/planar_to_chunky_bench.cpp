@@ -0,0 +1,108 @@
+// Computron x86 PC Emulator
+// Copyright (C) 2003-2018 Andreas Kling <awesomekling@gmail.com>
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY ANDREAS KLING ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL ANDREAS KLING OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Checks every planar-to-chunky and unchain-to-chunky kernel against the simplest one, then measures how many pixels per second each converts.
+// Build and run with "make bench".
+
+#include "PlanarToChunky.h"
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+
+static const size_t bytes_per_plane = 640 * 480 / 8;
+static const int frames = 2000;
+
+int main()
+{
+    static u8 planes[4][bytes_per_plane];
+    static u8 expected[bytes_per_plane * 8];
+    static u8 pixels[bytes_per_plane * 8];
+
+    std::mt19937 random(0xc0ffee);
+    for (auto& plane : planes) {
+        for (auto& byte : plane)
+            byte = random();
+    }
+
+    auto kernels = supported_planar_to_chunky_kernels();
+    kernels.front().function(planes[0], planes[1], planes[2], planes[3], expected, bytes_per_plane);
+
+    int failures = 0;
+    for (auto& kernel : kernels) {
+        // Odd sizes and offsets exercise the scalar tails of the vector kernels.
+        for (size_t count : { bytes_per_plane, bytes_per_plane - 1, (size_t)17, (size_t)1 }) {
+            memset(pixels, 0xff, sizeof(pixels));
+            kernel.function(planes[0] + (bytes_per_plane - count), planes[1] + (bytes_per_plane - count), planes[2] + (bytes_per_plane - count), planes[3] + (bytes_per_plane - count), pixels, count);
+            if (memcmp(pixels, expected + (bytes_per_plane - count) * 8, count * 8)) {
+                printf("FAIL: %s kernel disagrees with bitwise for %zu bytes\n", kernel.name, count);
+                ++failures;
+            }
+        }
+    }
+
+    // Chained/unchained 256-color scanlines: check each layout against the scalar kernel the same way.
+    auto unchain_kernels = supported_unchain_to_chunky_kernels();
+    for (unsigned shift = 0; shift <= 2; ++shift) {
+        size_t max_count = bytes_per_plane >> shift;
+        unchain_kernels.front().function(planes[0], planes[1], planes[2], planes[3], expected, max_count, shift);
+        for (auto& kernel : unchain_kernels) {
+            for (size_t count : { max_count, max_count - 1, (size_t)80, (size_t)17, (size_t)1 }) {
+                size_t skip = max_count - count;
+                size_t offset = skip << shift;
+                memset(pixels, 0xff, sizeof(pixels));
+                kernel.function(planes[0] + offset, planes[1] + offset, planes[2] + offset, planes[3] + offset, pixels, count, shift);
+                if (memcmp(pixels, expected + skip * 4, count * 4)) {
+                    printf("FAIL: %s unchain kernel disagrees with scalar for %zu bytes (shift %u)\n", kernel.name, count, shift);
+                    ++failures;
+                }
+            }
+        }
+    }
+
+    if (failures)
+        return 1;
+
+    for (auto& kernel : kernels) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < frames; ++i)
+            kernel.function(planes[0], planes[1], planes[2], planes[3], pixels, bytes_per_plane);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double pixels_per_second = (double)frames * bytes_per_plane * 8 / elapsed.count();
+        printf("%-8s %8.1f Mpixels/s  (%6.0f 640x480 frames/s)\n", kernel.name, pixels_per_second / 1e6, frames / elapsed.count());
+    }
+
+    for (unsigned shift = 0; shift <= 2; ++shift) {
+        for (auto& kernel : unchain_kernels) {
+            size_t count = bytes_per_plane >> shift;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < frames; ++i)
+                kernel.function(planes[0], planes[1], planes[2], planes[3], pixels, count, shift);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            double pixels_per_second = (double)frames * count * 4 / elapsed.count();
+            printf("unchain/%u %-8s %8.1f Mpixels/s  (%6.0f 320x200 frames/s)\n", shift, kernel.name, pixels_per_second / 1e6, pixels_per_second / (320 * 200));
+        }
+    }
+    return 0;
+}
@@ -25,11 +25,11 @@
 #include "CPU.h"
 #include "Common.h"
 #include "DiskDrive.h"
+#include "EventScheduler.h"
 #include "debug.h"
+#include "keyboard.h"
 #include "machine.h"
 #include <stdio.h>
-#include <sys/time.h>
-#include <time.h>
 
 #define FD_NO_ERROR 0x00
 #define FD_BAD_COMMAND 0x01
@@ -38,6 +38,7 @@
 #define FD_SECTOR_NOT_FOUND 0x04
 #define FD_FIXED_RESET_FAIL 0x05
 #define FD_CHANGED_OR_REMOVED 0x06
+#define FD_DMA_BOUNDARY_ERROR 0x09
 #define FD_SEEK_FAIL 0x40
 #define FD_TIMEOUT 0x80
 #define FD_FIXED_NOT_READY 0xAA
@@ -102,19 +103,13 @@ static DiskDrive* disk_drive_for_bios_index(Machine& machine, u8 index)
 
 void vm_handle_e6(CPU& cpu)
 {
-    extern u16 kbd_hit();
-    extern u16 kbd_getc();
-
-    struct tm* t;
-    time_t curtime;
-    struct timeval timv;
     u32 tick_count;
     DiskDrive* drive;
 
     switch (cpu.get_ax()) {
     case 0x1601:
-        if (kbd_hit()) {
-            cpu.set_ax(kbd_hit());
+        if (u16 key = cpu.machine().keyboard().peek_key()) {
+            cpu.set_ax(key);
             cpu.set_zf(0);
         } else {
             cpu.set_ax(0);
@@ -124,14 +119,8 @@ void vm_handle_e6(CPU& cpu)
     case 0x1A00:
         // Interrupt 1A, 00: Get RTC tick count
         cpu.set_al(0); // Midnight flag.
-        curtime = time(nullptr);
-        t = localtime(&curtime);
-        tick_count = ((t->tm_hour * 3600) + (t->tm_min * 60) + (t->tm_sec)) * 18.206; // yuck..
-        gettimeofday(&timv, NULL);
-        tick_count += timv.tv_usec / 54926.9471602768;
-#ifdef CT_DETERMINISTIC
-        tick_count = 0x12345678;
-#endif
+        // The BIOS tick is 65536 PIT clocks (1193182 Hz), roughly 18.2 Hz.
+        tick_count = (u64)cpu.machine().scheduler().current_datetime().time().msecsSinceStartOfDay() * 1193182 / 65536000;
         cpu.set_cx(most_significant<u16>(tick_count));
         cpu.set_dx(least_significant<u16>(tick_count));
         cpu.write_physical_memory<u32>(PhysicalAddress(0x046c), tick_count);
@@ -217,7 +206,7 @@ void vm_handle_e6(CPU& cpu)
         break;
 
     case 0x1600:
-        cpu.set_ax(kbd_getc());
+        cpu.set_ax(cpu.machine().keyboard().next_key());
         break;
 
     case 0x1700:
@@ -268,46 +257,88 @@ void vm_handle_e6(CPU& cpu)
     }
 }
 
-static void bios_disk_read(CPU& cpu, FILE* fp, DiskDrive& drive, u16 cylinder, u16 head, u16 sector, u16 count, u16 segment, u16 offset)
+// BIOS transfers use the buffer at ES:BX, with the offset wrapping around within the segment.
+// Usually that's one run of plain RAM, and the drive can transfer to or from it directly.
+static u8* bios_buffer_pointer(CPU& cpu, u16 segment, u16 offset, u32 size)
+{
+    if (offset + size > 0x10000)
+        return nullptr;
+    return cpu.ram_pointer(LinearAddress((segment << 4) + offset), size);
+}
+
+static void copy_to_bios_buffer(CPU& cpu, u16 segment, u16 offset, const u8* data, u32 size)
+{
+    while (size) {
+        u32 run = std::min<u32>(size, 0x10000 - offset);
+        cpu.write_linear_memory_block(LinearAddress((segment << 4) + offset), data, run);
+        data += run;
+        size -= run;
+        offset += run;
+    }
+}
+
+static void copy_from_bios_buffer(CPU& cpu, u16 segment, u16 offset, u8* data, u32 size)
+{
+    while (size) {
+        u32 run = std::min<u32>(size, 0x10000 - offset);
+        cpu.read_linear_memory_block(LinearAddress((segment << 4) + offset), data, run);
+        data += run;
+        size -= run;
+        offset += run;
+    }
+}
+
+static bool bios_disk_read(CPU& cpu, DiskDrive& drive, u16 cylinder, u16 head, u16 sector, u16 count, u16 segment, u16 offset)
 {
     auto lba = drive.to_lba(cylinder, head, sector);
 
     if (options.disklog)
         vlog(LogDisk, "%s reading %u sectors at %u/%u/%u (LBA %u) to %04x:%04x", qPrintable(drive.name()), count, cylinder, head, sector, lba, segment, offset);
 
-    QByteArray data(drive.bytes_per_sector() * count, Qt::Uninitialized);
-    fread(data.data(), drive.bytes_per_sector(), count, fp);
-    LinearAddress dest((segment << 4) + offset);
-    for (int i = 0; i < data.size(); ++i)
-        cpu.write_memory<u8>(dest.offset(i), data[i]);
+    u32 size = drive.bytes_per_sector() * count;
+    if (u8* destination = bios_buffer_pointer(cpu, segment, offset, size))
+        return drive.read_sectors(lba, count, destination);
+
+    QByteArray data(size, Qt::Uninitialized);
+    if (!drive.read_sectors(lba, count, reinterpret_cast<u8*>(data.data())))
+        return false;
+    copy_to_bios_buffer(cpu, segment, offset, reinterpret_cast<const u8*>(data.constData()), size);
+    return true;
 }
 
-static void bios_disk_write(CPU& cpu, FILE* fp, DiskDrive& drive, u16 cylinder, u16 head, u16 sector, u16 count, u16 segment, u16 offset)
+static bool bios_disk_write(CPU& cpu, DiskDrive& drive, u16 cylinder, u16 head, u16 sector, u16 count, u16 segment, u16 offset)
 {
     auto lba = drive.to_lba(cylinder, head, sector);
 
     if (options.disklog)
         vlog(LogDisk, "%s writing %u sectors at %u/%u/%u (LBA %u) from %04x:%04x", qPrintable(drive.name()), count, cylinder, head, sector, lba, segment, offset);
 
-    const void* source = cpu.memory_pointer(LogicalAddress(segment, offset));
-    fwrite(source, drive.bytes_per_sector(), count, fp);
+    u32 size = drive.bytes_per_sector() * count;
+    if (const u8* source = bios_buffer_pointer(cpu, segment, offset, size))
+        return drive.write_sectors(lba, count, source);
+
+    QByteArray data(size, Qt::Uninitialized);
+    copy_from_bios_buffer(cpu, segment, offset, reinterpret_cast<u8*>(data.data()), size);
+    return drive.write_sectors(lba, count, reinterpret_cast<const u8*>(data.constData()));
 }
 
-static void bios_disk_verify(CPU&, FILE* fp, DiskDrive& drive, u16 cylinder, u16 head, u16 sector, u16 count, u16 segment, u16 offset)
+static bool bios_disk_verify(CPU&, DiskDrive& drive, u16 cylinder, u16 head, u16 sector, u16 count, u16 segment, u16 offset)
 {
     auto lba = drive.to_lba(cylinder, head, sector);
 
     if (options.disklog)
         vlog(LogDisk, "%s verifying %u sectors at %u/%u/%u (LBA %u)", qPrintable(drive.name()), count, cylinder, head, sector, lba);
 
-    u8 dummy[count * drive.bytes_per_sector()];
-    u16 veri = fread(dummy, drive.bytes_per_sector(), count, fp);
-    if (veri != count)
-        vlog(LogAlert, "veri != count, something went wrong");
+    QByteArray dummy(drive.bytes_per_sector() * count, Qt::Uninitialized);
+    if (!drive.read_sectors(lba, count, reinterpret_cast<u8*>(dummy.data()))) {
+        vlog(LogAlert, "Verify of %u sectors at LBA %u failed", count, lba);
+        return false;
+    }
 
     // FIXME: Actually compare something..
     Q_UNUSED(segment);
     Q_UNUSED(offset);
+    return true;
 }
 
 void bios_disk_call(CPU& cpu, DiskCallFunction function)
@@ -320,7 +351,6 @@ void bios_disk_call(CPU& cpu, DiskCallFunction function)
     u8 driveIndex = cpu.get_dl();
     u8 head = cpu.get_dh();
     u16 sector_count = cpu.get_al();
-    FILE* fp;
     u32 lba;
 
     auto* drive = disk_drive_for_bios_index(cpu.machine(), driveIndex);
@@ -351,29 +381,33 @@ void bios_disk_call(CPU& cpu, DiskCallFunction function)
         goto epilogue;
     }
 
-    fp = fopen(qPrintable(drive->image_path()), function == WriteSectors ? "rb+" : "rb");
-    if (!fp) {
-        vlog(LogDisk, "PANIC: Could not access drive %d image (%s)!", driveIndex, qPrintable(drive->image_path()));
-        hard_exit(1);
+    if (!(driveIndex & 0x80) && function != VerifySectors) {
+        // Floppy transfers go through ISA DMA, which can't cross a 64 KiB physical boundary.
+        u32 start = (cpu.get_es() << 4) + cpu.get_bx();
+        u32 end = start + drive->bytes_per_sector() * sector_count - 1;
+        if (sector_count && (start >> 16) != (end >> 16)) {
+            if (options.disklog)
+                vlog(LogDisk, "%s transfer to %04x:%04x crosses a DMA boundary", qPrintable(drive->name()), cpu.get_es(), cpu.get_bx());
+            error = FD_DMA_BOUNDARY_ERROR;
+            goto epilogue;
+        }
     }
 
-    fseek(fp, lba * drive->bytes_per_sector(), SEEK_SET);
-
     switch (function) {
     case ReadSectors:
-        bios_disk_read(cpu, fp, *drive, cylinder, head, sector, sector_count, cpu.get_es(), cpu.get_bx());
+        if (!bios_disk_read(cpu, *drive, cylinder, head, sector, sector_count, cpu.get_es(), cpu.get_bx()))
+            error = FD_SECTOR_NOT_FOUND;
         break;
     case WriteSectors:
-        bios_disk_write(cpu, fp, *drive, cylinder, head, sector, sector_count, cpu.get_es(), cpu.get_bx());
+        if (!bios_disk_write(cpu, *drive, cylinder, head, sector, sector_count, cpu.get_es(), cpu.get_bx()))
+            error = FD_WRITE_PROTECT_ERROR;
         break;
     case VerifySectors:
-        bios_disk_verify(cpu, fp, *drive, cylinder, head, sector, sector_count, cpu.get_es(), cpu.get_bx());
+        if (!bios_disk_verify(cpu, *drive, cylinder, head, sector, sector_count, cpu.get_es(), cpu.get_bx()))
+            error = FD_SECTOR_NOT_FOUND;
         break;
     }
 
-    error = FD_NO_ERROR;
-    fclose(fp);
-
 epilogue:
     if (error == FD_NO_ERROR) {
         cpu.set_cf(0);
@@ -24,14 +24,15 @@
 
 #include "CPU.h"
 #include "Common.h"
+#include "EventScheduler.h"
+#include "InputLog.h"
 #include "Tasking.h"
 #include "debug.h"
 #include "debugger.h"
 #include "machine.h"
 #include "pic.h"
-#include "pit.h"
 #include "settings.h"
-#include <unistd.h>
+#include <QtCore/QDeadlineTimer>
 
 //#define DEBUG_PAGING
 #define CRASH_ON_OPCODE_00_00
@@ -52,9 +53,6 @@
 static bool should_log_all_memory_accesses(PhysicalAddress address)
 {
     UNUSED_PARAM(address);
-#    ifdef CT_DETERMINISTIC
-    return true;
-#    endif
     return false;
 }
 
@@ -356,7 +354,7 @@ void CPU::reset()
     m_last_result = 0;
     m_last_op_size = ByteSize;
 
-    m_cycle = 0;
+    // NOTE: m_cycle keeps counting across resets, since it drives the machine's virtual clock (see EventScheduler.)
 
     init_watches();
 
@@ -396,29 +394,90 @@ FLATTEN void CPU::execute_one_instruction()
     } catch (Exception e) {
         if (options.log_exceptions)
             dump_disassembled(cached_descriptor(SegmentRegisterIndex::CS), m_base_eip, 3);
+        // Count faulting instructions too, so that every pass through the main loop has a unique cycle (see InputLog.)
+        ++m_cycle;
         raise_exception(e);
     } catch (HardwareInterruptDuringREP) {
         set_eip(current_base_instruction_pointer());
+        ++m_cycle;
     }
 }
 
 void CPU::halted_loop()
 {
+    auto& scheduler = machine().scheduler();
     while (state() == CPU::Halted) {
-#ifdef HAVE_USLEEP
-        usleep(100);
-#endif
+        // No instructions are retiring, so let virtual time catch up with the host (but not past the next event.)
+        m_cycle = scheduler.idle_target_cycle();
+        if (m_cycle >= scheduler.next_event_cycle())
+            scheduler.run_due_events();
+        if (m_should_pause)
+            wait_while_paused();
+        // Leave the main loop to pick up the stop request.
+        if (m_should_stop)
+            return;
         if (m_should_hard_reboot) {
             hard_reboot();
             return;
         }
+        if (m_should_deliver_input)
+            deliver_input();
+        if (m_should_change_media)
+            change_media();
+        if (m_debugger_request != NoDebuggerRequest)
+            handle_debugger_request();
         if (debugger().is_active()) {
             save_base_address();
             debugger().do_console();
         }
-        if (PIC::has_pending_irq() && get_if())
+        if (PIC::has_pending_irq() && get_if()) {
             PIC::service_irq(*this);
+            continue;
+        }
+
+        // Sleep until the next scheduled event is due, or until someone calls wake_up().
+        u64 timeout_ns = scheduler.idle_timeout_ns();
+        if (timeout_ns)
+            wait_for_wake_up(timeout_ns);
+    }
+}
+
+void CPU::idle_until(u64 deadline_ns)
+{
+    auto& scheduler = machine().scheduler();
+    // Like halted_loop(), don't let virtual time run ahead of the host.
+    u64 timeout_ns = scheduler.idle_timeout_ns(deadline_ns);
+    if (timeout_ns)
+        wait_for_wake_up(timeout_ns);
+    m_cycle = scheduler.idle_target_cycle(deadline_ns);
+}
+
+void CPU::wait_for_wake_up(u64 timeout_ns)
+{
+    QMutexLocker locker(&m_wake_up_lock);
+    m_waiting_for_wake_up = true;
+    if (!m_wake_up_pending.exchange(false)) {
+        if (timeout_ns == ~0ull) {
+            m_wake_up_condition.wait(&m_wake_up_lock);
+        } else {
+            QDeadlineTimer deadline(Qt::PreciseTimer);
+            deadline.setPreciseRemainingTime(timeout_ns / 1000000000, timeout_ns % 1000000000, Qt::PreciseTimer);
+            m_wake_up_condition.wait(&m_wake_up_lock, deadline);
+        }
     }
+    m_waiting_for_wake_up = false;
+    m_wake_up_pending = false;
+}
+
+void CPU::wake_up()
+{
+    // NOTE: This pairs with wait_for_wake_up(): either the waiter sees the pending flag before
+    //       going to sleep, or we see that it's waiting and signal it under the lock.
+    m_wake_up_pending = true;
+    if (!m_waiting_for_wake_up)
+        return;
+    QMutexLocker locker(&m_wake_up_lock);
+    m_wake_up_condition.wakeAll();
 }
 
 void CPU::queue_command(Command command)
@@ -433,8 +492,38 @@ void CPU::queue_command(Command command)
     case HardReboot:
         m_should_hard_reboot = true;
         break;
+    case DeliverInput:
+        m_should_deliver_input = true;
+        break;
+    case ChangeMedia:
+        m_should_change_media = true;
+        break;
+    case Pause:
+        m_should_pause = true;
+        break;
+    case Resume:
+        m_should_pause = false;
+        break;
+    case Stop:
+        m_should_stop = true;
+        break;
     }
     recompute_main_loop_needs_slow_stuff();
+    wake_up();
+}
+
+void CPU::deliver_input()
+{
+    m_should_deliver_input = false;
+    recompute_main_loop_needs_slow_stuff();
+    machine().input_log().deliver_pending_input(Badge<CPU>());
+}
+
+void CPU::change_media()
+{
+    m_should_change_media = false;
+    recompute_main_loop_needs_slow_stuff();
+    machine().apply_pending_media_changes(Badge<CPU>());
 }
 
 void CPU::hard_reboot()
@@ -451,16 +540,51 @@ void CPU::make_next_instruction_uninterruptible()
 
 void CPU::recompute_main_loop_needs_slow_stuff()
 {
-    m_main_loop_needs_slow_stuff = m_debugger_request != NoDebuggerRequest || m_should_hard_reboot || options.trace || !m_breakpoints.empty() || debugger().is_active() || !m_watches.isEmpty();
+    m_main_loop_needs_slow_stuff = m_debugger_request != NoDebuggerRequest || m_should_hard_reboot || m_should_deliver_input || m_should_change_media || m_should_pause || m_should_stop || options.trace || !m_breakpoints.empty() || debugger().is_active() || !m_watches.isEmpty();
+}
+
+void CPU::handle_debugger_request()
+{
+    if (m_debugger_request == PleaseEnterDebugger) {
+        debugger().enter();
+        m_debugger_request = NoDebuggerRequest;
+        recompute_main_loop_needs_slow_stuff();
+    } else if (m_debugger_request == PleaseExitDebugger) {
+        debugger().exit();
+        m_debugger_request = NoDebuggerRequest;
+        recompute_main_loop_needs_slow_stuff();
+    }
+}
+
+void CPU::wait_while_paused()
+{
+    while (m_should_pause && !m_should_stop) {
+        // Swapping disks is a common thing to do while paused.
+        if (m_should_change_media)
+            change_media();
+        wait_for_wake_up(~0ull);
+    }
 }
 
 NEVER_INLINE bool CPU::main_loop_slow_stuff()
 {
+    if (m_should_pause)
+        wait_while_paused();
+
+    if (m_should_stop)
+        return false;
+
     if (m_should_hard_reboot) {
         hard_reboot();
         return true;
     }
 
+    if (m_should_deliver_input)
+        deliver_input();
+
+    if (m_should_change_media)
+        change_media();
+
     if (!m_breakpoints.empty()) {
         for (auto& breakpoint : m_breakpoints) {
             if (get_cs() == breakpoint.selector() && get_eip() == breakpoint.offset()) {
@@ -470,15 +594,8 @@ NEVER_INLINE bool CPU::main_loop_slow_stuff()
         }
     }
 
-    if (m_debugger_request == PleaseEnterDebugger) {
-        debugger().enter();
-        m_debugger_request = NoDebuggerRequest;
-        recompute_main_loop_needs_slow_stuff();
-    } else if (m_debugger_request == PleaseExitDebugger) {
-        debugger().exit();
-        m_debugger_request = NoDebuggerRequest;
-        recompute_main_loop_needs_slow_stuff();
-    }
+    if (m_debugger_request != NoDebuggerRequest)
+        handle_debugger_request();
 
     if (debugger().is_active()) {
         save_base_address();
@@ -496,14 +613,19 @@ NEVER_INLINE bool CPU::main_loop_slow_stuff()
 
 FLATTEN void CPU::main_loop()
 {
+    auto& scheduler = machine().scheduler();
     forever
     {
         if (UNLIKELY(m_main_loop_needs_slow_stuff)) {
-            main_loop_slow_stuff();
+            if (!main_loop_slow_stuff())
+                break;
         }
 
         execute_one_instruction();
 
+        if (UNLIKELY(m_cycle >= scheduler.next_event_cycle()))
+            scheduler.run_due_events();
+
         // FIXME: An obvious optimization here would be to dispatch next insn directly from whoever put us in this state.
         // Easy to implement: just call executeOneInstruction() in e.g "POP SS"
         // I'll do this once things feel more trustworthy in general.
@@ -523,13 +645,11 @@ FLATTEN void CPU::main_loop()
 
         if (PIC::has_pending_irq() && get_if())
             PIC::service_irq(*this);
-
-#ifdef CT_DETERMINISTIC
-        if (getIF() && ((cycle() + 1) % 100 == 0)) {
-            machine().pit().raise_irq();
-        }
-#endif
     }
+
+    // We've been asked to stop. Leave things ready for the next main_loop().
+    m_should_stop = false;
+    recompute_main_loop_needs_slow_stuff();
 }
 
 void CPU::jump_relative8(i8 displacement)
@@ -1381,10 +1501,21 @@ ALWAYS_INLINE bool CPU::validate_physical_address(PhysicalAddress physical_addre
     return false;
 }
 
+template<typename T>
+ALWAYS_INLINE u8* CPU::direct_memory_pointer(PhysicalAddress physical_address)
+{
+    u32 offset = physical_address.get() - m_direct_memory_base;
+    if (physical_address.get() < m_direct_memory_base || offset + sizeof(T) > m_direct_memory_size)
+        return nullptr;
+    return &m_direct_memory[offset];
+}
+
 template<typename T>
 T CPU::read_physical_memory(PhysicalAddress physical_address)
 {
     if (!validate_physical_address<T>(physical_address, MemoryAccessType::Read)) {
+        if (auto* pointer = direct_memory_pointer<T>(physical_address))
+            return *reinterpret_cast<const T*>(pointer);
         vlog(LogCPU, "Read outside physical memory: %08x", physical_address.get());
 #ifdef DEBUG_PHYSICAL_OOB
         debugger().enter();
@@ -1408,6 +1539,10 @@ template<typename T>
 void CPU::write_physical_memory(PhysicalAddress physical_address, T data)
 {
     if (!validate_physical_address<T>(physical_address, MemoryAccessType::Write)) {
+        if (auto* pointer = direct_memory_pointer<T>(physical_address)) {
+            *reinterpret_cast<T*>(pointer) = data;
+            return;
+        }
         vlog(LogCPU, "Write outside physical memory: %08x", physical_address.get());
 #ifdef DEBUG_PHYSICAL_OOB
         debugger().enter();
@@ -1655,7 +1790,7 @@ void CPU::set_gs(u16 value)
 const u8* CPU::pointer_to_physical_memory(PhysicalAddress physical_address)
 {
     if (!validate_physical_address<u8>(physical_address, MemoryAccessType::InternalPointer))
-        return nullptr;
+        return direct_memory_pointer<u8>(physical_address);
     if (auto* provider = memory_provider_for_address(physical_address))
         return provider->memory_pointer(physical_address.get());
     return &m_memory[physical_address.get()];
@@ -1787,6 +1922,125 @@ void CPU::register_memory_provider(MemoryProvider& provider)
     }
 }
 
+// Length of the run starting at `address` that is plain RAM (if `is_ram`), or that isn't.
+u32 CPU::physical_memory_run(u32 address, u32 size, bool& is_ram)
+{
+    if (address >= m_memory_size) {
+        is_ram = false;
+        return size;
+    }
+    u32 run = std::min<u64>(size, m_memory_size - address);
+    if (address >= 1048576) {
+        is_ram = true;
+        return run;
+    }
+    run = std::min<u32>(run, memory_provider_block_size - (address % memory_provider_block_size));
+    is_ram = !memory_provider_for_address(PhysicalAddress(address));
+    return run;
+}
+
+void CPU::read_physical_memory_block(PhysicalAddress address, u8* buffer, u32 size)
+{
+    u32 offset = address.get();
+    while (size) {
+        bool is_ram;
+        u32 run = physical_memory_run(offset, size, is_ram);
+        if (is_ram) {
+            memcpy(buffer, &m_memory[offset], run);
+        } else {
+            for (u32 i = 0; i < run; ++i)
+                buffer[i] = read_physical_memory<u8>(PhysicalAddress(offset + i));
+        }
+        buffer += run;
+        offset += run;
+        size -= run;
+    }
+}
+
+void CPU::write_physical_memory_block(PhysicalAddress address, const u8* buffer, u32 size)
+{
+    u32 offset = address.get();
+    while (size) {
+        bool is_ram;
+        u32 run = physical_memory_run(offset, size, is_ram);
+        if (is_ram) {
+            memcpy(&m_memory[offset], buffer, run);
+        } else {
+            for (u32 i = 0; i < run; ++i)
+                write_physical_memory<u8>(PhysicalAddress(offset + i), buffer[i]);
+        }
+        buffer += run;
+        offset += run;
+        size -= run;
+    }
+}
+
+u32 CPU::linear_memory_run(LinearAddress address, u32 size)
+{
+    // Translation is constant within a page, and without paging, within each 1 MiB (the A20 wrap.)
+    u32 granularity = (get_pe() && get_pg()) ? 4096 : 1048576;
+    return std::min(size, granularity - (address.get() & (granularity - 1)));
+}
+
+void CPU::read_linear_memory_block(LinearAddress address, u8* buffer, u32 size)
+{
+    while (size) {
+        u32 run = linear_memory_run(address, size);
+        auto physical_address = translate_address(address, MemoryAccessType::Read);
+#ifdef A20_ENABLED
+        physical_address.mask(a20_mask());
+#endif
+        read_physical_memory_block(physical_address, buffer, run);
+        address = address.offset(run);
+        buffer += run;
+        size -= run;
+    }
+}
+
+void CPU::write_linear_memory_block(LinearAddress address, const u8* buffer, u32 size)
+{
+    while (size) {
+        u32 run = linear_memory_run(address, size);
+        auto physical_address = translate_address(address, MemoryAccessType::Write);
+#ifdef A20_ENABLED
+        physical_address.mask(a20_mask());
+#endif
+        write_physical_memory_block(physical_address, buffer, run);
+        address = address.offset(run);
+        buffer += run;
+        size -= run;
+    }
+}
+
+u8* CPU::ram_pointer(LinearAddress address, u32 size)
+{
+    if (!size || linear_memory_run(address, size) != size)
+        return nullptr;
+    auto physical_address = translate_address(address, MemoryAccessType::InternalPointer);
+#ifdef A20_ENABLED
+    physical_address.mask(a20_mask());
+#endif
+    u32 start = physical_address.get();
+    for (u32 checked = 0; checked < size;) {
+        bool is_ram;
+        checked += physical_memory_run(start + checked, size - checked, is_ram);
+        if (!is_ram)
+            return nullptr;
+    }
+    return &m_memory[start];
+}
+
+void CPU::map_direct_memory(PhysicalAddress base_address, u8* host_memory, u32 size)
+{
+    if (host_memory && base_address.get() < m_memory_size) {
+        vlog(LogConfig, "Can't map direct memory @ %08x over RAM", base_address.get());
+        ASSERT_NOT_REACHED();
+    }
+    m_direct_memory_base = base_address.get();
+    m_direct_memory = host_memory;
+    m_direct_memory_size = host_memory ? size : 0;
+}
+
 ALWAYS_INLINE MemoryProvider* CPU::memory_provider_for_address(PhysicalAddress address)
 {
     if (address.get() >= 1048576)
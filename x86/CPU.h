@@ -29,7 +29,9 @@
 #include "Instruction.h"
 #include "OwnPtr.h"
 #include "debug.h"
+#include <QtCore/QMutex>
 #include <QtCore/QVector>
+#include <QtCore/QWaitCondition>
 #include <set>
 
 class Debugger;
@@ -247,6 +249,23 @@ public:
     void register_memory_provider(MemoryProvider&);
     MemoryProvider* memory_provider_for_address(PhysicalAddress);
 
+    // Maps host memory into the physical address space above RAM (e.g the VBE linear framebuffer.)
+    // Accesses go straight to it, without any device involvement. Pass nullptr to unmap.
+    void map_direct_memory(PhysicalAddress, u8* host_memory, u32 size);
+
+    // Bulk transfers between devices and guest physical memory (DMA.)
+    // Plain RAM is copied with memcpy; ranges claimed by a memory provider go through it byte by byte.
+    void read_physical_memory_block(PhysicalAddress, u8* buffer, u32 size);
+    void write_physical_memory_block(PhysicalAddress, const u8* buffer, u32 size);
+
+    // The same for linear addresses, translating (paging, A20) once per page rather than per byte.
+    void read_linear_memory_block(LinearAddress, u8* buffer, u32 size);
+    void write_linear_memory_block(LinearAddress, const u8* buffer, u32 size);
+
+    // Host pointer to `size` bytes at a linear address, if they are one contiguous run of plain RAM
+    // (nothing in between for paging, A20 or a memory provider to get involved in.) Otherwise null.
+    u8* ram_pointer(LinearAddress, u32 size);
+
     void recompute_main_loop_needs_slow_stuff();
 
     u64 cycle() const { return m_cycle; }
@@ -719,6 +738,8 @@ public:
     template<typename T>
     bool validate_physical_address(PhysicalAddress, MemoryAccessType);
     template<typename T>
+    u8* direct_memory_pointer(PhysicalAddress);
+    template<typename T>
     void validate_address(const SegmentDescriptor&, u32 offset, MemoryAccessType);
     template<typename T>
     void validate_address(SegmentRegisterIndex, u32 offset, MemoryAccessType);
@@ -825,10 +846,22 @@ public:
     enum Command {
         ExitDebugger,
         EnterDebugger,
-        HardReboot
+        HardReboot,
+        DeliverInput,
+        ChangeMedia,
+        Pause,
+        Resume,
+        Stop,
     };
     void queue_command(Command);
 
+    // Wakes up a halted CPU so it can look for work. Can be called from any thread.
+    void wake_up();
+
+    // Lets virtual time pass until `deadline_ns` (or the next event) without running any code.
+    // For devices that know the guest is only spinning until then, e.g polling for vertical retrace.
+    void idle_until(u64 deadline_ns);
+
     static const char* register_name(CPU::RegisterIndex8) PURE;
     static const char* register_name(CPU::RegisterIndex16) PURE;
     static const char* register_name(CPU::RegisterIndex32) PURE;
@@ -1448,6 +1481,11 @@ private:
 
     void init_watches();
     void hard_reboot();
+    void deliver_input();
+    void change_media();
+    void wait_for_wake_up(u64 timeout_ns);
+    void handle_debugger_request();
+    void wait_while_paused();
 
     void update_default_sizes();
     void update_stack_size();
@@ -1581,12 +1619,20 @@ private:
     OwnPtr<Debugger> m_debugger;
 
     // One MemoryProvider* per 'memoryProviderBlockSize' bytes for the first MB of memory.
+    u32 physical_memory_run(u32 address, u32 size, bool& is_ram);
+    u32 linear_memory_run(LinearAddress, u32 size);
+
     static const size_t memory_provider_block_size = 16384;
     MemoryProvider* m_memory_providers[1048576 / memory_provider_block_size];
 
     u8* m_memory { nullptr };
     size_t m_memory_size { 0 };
 
+    // FIXME: Support more than one directly mapped region.
+    u32 m_direct_memory_base { 0 };
+    u8* m_direct_memory { nullptr };
+    u32 m_direct_memory_size { 0 };
+
     u16* m_segment_map[8];
     u32* m_control_register_map[8];
     u32* m_debug_register_map[8];
@@ -1608,6 +1654,15 @@ private:
     std::atomic<bool> m_main_loop_needs_slow_stuff { false };
     std::atomic<DebuggerRequest> m_debugger_request { NoDebuggerRequest };
     std::atomic<bool> m_should_hard_reboot { false };
+    std::atomic<bool> m_should_deliver_input { false };
+    std::atomic<bool> m_should_change_media { false };
+    std::atomic<bool> m_should_pause { false };
+    std::atomic<bool> m_should_stop { false };
+
+    QMutex m_wake_up_lock;
+    QWaitCondition m_wake_up_condition;
+    std::atomic<bool> m_wake_up_pending { false };
+    std::atomic<bool> m_waiting_for_wake_up { false };
 
     QVector<WatchedAddress> m_watches;
 
@@ -23,6 +23,8 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "CPU.h"
+#include "EventScheduler.h"
+#include "machine.h"
 #include "pic.h"
 
 template<typename F>
@@ -38,6 +40,8 @@ void CPU::doOnceOrRepeatedly(Instruction& insn, bool care_about_zf, F func)
         }
         func();
         ++m_cycle;
+        if (UNLIKELY(m_cycle >= machine().scheduler().next_event_cycle()))
+            machine().scheduler().run_due_events();
         decrement_cx_for_address_size();
         if (care_about_zf) {
             if (insn.rep_prefix() == Prefix::REPZ && !get_zf())